@@ -0,0 +1,281 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bind.h"
+#include "parser.h"
+
+#define DEFAULT_BUCKETS 64
+
+// binder walks the tree in the order of translation.
+struct binder {
+    const char *filename;
+    struct ast *ast;
+    struct symbol_table *table;
+    size_t first; // First symbol of this tree
+    const char *scope; // Qualified name of the innermost labeled sheet
+    struct node **unresolved;
+    size_t n_unresolved;
+    size_t unresolved_capacity;
+    bool failed;
+};
+
+// FNV-1a
+size_t hash_name(const char *name, size_t len) {
+    size_t h = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+size_t *find_bucket(size_t *buckets, size_t n_buckets, struct symbol *symbols, const char *name, size_t len) {
+    size_t mask = n_buckets - 1;
+
+    for (size_t i = hash_name(name, len) & mask;; i = (i + 1) & mask) {
+        if (buckets[i] == 0)
+            return &buckets[i];
+
+        const char *s = symbols[buckets[i] - 1].name;
+
+        if (strncmp(s, name, len) == 0 && s[len] == '\0')
+            return &buckets[i];
+    }
+}
+
+struct symbol *find_symbol(struct symbol_table *t, const char *name) {
+    return find_symbol_view(t, string_view(name));
+}
+
+struct symbol *find_symbol_view(struct symbol_table *t, struct view name) {
+    size_t *bucket = find_bucket(t->buckets, t->n_buckets, t->symbols, name.s, name.len);
+
+    if (*bucket == 0)
+        return NULL;
+    return &t->symbols[*bucket - 1];
+}
+
+bool grow_buckets(struct symbol_table *t) {
+    size_t n_buckets = t->n_buckets * 2;
+    size_t *buckets = calloc(n_buckets, sizeof (size_t));
+
+    if (buckets == NULL)
+        return false;
+    for (size_t i = 0; i < t->size; i++)
+        *find_bucket(buckets, n_buckets, t->symbols, t->symbols[i].name, strlen(t->symbols[i].name)) = i + 1;
+    free(t->buckets);
+    t->buckets = buckets;
+    t->n_buckets = n_buckets;
+    return true;
+}
+
+// intern adds the qualified name unless it is there already. The first
+// definition wins. Function returns index of the symbol or -1 on failure.
+int intern(struct symbol_table *t, char *name, size_t n) {
+    size_t *bucket = find_bucket(t->buckets, t->n_buckets, t->symbols, name, strlen(name));
+
+    if (*bucket != 0) {
+        free(name);
+        return *bucket - 1;
+    }
+
+    if (t->size == t->capacity) {
+        size_t capacity = t->capacity == 0 ? 16 : t->capacity * 2;
+        void *ptr = realloc(t->symbols, capacity * sizeof (struct symbol));
+
+        if (ptr == NULL) {
+            free(name);
+            return -1;
+        }
+        t->symbols = ptr;
+        t->capacity = capacity;
+    }
+    t->symbols[t->size] = (struct symbol) {.name = name, .node = n};
+    *bucket = ++t->size;
+
+    // Keep the load under a half
+    if (t->size * 2 > t->n_buckets && !grow_buckets(t))
+        return -1;
+    return t->size - 1;
+}
+
+// qualify appends the label to the scope.
+char *qualify(const char *scope, struct view label) {
+    size_t scope_len = scope == NULL ? 0 : strlen(scope);
+    char *name = calloc(scope_len + label.len + 2, sizeof (char));
+
+    if (name == NULL)
+        return NULL;
+    if (scope_len > 0) {
+        memcpy(name, scope, scope_len);
+        name[scope_len++] = '.';
+    }
+    memcpy(&name[scope_len], label.s, label.len);
+    return name;
+}
+
+void add_unresolved(struct binder *b, struct node *n) {
+    if (b->n_unresolved == b->unresolved_capacity) {
+        size_t capacity = b->unresolved_capacity == 0 ? 16 : b->unresolved_capacity * 2;
+        void *ptr = realloc(b->unresolved, capacity * sizeof (struct node *));
+
+        if (ptr == NULL) {
+            b->failed = true;
+            return;
+        }
+        b->unresolved = ptr;
+        b->unresolved_capacity = capacity;
+    }
+    b->unresolved[b->n_unresolved++] = n;
+}
+
+void bind_node(struct binder *b, size_t index) {
+    struct node *n = &b->ast->nodes[index];
+
+
+    switch (n->type) {
+
+    case NODE_TYPE_SHEET:
+    {
+        struct sheet *s = &n->u.sheet;
+        const char *scope = b->scope;
+
+        if (s->label.len > 0) {
+            char *name = qualify(scope, s->label);
+            int symbol = name == NULL ? -1 : intern(b->table, name, index);
+
+            if (symbol < 0) {
+                b->failed = true;
+                return;
+            }
+            s->symbol = symbol;
+            b->scope = b->table->symbols[symbol].name;
+        }
+        for (size_t i = 0; i < n->n; i++)
+            bind_node(b, b->ast->children[n->first + i]);
+        b->scope = scope;
+        break;
+    }
+
+    case NODE_TYPE_REFERENCE:
+    {
+        struct symbol *s = find_symbol_view(b->table, n->u.reference.label);
+
+        // Sheets of the trees bound before are known by their symbol only
+        n->u.reference.symbol = s == NULL ? -1 : s - b->table->symbols;
+        n->u.reference.target = s == NULL || (size_t) n->u.reference.symbol < b->first ? 0 : s->node;
+        if (s == NULL)
+            add_unresolved(b, n);
+        break;
+    }
+
+    case NODE_TYPE_CRATE:
+    case NODE_TYPE_LEGATO:
+    case NODE_TYPE_CHORD:
+    case NODE_TYPE_VOICES:
+        for (size_t i = 0; i < n->n; i++)
+            bind_node(b, b->ast->children[n->first + i]);
+        break;
+
+    default:
+        break;
+    }
+}
+
+// report lists the unresolved references. The ones defined later are told
+// apart.
+char *report(struct binder *b) {
+    const char *unresolved = "%s: error: unresolved reference {%.*s}\n";
+    const char *early = "%s: error: reference {%.*s} comes before its definition\n";
+    size_t len = 0;
+
+    for (size_t i = 0; i < b->n_unresolved; i++)
+        len += strlen(early) + strlen(b->filename) + b->unresolved[i]->u.reference.label.len;
+
+    char *err = calloc(len + 1, sizeof (char));
+
+    if (err == NULL)
+        return NULL;
+
+    for (size_t i = 0, end = 0; i < b->n_unresolved; i++) {
+        struct view label = b->unresolved[i]->u.reference.label;
+        const char *format = find_symbol_view(b->table, label) != NULL ? early : unresolved;
+
+        end += snprintf(&err[end], len + 1 - end, format, b->filename, (int) label.len, label.s);
+    }
+    return err;
+}
+
+void free_symbol_table(struct symbol_table *t) {
+    if (t == NULL)
+        return;
+    for (size_t i = 0; i < t->size; i++)
+        free(t->symbols[i].name);
+    free(t->symbols);
+    free(t->buckets);
+    free(t);
+}
+
+struct symbol_table *new_symbol_table() {
+    struct symbol_table *t = calloc(1, sizeof (struct symbol_table));
+
+    if (t == NULL)
+        return NULL;
+
+    t->n_buckets = DEFAULT_BUCKETS;
+    t->buckets = calloc(t->n_buckets, sizeof (size_t));
+    if (t->buckets == NULL) {
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+struct bind_result bind_more(const char *filename, struct ast *a, struct symbol_table *t) {
+    struct binder b = {
+        .filename = filename,
+        .ast = a,
+        .table = t,
+        .first = t->size,
+        .scope = NULL,
+        .unresolved = NULL,
+        .n_unresolved = 0,
+        .unresolved_capacity = 0,
+        .failed = false,
+    };
+    char *err = NULL;
+
+    bind_node(&b, a->root);
+    if (b.n_unresolved > 0)
+        err = report(&b);
+    free(b.unresolved);
+
+    if (b.failed) {
+        free(err);
+        return (struct bind_result) {.symbols = NULL,.err = NULL};
+    }
+    return (struct bind_result) {.symbols = t,.err = err};
+}
+
+struct bind_result bind(const char *filename, struct ast *a) {
+    struct symbol_table *t = new_symbol_table();
+
+    if (t == NULL)
+        return (struct bind_result) {.symbols = NULL,.err = NULL};
+
+    struct bind_result res = bind_more(filename, a, t);
+
+    if (res.symbols == NULL)
+        free_symbol_table(t);
+    return res;
+}
+
+void free_bind_result(struct bind_result *b) {
+    free_symbol_table(b->symbols);
+    b->symbols = NULL;
+    free(b->err);
+    b->err = NULL;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "parser.h"
+
+// symbol is a labeled sheet under its fully qualified name, e.g. main.label.
+struct symbol {
+    char *name;
+    size_t node; // Index of the sheet in the tree it was defined in
+};
+
+// symbol_table interns the qualified names. Symbols are kept in the order of
+// definition and looked up through an open addressing hash table.
+struct symbol_table {
+    struct symbol *symbols;
+    size_t size;
+    size_t capacity;
+    size_t *buckets; // Index of the symbol plus one, 0 marks an empty bucket
+    size_t n_buckets;
+};
+
+struct bind_result {
+    struct symbol_table *symbols;
+    char *err;
+};
+
+// bind resolves labels of the tree. Every labeled sheet gets its symbol and
+// every reference is pointed at the sheet it refers to. A reference has to
+// come after the definition of its sheet; unresolved references are reported
+// in `err` one per line.
+struct bind_result bind(const char *filename, struct ast *a);
+void free_bind_result(struct bind_result *b);
+
+// bind_more binds a tree of a score read in pieces. References may point to
+// sheets of the pieces bound before into `t`; they get the symbol and no
+// target then. Symbols of the tree are added to `t`, which the result refers
+// to but doesn't own: its symbols are NULL when out of memory.
+struct bind_result bind_more(const char *filename, struct ast *a, struct symbol_table *t);
+
+struct symbol_table *new_symbol_table();
+void free_symbol_table(struct symbol_table *t);
+
+// find_symbol returns the symbol of the qualified name or NULL.
+struct symbol *find_symbol(struct symbol_table *t, const char *name);
+struct symbol *find_symbol_view(struct symbol_table *t, struct view name);
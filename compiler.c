@@ -0,0 +1,885 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "korlessa.h"
+#include "bind.h"
+#include "parser.h"
+#include "compiler.h"
+
+#define DEFAULT_CODE_CAPACITY 64
+
+// code is a growable run of instructions. Every function is compiled into its
+// own run and moved into the bytecode once it is complete.
+struct code {
+    struct instruction *ins;
+    size_t size;
+    size_t capacity;
+};
+
+bool code_append(struct code *c, struct instruction i) {
+    if (c->size == c->capacity) {
+        size_t capacity = c->capacity == 0 ? DEFAULT_CODE_CAPACITY : c->capacity * 2;
+        void *ptr = realloc(c->ins, capacity * sizeof (struct instruction));
+
+        if (ptr == NULL)
+            return false;
+        c->ins = ptr;
+        c->capacity = capacity;
+    }
+    c->ins[c->size++] = i;
+    return true;
+}
+
+// definition is what a reference needs to know about a labeled sheet.
+struct definition {
+    bool defined;
+    size_t function;
+
+    // State the sheet leaves behind
+    bool has_note;
+    int channel;
+    int octave;
+    int velocity;
+};
+
+// fraction is a duration as an exact part of a whole note, in lowest terms.
+struct fraction {
+    uint64_t num;
+    uint64_t den;
+};
+
+// Terms are kept below the limit so their products don't overflow
+#define FRACTION_LIMIT (UINT64_C(1) << 31)
+
+// compiler keeps the part of the context which is known while compiling.
+// Everything depending on the number of iterations is left to the VM.
+struct compiler {
+    struct ast *ast;
+    struct bytecode *b;
+    struct symbol_table *symbols;
+    struct definition *definitions; // One per symbol
+    size_t n_definitions;
+    struct fraction whole; // Duration of one element
+    bool has_note;
+    int channel;
+    int octave;
+    int velocity;
+    bool timed; // Something taking time was compiled, a bpm comes after tick 0
+    bool failed;
+};
+
+uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b != 0) {
+        uint64_t r = a % b;
+
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+// scale_fraction multiplies the fraction by units/duration. Past the limit
+// the fraction is rounded, it's far off grid by then anyway.
+struct fraction scale_fraction(struct fraction f, int units, int duration) {
+    uint64_t num = f.num * (uint64_t) units;
+    uint64_t den = f.den * (uint64_t) duration;
+    uint64_t g = gcd(num, den);
+
+    if (g > 0) {
+        num /= g;
+        den /= g;
+    }
+    while (num >= FRACTION_LIMIT || den >= FRACTION_LIMIT) {
+        num >>= 1;
+        den = den > 1 ? den >> 1 : 1;
+    }
+    return (struct fraction) {.num = num,.den = den};
+}
+
+// pulse_for returns the ticks in a quarter note the fraction needs to be a
+// whole number of ticks, 0 if none does.
+uint64_t pulse_for(struct fraction f) {
+    return f.den == 0 ? 0 : f.den / gcd(f.den, 4);
+}
+
+// on_grid tells whether the fraction is a whole number of ticks.
+bool on_grid(struct fraction f, unsigned int ppq) {
+    return f.den != 0 && (4 * (uint64_t) ppq * f.num) % f.den == 0;
+}
+
+// Duration of the fraction in ticks, rounded to the nearest one
+unsigned int compute_duration(struct fraction f, unsigned int ppq) {
+    if (f.den == 0)
+        return 0;
+
+    uint64_t ticks = (8 * (uint64_t) ppq * f.num + f.den) / (2 * f.den);
+
+    return ticks > UINT_MAX ? UINT_MAX : ticks;
+}
+
+// choose_pulse goes through the sheets in the order of the score and raises
+// `ppq` to fit each, unless it would get past the maximum.
+void choose_pulse(struct ast *a, struct node *n, struct fraction whole, unsigned int *ppq) {
+    if (n->type == NODE_TYPE_SHEET) {
+        whole = scale_fraction(whole, n->u.sheet.units, n->u.sheet.duration);
+
+        uint64_t need = pulse_for(whole);
+
+        if (need > 0 && need <= MAX_PULSE_PER_QUARTER) {
+            uint64_t lcm = *ppq / gcd(*ppq, need) * need;
+
+            if (lcm <= MAX_PULSE_PER_QUARTER)
+                *ppq = lcm;
+        }
+    }
+    for (size_t i = 0; i < n->n; i++)
+        choose_pulse(a, child(a, n, i), whole, ppq);
+}
+
+// off_grid records the sheet at `at` as off grid.
+void off_grid(struct compiler *c, struct position at) {
+    struct bytecode *b = c->b;
+
+    if (b->n_off_grid == b->off_grid_capacity) {
+        size_t capacity = b->off_grid_capacity == 0 ? 16 : b->off_grid_capacity * 2;
+        void *ptr = realloc(b->off_grid, capacity * sizeof (struct position));
+
+        if (ptr == NULL) {
+            c->failed = true;
+            return;
+        }
+        b->off_grid = ptr;
+        b->off_grid_capacity = capacity;
+    }
+    b->off_grid[b->n_off_grid++] = at;
+}
+
+int letter_value(char letter) {
+    switch (letter) {
+    case 'C':
+    case 'c':
+        return 0;
+    case 'D':
+    case 'd':
+        return 2;
+    case 'E':
+    case 'e':
+        return 4;
+    case 'F':
+    case 'f':
+        return 5;
+    case 'G':
+    case 'g':
+        return 7;
+    case 'A':
+    case 'a':
+        return 9;
+    case 'B':
+    case 'b':
+        return 11;
+    }
+    // unreachable
+    assert(0);
+    return -1;
+}
+
+unsigned char midi_value(char letter, struct view accidental, int octave) {
+    int offset = 0;
+
+    for (size_t i = 0; i < accidental.len; i++) {
+        if (accidental.s[i] == '#') {
+            offset++;
+        } else if (accidental.s[i] == 'b') {
+            offset--;
+        }
+    }
+
+    return letter_value(letter) + offset + 12 * octave;
+}
+
+// new_function reserves a slot in the function table. Address is filled in
+// when the body is complete.
+size_t new_function(struct compiler *c, unsigned int step) {
+    struct bytecode *b = c->b;
+
+    if (b->n_functions == b->functions_capacity) {
+        size_t capacity = b->functions_capacity == 0 ? 16 : b->functions_capacity * 2;
+        void *ptr = realloc(b->functions, capacity * sizeof (struct function));
+
+        if (ptr == NULL) {
+            c->failed = true;
+            return 0;
+        }
+        b->functions = ptr;
+        b->functions_capacity = capacity;
+    }
+    b->functions[b->n_functions] = (struct function) {.label = NULL, .address = 0, .step = step};
+    return b->n_functions++;
+}
+
+// link_code moves finished code into the bytecode and returns its address.
+size_t link_code(struct compiler *c, struct code *code) {
+    struct bytecode *b = c->b;
+    size_t address = b->size;
+
+    if (b->size + code->size > b->capacity) {
+        size_t capacity = b->capacity == 0 ? DEFAULT_CODE_CAPACITY : b->capacity;
+
+        while (capacity < b->size + code->size)
+            capacity *= 2;
+
+        void *ptr = realloc(b->code, capacity * sizeof (struct instruction));
+
+        if (ptr == NULL) {
+            c->failed = true;
+            return 0;
+        }
+        b->code = ptr;
+        b->capacity = capacity;
+    }
+    memcpy(&b->code[b->size], code->ins, code->size * sizeof (struct instruction));
+    b->size += code->size;
+    return address;
+}
+
+void emit_instruction(struct compiler *c, struct code *code, struct instruction i) {
+    if (!code_append(code, i))
+        c->failed = true;
+}
+
+// emit_call emits the call preceded by the way it should be repeated. Sheets
+// marked `off` don't need to be run when the state they leave is known.
+void emit_call(struct compiler *c, struct code *code, size_t function, int repeat_count) {
+
+    if (repeat_count == 0 && c->b->functions[function].skippable) {
+        emit_instruction(c, code, c->b->functions[function].skip);
+        return;
+    }
+
+    // Loop is indicated by negative number of repeat_count
+    if (repeat_count < 0) {
+        emit_instruction(c, code, (struct instruction) {.op = OP_LOOP});
+    } else if (repeat_count != 1) {
+        emit_instruction(c, code, (struct instruction) {.op = OP_REPEAT,.x = repeat_count});
+    }
+    emit_instruction(c, code, (struct instruction) {.op = OP_CALL,.x = function});
+}
+
+void compile_node(struct compiler *c, struct code *code, struct node *n);
+
+// is_pure tells whether the body reads anything left by the preceding
+// elements. The first element reading the channel or the last tone has to be
+// a note; called functions have to be pure themselves.
+bool is_pure(struct compiler *c, struct code *body) {
+    bool note = false;
+
+    for (size_t i = 0; i < body->size; i++) {
+        struct instruction in = body->ins[i];
+
+        switch (in.op) {
+        case OP_NOTE:
+            note = true;
+            break;
+
+        case OP_INTERVAL:
+        case OP_TIE:
+        case OP_CC:
+        case OP_PGM:
+            if (!note)
+                return false;
+            break;
+
+        case OP_LOOP:
+        case OP_SKIP:
+            return false;
+
+        case OP_REPEAT:
+            if (in.x == 0)
+                return false;
+            break;
+
+        case OP_CALL:
+            if (!c->b->functions[in.x].pure)
+                return false;
+            note = true;
+            break;
+        }
+    }
+    return note;
+}
+
+// summarize finds the state left behind by the body. It is known unless an
+// interval or a tie comes before the first note.
+void summarize(struct compiler *c, struct code *body, struct function *f) {
+    bool note = false;
+    bool rest = false; // Rest after the last tone
+    struct instruction last = { 0 };
+
+    f->skippable = false;
+    for (size_t i = 0; i < body->size; i++) {
+        struct instruction in = body->ins[i];
+
+        switch (in.op) {
+        case OP_NOTE:
+            note = true;
+            rest = false;
+            last = in;
+            break;
+
+        case OP_INTERVAL:
+            if (!note)
+                return;
+            rest = false;
+            break;
+
+        case OP_TIE:
+            if (!note)
+                return;
+            break;
+
+        case OP_REST:
+            rest = true;
+            break;
+
+        case OP_CALL:
+        case OP_SKIP:
+        {
+            struct instruction skip = in.op == OP_SKIP ? in : c->b->functions[in.x].skip;
+
+            if (in.op == OP_CALL && !c->b->functions[in.x].skippable)
+                return;
+            if (skip.x & SKIP_NOTE) {
+                note = true;
+                rest = false;
+                last = skip;
+            }
+            if (skip.x & SKIP_REST)
+                rest = true;
+            break;
+        }
+        }
+    }
+
+    f->skippable = true;
+    f->skip = (struct instruction) {
+        .op = OP_SKIP,
+        .a = last.a,
+        .b = last.b,
+        .c = last.c,
+        .x = (note ? SKIP_NOTE : 0) | (rest ? SKIP_REST : 0),
+    };
+}
+
+// compile_sheet compiles body of the sheet into a new function.
+size_t compile_sheet(struct compiler *c, struct node *n) {
+    struct sheet *s = &n->u.sheet;
+    struct fraction whole = c->whole;
+    struct code body = { 0 };
+    struct definition *d = NULL;
+    bool off = s->repeat_count == 0;
+    bool timed = c->timed;
+    bool had_note = c->has_note;
+
+    c->whole = scale_fraction(whole, s->units, s->duration);
+    if (!on_grid(c->whole, c->b->ppq))
+        off_grid(c, s->at);
+
+    size_t function = new_function(c, compute_duration(c->whole, c->b->ppq));
+
+    if (c->failed)
+        return 0;
+
+    // First definition of the label wins
+    if (s->symbol >= 0 && !c->definitions[s->symbol].defined) {
+        const char *name = c->symbols->symbols[s->symbol].name;
+        char *label = calloc(strlen(name) + 1, sizeof (char));
+
+        if (label == NULL) {
+            c->failed = true;
+        } else {
+            c->b->functions[function].label = strcpy(label, name);
+        }
+        d = &c->definitions[s->symbol];
+        d->defined = true;
+        d->function = function;
+    }
+
+    // Only a note of the body sets the state a reference leaves behind
+    c->has_note = false;
+    for (size_t i = 0; i < n->n; i++)
+        compile_node(c, &body, child(c->ast, n, i));
+    emit_instruction(c, &body, (struct instruction) {.op = OP_RET});
+
+    // An `off` sheet takes no time
+    if (off)
+        c->timed = timed;
+
+    struct function *f = &c->b->functions[function];
+
+    f->address = link_code(c, &body);
+    f->pure = is_pure(c, &body);
+    summarize(c, &body, f);
+    if (d != NULL) {
+        d->has_note = c->has_note;
+        d->channel = c->channel;
+        d->octave = c->octave;
+        d->velocity = c->velocity;
+    }
+
+    c->has_note = had_note || c->has_note;
+    c->whole = whole;
+    free(body.ins);
+    return function;
+}
+
+void compile_node(struct compiler *c, struct code *code, struct node *n) {
+
+    switch (n->type) {
+
+    case NODE_TYPE_BPM:
+        // Only a bpm at tick 0 is the tempo the score starts with
+        if (c->b->bpm == 0 && !c->timed)
+            c->b->bpm = n->u.bpm.value;
+        emit_instruction(c, code, (struct instruction) {.op = OP_TEMPO,.x = n->u.bpm.value});
+        break;
+
+    case NODE_TYPE_NOTE:
+    {
+        struct note *note = &n->u.note;
+
+        c->channel = note->channel == -1 ? c->channel : note->channel;
+        c->octave = note->octave == -1 ? c->octave : note->octave;
+        c->velocity = note->velocity == -1 ? c->velocity : note->velocity;
+        c->has_note = true;
+        c->timed = true;
+
+        unsigned char velocity = (double) c->velocity / 9. * 127.;
+
+        emit_instruction(c, code, (struct instruction) {
+             .op = OP_NOTE,
+             .a = c->channel,
+             .b = midi_value(note->letter, note->accidental, c->octave),
+             .c = velocity,
+             });
+        break;
+    }
+
+    case NODE_TYPE_INTERVAL:
+        c->timed = true;
+        emit_instruction(c, code, (struct instruction) {.op = OP_INTERVAL,.x = n->u.interval.value});
+        break;
+
+    case NODE_TYPE_REST:
+        c->timed = true;
+        emit_instruction(c, code, (struct instruction) {.op = OP_REST});
+        break;
+
+    case NODE_TYPE_TIE:
+        c->timed = true;
+        emit_instruction(c, code, (struct instruction) {.op = OP_TIE});
+        break;
+
+    case NODE_TYPE_CONTROLLER:
+        emit_instruction(c, code, (struct instruction) {.op = OP_CC,.x = n->u.controller.param,.y = n->u.controller.value});
+        break;
+
+    case NODE_TYPE_PROGRAM:
+        emit_instruction(c, code, (struct instruction) {.op = OP_PGM,.x = n->u.program.value});
+        break;
+
+    case NODE_TYPE_DIVIDER:
+        // No action for divider
+        break;
+
+    case NODE_TYPE_LEGATO:
+        // Legato is turned off on the last element
+        for (size_t i = 0; i < n->n; i++) {
+            if (i == 0 && n->n > 1)
+                emit_instruction(c, code, (struct instruction) {.op = OP_LEGATO,.a = 1});
+            if (i == n->n - 1 && n->n > 1)
+                emit_instruction(c, code, (struct instruction) {.op = OP_LEGATO,.a = 0});
+            compile_node(c, code, child(c->ast, n, i));
+        }
+        break;
+
+    case NODE_TYPE_CHORD:
+        emit_instruction(c, code, (struct instruction) {.op = OP_CHORD,.a = 1});
+        for (size_t i = 0; i < n->n; i++)
+            compile_node(c, code, child(c->ast, n, i));
+        emit_instruction(c, code, (struct instruction) {.op = OP_CHORD,.a = 0});
+        break;
+
+    case NODE_TYPE_SHEET:
+    {
+        size_t function = compile_sheet(c, n);
+
+        if (!c->failed)
+            emit_call(c, code, function, n->u.sheet.repeat_count);
+        break;
+    }
+
+    case NODE_TYPE_REFERENCE:
+    {
+        int symbol = n->u.reference.symbol;
+
+        // Unresolved references are reported by bind
+        if (symbol < 0 || !c->definitions[symbol].defined)
+            break;
+
+        struct definition *d = &c->definitions[symbol];
+
+        if (d->has_note) {
+            c->has_note = true;
+            c->channel = d->channel;
+            c->octave = d->octave;
+            c->velocity = d->velocity;
+        }
+        c->b->functions[d->function].referenced = true;
+        c->timed = c->timed || n->u.reference.repeat_count != 0;
+        emit_call(c, code, d->function, n->u.reference.repeat_count);
+        break;
+    }
+
+    case NODE_TYPE_VOICES:
+    {
+        // Every voice starts with the state the first one does
+        struct compiler start = *c;
+
+        emit_instruction(c, code, (struct instruction) {.op = OP_VOICES});
+        for (size_t i = 0; i < n->n; i++) {
+            if (i > 0) {
+                c->has_note = start.has_note;
+                c->channel = start.channel;
+                c->octave = start.octave;
+                c->velocity = start.velocity;
+                emit_instruction(c, code, (struct instruction) {.op = OP_VOICE});
+            }
+            compile_node(c, code, child(c->ast, n, i));
+        }
+        emit_instruction(c, code, (struct instruction) {.op = OP_MERGE});
+        break;
+    }
+
+    case NODE_TYPE_CRATE:
+        for (size_t i = 0; i < n->n; i++)
+            compile_node(c, code, child(c->ast, n, i));
+        break;
+
+    case NODE_TYPE_EOF:
+        emit_instruction(c, code, (struct instruction) {.op = OP_EOF});
+        break;
+
+    case NODE_TYPE_UNKNOWN:
+    default:
+        break;
+    }
+}
+
+// init_compiler sets the context a score starts with.
+struct compiler init_compiler(struct bytecode *b) {
+
+    // Default values
+    return (struct compiler) {
+        .ast = NULL,
+        .b = b,
+        .symbols = NULL,
+        .definitions = NULL,
+        .n_definitions = 0,
+        .whole = {.num = 1,.den = 1},
+        .has_note = false,
+        .channel = 0,
+        .octave = 5,
+        .velocity = 9,
+        .timed = false,
+        .failed = false,
+    };
+}
+
+// compile_top compiles the top level of the tree after the code compiled so
+// far and makes it the entry.
+void compile_top(struct compiler *c, struct ast *a, struct symbol_table *symbols) {
+    struct code top = { 0 };
+
+    // Symbols of the tree come after the ones compiled so far
+    if (symbols->size + 1 > c->n_definitions) {
+        void *ptr = realloc(c->definitions, (symbols->size + 1) * sizeof (struct definition));
+
+        if (ptr == NULL) {
+            c->failed = true;
+            return;
+        }
+        c->definitions = ptr;
+        memset(&c->definitions[c->n_definitions], 0,
+          (symbols->size + 1 - c->n_definitions) * sizeof (struct definition));
+        c->n_definitions = symbols->size + 1;
+    }
+    c->ast = a;
+    c->symbols = symbols;
+
+    compile_node(c, &top, &a->nodes[a->root]);
+    emit_instruction(c, &top, (struct instruction) {.op = OP_HALT});
+    c->b->entry = link_code(c, &top);
+    free(top.ins);
+}
+
+struct bytecode *compile(struct ast *a, struct symbol_table *symbols) {
+    struct bytecode *b = calloc(1, sizeof (struct bytecode));
+
+    if (b == NULL)
+        return NULL;
+
+    struct compiler c = init_compiler(b);
+
+    b->ppq = DEFAULT_PULSE_PER_QUARTER;
+    choose_pulse(a, &a->nodes[a->root], c.whole, &b->ppq);
+    compile_top(&c, a, symbols);
+    free(c.definitions);
+
+    if (c.failed) {
+        free_bytecode(b);
+        return NULL;
+    }
+    return b;
+}
+
+struct compiler *new_compiler() {
+    struct compiler *c = calloc(1, sizeof (struct compiler));
+    struct bytecode *b = calloc(1, sizeof (struct bytecode));
+    struct code top = { 0 };
+
+    if (c == NULL || b == NULL) {
+        free(c);
+        free(b);
+        return NULL;
+    }
+    *c = init_compiler(b);
+    b->ppq = DEFAULT_PULSE_PER_QUARTER;
+
+    // Score is empty until the first piece
+    emit_instruction(c, &top, (struct instruction) {.op = OP_HALT});
+    b->entry = link_code(c, &top);
+    free(top.ins);
+    if (c->failed) {
+        free_compiler(c);
+        return NULL;
+    }
+    return c;
+}
+
+void free_compiler(struct compiler *c) {
+    if (c == NULL)
+        return;
+    free_bytecode(c->b);
+    free(c->definitions);
+    free(c);
+}
+
+struct bytecode *compiler_bytecode(struct compiler *c) {
+    return c->b;
+}
+
+bool compile_piece(struct compiler *c, struct ast *a, struct symbol_table *symbols) {
+    compile_top(c, a, symbols);
+    c->ast = NULL;
+    return !c->failed;
+}
+
+// function_end returns the address of the RET of the function. Nested sheets
+// are functions of their own, so a body has only one.
+size_t function_end(struct bytecode *b, size_t function) {
+    size_t i = b->functions[function].address;
+
+    while (b->code[i].op != OP_RET)
+        i++;
+    return i;
+}
+
+bool prune_bytecode(struct compiler *c, size_t *map) {
+    struct bytecode *b = c->b;
+    size_t n = 0;
+    size_t size = 0;
+
+    // Nested sheets come after the sheet they are nested in
+    for (size_t i = 0; i < b->n_functions; i++)
+        map[i] = b->functions[i].label != NULL ? 0 : NO_FUNCTION;
+    for (size_t i = 0; i < b->n_functions; i++) {
+        if (map[i] == NO_FUNCTION)
+            continue;
+        map[i] = n++;
+        for (size_t j = b->functions[i].address, end = function_end(b, i); j < end; j++) {
+            if (b->code[j].op == OP_CALL && map[b->code[j].x] == NO_FUNCTION)
+                map[b->code[j].x] = 0;
+        }
+        size += function_end(b, i) + 1 - b->functions[i].address;
+    }
+
+    struct instruction *code = calloc(size == 0 ? 1 : size, sizeof (struct instruction));
+
+    if (code == NULL)
+        return false;
+
+    size = 0;
+    for (size_t i = 0; i < b->n_functions; i++) {
+        struct function f = b->functions[i];
+
+        if (map[i] == NO_FUNCTION) {
+            free(f.label);
+            continue;
+        }
+        for (size_t j = f.address, end = function_end(b, i); j <= end; j++) {
+            code[size] = b->code[j];
+            if (code[size].op == OP_CALL)
+                code[size].x = map[code[size].x];
+            size++;
+        }
+        f.address = size - (function_end(b, i) + 1 - f.address);
+        b->functions[map[i]] = f;
+    }
+
+    for (size_t i = 0; i < c->n_definitions; i++) {
+        if (c->definitions[i].defined)
+            c->definitions[i].function = map[c->definitions[i].function];
+    }
+
+    free(b->code);
+    b->code = code;
+    b->size = size;
+    b->capacity = size == 0 ? 1 : size;
+    b->n_functions = n;
+    b->entry = size;
+    return true;
+}
+
+void free_bytecode(struct bytecode *b) {
+    if (b == NULL)
+        return;
+    for (size_t i = 0; i < b->n_functions; i++)
+        free(b->functions[i].label);
+    free(b->functions);
+    free(b->code);
+    free(b->off_grid);
+    free(b);
+}
+
+void report_off_grid(struct bytecode *b, const char *filename, FILE * f) {
+    for (size_t i = 0; i < b->n_off_grid; i++) {
+        fprintf(f, "%s:%zu:%zu: warning: sheet is not in pulse at %u ticks a quarter, its steps are rounded\n",
+          filename, b->off_grid[i].line + 1, b->off_grid[i].column + 1, b->ppq);
+    }
+    b->n_off_grid = 0;
+}
+
+void print_function_name(struct bytecode *b, size_t function, FILE * f) {
+    if (b->functions[function].label != NULL) {
+        fprintf(f, "%s", b->functions[function].label);
+    } else {
+        fprintf(f, "#%zu", function);
+    }
+}
+
+void print_instruction(struct bytecode *b, struct instruction i, FILE * f) {
+
+    switch (i.op) {
+    case OP_HALT:
+        fprintf(f, "HALT");
+        break;
+
+    case OP_NOTE:
+        fprintf(f, "NOTE ch:%u n:%u v:%u", i.a, i.b, i.c);
+        break;
+
+    case OP_INTERVAL:
+        fprintf(f, "INTERVAL %d", i.x);
+        break;
+
+    case OP_REST:
+        fprintf(f, "REST");
+        break;
+
+    case OP_TIE:
+        fprintf(f, "TIE");
+        break;
+
+    case OP_CC:
+        fprintf(f, "CC p:%u v:%d", (unsigned int) i.x, i.y);
+        break;
+
+    case OP_PGM:
+        fprintf(f, "PGM %d", i.x);
+        break;
+
+    case OP_TEMPO:
+        fprintf(f, "TEMPO %d", i.x);
+        break;
+
+    case OP_LEGATO:
+        fprintf(f, "LEGATO %s", i.a ? "on" : "off");
+        break;
+
+    case OP_CHORD:
+        fprintf(f, "CHORD %s", i.a ? "on" : "off");
+        break;
+
+    case OP_REPEAT:
+        fprintf(f, "REPEAT %d", i.x);
+        break;
+
+    case OP_LOOP:
+        fprintf(f, "LOOP");
+        break;
+
+    case OP_CALL:
+        fprintf(f, "CALL ");
+        print_function_name(b, i.x, f);
+        break;
+
+    case OP_RET:
+        fprintf(f, "RET");
+        break;
+
+    case OP_EOF:
+        fprintf(f, "EOF");
+        break;
+
+    case OP_VOICES:
+        fprintf(f, "VOICES");
+        break;
+
+    case OP_VOICE:
+        fprintf(f, "VOICE");
+        break;
+
+    case OP_MERGE:
+        fprintf(f, "MERGE");
+        break;
+
+    case OP_SKIP:
+        fprintf(f, "SKIP");
+        if (i.x & SKIP_NOTE)
+            fprintf(f, " ch:%u n:%u v:%u", i.a, i.b, i.c);
+        if (i.x & SKIP_REST)
+            fprintf(f, " rest");
+        break;
+    }
+}
+
+void print_bytecode(struct bytecode *b, FILE * f) {
+    for (size_t i = 0; i < b->size; i++) {
+        if (i == b->entry)
+            fprintf(f, "main:\n");
+        for (size_t j = 0; j < b->n_functions; j++) {
+            if (b->functions[j].address == i) {
+                print_function_name(b, j, f);
+                fprintf(f, ": step %u%s\n", b->functions[j].step, b->functions[j].pure ? " pure" : "");
+            }
+        }
+        fprintf(f, "%6zu  ", i);
+        print_instruction(b, b->code[i], f);
+        fprintf(f, "\n");
+    }
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "bind.h"
+#include "parser.h"
+
+enum opcode {
+    OP_HALT = 0,
+    OP_NOTE = 1,
+    OP_INTERVAL = 2,
+    OP_REST = 3,
+    OP_TIE = 4,
+    OP_CC = 5,
+    OP_PGM = 6,
+    OP_TEMPO = 7,
+    OP_LEGATO = 8,
+    OP_REPEAT = 9,
+    OP_LOOP = 10,
+    OP_CALL = 11,
+    OP_RET = 12,
+    OP_EOF = 13,
+    OP_SKIP = 14,
+    OP_VOICES = 15,
+    OP_VOICE = 16,
+    OP_MERGE = 17,
+    OP_CHORD = 18,
+};
+
+// Flags of the SKIP instruction
+#define SKIP_NOTE 1 // Sets the last note, the channel and forgets the last tone
+#define SKIP_REST 2 // Sets the rest flag
+
+// instruction is one step of the compiled score. Operands by opcode:
+//   NOTE      a: channel, b: note, c: velocity
+//   INTERVAL  x: semitones
+//   CC        x: param, y: value
+//   PGM       x: program
+//   TEMPO     x: bpm
+//   LEGATO    a: 1 turns legato on, 0 turns it off
+//   CHORD     a: 1 starts a chord, its tones share one offset, 0 ends it and
+//             moves on by one step
+//   REPEAT    x: iterations of the next CALL, 0 runs it without output
+//   LOOP      next CALL loops
+//   CALL      x: function to call
+//   SKIP      a, b, c: last note as in NOTE, x: SKIP_ flags
+//   VOICES    opens voices, they start at the same offset
+//   VOICE     next voice starts where and as the first one did
+//   MERGE     closes voices at the end of the longest one, events are merged
+//             by tick
+struct instruction {
+    unsigned char op;
+    unsigned char a;
+    unsigned char b;
+    unsigned char c;
+    int x;
+    int y;
+};
+
+// function is a compiled sheet. A sheet is compiled once no matter how many
+// times it is repeated or referenced. The divider is folded into `step`.
+// Output of a pure function doesn't depend on the state it is called with
+// (it starts with a note, has no loops and no `off` sheets), so all its
+// iterations look the same.
+struct function {
+    char *label; // Full dotted label, NULL for anonymous sheets
+    size_t address;
+    unsigned int step; // Duration of one element in ticks
+    bool pure;
+    bool referenced;
+
+    // State left behind, `off` calls are replaced by it when it is known
+    bool skippable;
+    struct instruction skip;
+};
+
+struct bytecode {
+    struct instruction *code;
+    size_t size;
+    size_t capacity;
+    struct function *functions;
+    size_t n_functions;
+    size_t functions_capacity;
+    size_t entry; // Address of the top level code
+    unsigned int ppq; // Ticks in a quarter note
+    int bpm; // Tempo of a bpm statement at tick 0, 0 if there is none
+
+    // Sheets whose elements don't take a whole number of ticks, their steps
+    // are rounded
+    struct position *off_grid;
+    size_t n_off_grid;
+    size_t off_grid_capacity;
+};
+
+// compile turns the bound tree into bytecode. Notes get their channel, octave
+// and velocity resolved here, the tree itself is left untouched. Durations
+// are kept as exact fractions of a whole note; `ppq` is the smallest multiple
+// of DEFAULT_PULSE_PER_QUARTER up to MAX_PULSE_PER_QUARTER which makes every
+// step a whole number of ticks, sheets which still don't fit are off grid.
+struct bytecode *compile(struct ast *a, struct symbol_table *symbols);
+void free_bytecode(struct bytecode *b);
+
+// report_off_grid prints a warning for each sheet off grid and forgets them,
+// so every one is reported once.
+void report_off_grid(struct bytecode *b, const char *filename, FILE * f);
+
+// NO_FUNCTION marks a function dropped by prune_bytecode.
+#define NO_FUNCTION ((size_t) -1)
+
+// compiler compiles a score read in pieces into one bytecode, which it owns.
+// The context a piece leaves behind (channel, octave, velocity and labeled
+// sheets) is where the next one starts.
+struct compiler;
+
+// new_compiler starts with an empty score, its entry is a HALT. Pieces to
+// come are not known, so the score keeps DEFAULT_PULSE_PER_QUARTER.
+struct compiler *new_compiler();
+void free_compiler(struct compiler *c);
+struct bytecode *compiler_bytecode(struct compiler *c);
+
+// compile_piece compiles the top level of the next bound piece after the code
+// compiled so far and ends it with HALT. The entry of the bytecode is moved to
+// the piece. Function returns false when out of memory.
+bool compile_piece(struct compiler *c, struct ast *a, struct symbol_table *symbols);
+
+// prune_bytecode drops the code which can't be called anymore once the
+// pieces compiled so far have been run: everything but labeled sheets and
+// the sheets nested in them. `map` has room for every function and gets its
+// new index or NO_FUNCTION. Function returns false when out of memory.
+bool prune_bytecode(struct compiler *c, size_t *map);
+
+// debug functions
+void print_bytecode(struct bytecode *b, FILE * f);
@@ -1,4 +1,9 @@
 #pragma once
 
 #define DEFAULT_CLIENT_NAME "Korlessa"
-#define PULSE_PER_QUARTER 96
+
+// Ticks in a quarter note. A score gets the smallest multiple of the default
+// which times all of its sheets exactly, up to the maximum. Ticks of a four
+// hours long score at 240 bpm still fit 32 bits with the maximum.
+#define DEFAULT_PULSE_PER_QUARTER 96
+#define MAX_PULSE_PER_QUARTER 65536
@@ -71,10 +71,32 @@ enum {
   MPC_INPUT_MEM_NUM = 512
 };
 
-typedef struct {
+/* Errors are made all the time, they have to fit too */
+typedef union {
   char mem[64];
+  mpc_err_t err;
 } mpc_mem_t;
 
+/* Result of a memoized parser at a position. The table is a cache of the
+** latest results, which is where backtracking looks for them. Errors are
+** packed in the heap, the ones merged on the way as well as the one of a
+** failure. */
+typedef struct {
+  mpc_parser_t *p;
+  long pos;
+  int success;
+  int errors;
+  mpc_state_t state;
+  char last;
+  mpc_val_t *output;
+  mpc_err_t *error;
+  mpc_err_t *furthest;
+} mpc_memo_t;
+
+enum {
+  MPC_INPUT_MEMO_NUM = 256
+};
+
 typedef struct {
 
   int type;
@@ -95,9 +117,12 @@ typedef struct {
   char last;
 
   size_t mem_index;
+  size_t mem_used;
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
 
+  mpc_memo_t *memo;
+
 } mpc_input_t;
 
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
@@ -124,8 +149,11 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->last = '\0';
 
   i->mem_index = 0;
+  i->mem_used = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo = NULL;
+
   return i;
 }
 
@@ -154,8 +182,11 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->last = '\0';
 
   i->mem_index = 0;
+  i->mem_used = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo = NULL;
+
   return i;
 
 }
@@ -183,8 +214,11 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->last = '\0';
 
   i->mem_index = 0;
+  i->mem_used = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo = NULL;
+
   return i;
 
 }
@@ -211,11 +245,24 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->last = '\0';
 
   i->mem_index = 0;
+  i->mem_used = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo = NULL;
+
   return i;
 }
 
+static void mpc_memo_delete(mpc_input_t *i) {
+  size_t j;
+  if (i->memo == NULL) { return; }
+  for (j = 0; j < MPC_INPUT_MEMO_NUM; j++) {
+    free(i->memo[j].error);
+    free(i->memo[j].furthest);
+  }
+  free(i->memo);
+}
+
 static void mpc_input_delete(mpc_input_t *i) {
 
   free(i->filename);
@@ -225,6 +272,7 @@ static void mpc_input_delete(mpc_input_t *i) {
 
   free(i->marks);
   free(i->lasts);
+  mpc_memo_delete(i);
   free(i);
 }
 
@@ -238,13 +286,15 @@ static void *mpc_malloc(mpc_input_t *i, size_t n) {
   size_t j;
   char *p;
 
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+  /* A full pool is not searched */
+  if (n > sizeof(mpc_mem_t) || i->mem_used == MPC_INPUT_MEM_NUM) { return malloc(n); }
 
   j = i->mem_index;
   do {
     if (!i->mem_full[i->mem_index]) {
       p = (void*)(i->mem + i->mem_index);
       i->mem_full[i->mem_index] = 1;
+      i->mem_used++;
       i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
       return p;
     }
@@ -264,6 +314,7 @@ static void mpc_free(mpc_input_t *i, void *p) {
   size_t j;
   if (!mpc_mem_ptr(i, p)) { free(p); return; }
   j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
+  if (i->mem_full[j]) { i->mem_used--; }
   i->mem_full[j] = 0;
 }
 
@@ -601,7 +652,7 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
+static __thread char char_unescape_buffer[4];
 
 static const char *mpc_err_char_unescape(char c) {
 
@@ -738,66 +789,6 @@ static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expecte
   return 0;
 }
 
-static void mpc_err_add_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
-  (void)i;
-  x->expected_num++;
-  x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-  x->expected[x->expected_num-1] = mpc_malloc(i, strlen(expected) + 1);
-  strcpy(x->expected[x->expected_num-1], expected);
-}
-
-static mpc_err_t *mpc_err_or(mpc_input_t *i, mpc_err_t** x, int n) {
-
-  int j, k, fst;
-  mpc_err_t *e;
-
-  fst = -1;
-  for (j = 0; j < n; j++) {
-    if (x[j] != NULL) { fst = j; }
-  }
-
-  if (fst == -1) { return NULL; }
-
-  e = mpc_malloc(i, sizeof(mpc_err_t));
-  e->state = mpc_state_invalid();
-  e->expected_num = 0;
-  e->expected = NULL;
-  e->failure = NULL;
-  e->filename = mpc_malloc(i, strlen(x[fst]->filename)+1);
-  strcpy(e->filename, x[fst]->filename);
-
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    if (x[j]->state.pos > e->state.pos) { e->state = x[j]->state; }
-  }
-
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    if (x[j]->state.pos < e->state.pos) { continue; }
-
-    if (x[j]->failure) {
-      e->failure = mpc_malloc(i, strlen(x[j]->failure)+1);
-      strcpy(e->failure, x[j]->failure);
-      break;
-    }
-
-    e->received = x[j]->received;
-
-    for (k = 0; k < x[j]->expected_num; k++) {
-      if (!mpc_err_contains_expected(i, e, x[j]->expected[k])) {
-        mpc_err_add_expected(i, e, x[j]->expected[k]);
-      }
-    }
-  }
-
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    mpc_err_delete_internal(i, x[j]);
-  }
-
-  return e;
-}
-
 static mpc_err_t *mpc_err_repeat(mpc_input_t *i, mpc_err_t *x, const char *prefix) {
 
   int j = 0;
@@ -872,11 +863,119 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
   return y;
 }
 
+/* Keeps the error further in the input, errors at the same position are
+** joined into x. Nothing is copied, the parts of y are moved. */
 static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
-  mpc_err_t *errs[2];
-  errs[0] = x;
-  errs[1] = y;
-  return mpc_err_or(i, errs, 2);
+
+  int k;
+
+  if (x == NULL) { return y; }
+  if (y == NULL) { return x; }
+  if (y->state.pos > x->state.pos) { mpc_err_delete_internal(i, x); return y; }
+  if (y->state.pos < x->state.pos || x->failure) { mpc_err_delete_internal(i, y); return x; }
+
+  if (y->failure) {
+    x->failure = y->failure;
+    y->failure = NULL;
+    mpc_err_delete_internal(i, y);
+    return x;
+  }
+
+  x->received = y->received;
+
+  for (k = 0; k < y->expected_num; k++) {
+    if (!mpc_err_contains_expected(i, x, y->expected[k])) {
+      x->expected_num++;
+      x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
+      x->expected[x->expected_num-1] = y->expected[k];
+      y->expected[k] = NULL;
+    }
+  }
+
+  mpc_err_delete_internal(i, y);
+  return x;
+}
+
+/*
+** Memo Table
+*/
+
+/* Packs an error into a single heap block to keep in the memo table */
+static mpc_err_t *mpc_err_pack(mpc_err_t *x) {
+  int j;
+  size_t l = sizeof(mpc_err_t) + sizeof(char*) * x->expected_num;
+  mpc_err_t *y;
+  char *s;
+
+  l += strlen(x->filename) + 1 + (x->failure ? strlen(x->failure) + 1 : 0);
+  for (j = 0; j < x->expected_num; j++) { l += strlen(x->expected[j]) + 1; }
+
+  y = malloc(l);
+  *y = *x;
+  y->expected = x->expected_num > 0 ? (char**)(y + 1) : NULL;
+  s = (char*)(y + 1) + sizeof(char*) * x->expected_num;
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = strcpy(s, x->expected[j]); s += strlen(s) + 1;
+  }
+  y->filename = strcpy(s, x->filename); s += strlen(s) + 1;
+  y->failure = x->failure ? strcpy(s, x->failure) : NULL;
+  return y;
+}
+
+static char *mpc_strdup(mpc_input_t *i, const char *s) {
+  if (s == NULL) { return NULL; }
+  return strcpy(mpc_malloc(i, strlen(s) + 1), s);
+}
+
+/* Copies a packed error back into the input */
+static mpc_err_t *mpc_err_unpack(mpc_input_t *i, mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL || i->suppress) { return NULL; }
+  y = mpc_malloc(i, sizeof(mpc_err_t));
+  *y = *x;
+  y->filename = mpc_strdup(i, x->filename);
+  y->failure = mpc_strdup(i, x->failure);
+  y->expected = NULL;
+  if (x->expected_num > 0) {
+    y->expected = mpc_malloc(i, sizeof(char*) * x->expected_num);
+    for (j = 0; j < x->expected_num; j++) { y->expected[j] = mpc_strdup(i, x->expected[j]); }
+  }
+  return y;
+}
+
+static mpc_memo_t *mpc_memo_slot(mpc_input_t *i, mpc_parser_t *p, long pos) {
+  size_t h = ((size_t)p / sizeof(void*)) * 31 + (size_t)pos;
+  h *= 2654435761u;
+  return &i->memo[(h ^ (h >> 15)) % MPC_INPUT_MEMO_NUM];
+}
+
+static mpc_memo_t *mpc_memo_find(mpc_input_t *i, mpc_parser_t *p, long pos) {
+  mpc_memo_t *m;
+  if (i->memo == NULL) { return NULL; }
+  m = mpc_memo_slot(i, p, pos);
+  return m->p == p && m->pos == pos ? m : NULL;
+}
+
+/* Keeps the result of p at pos in place of whatever had the slot */
+static void mpc_memo_add(mpc_input_t *i, mpc_parser_t *p, long pos, int success, mpc_result_t *r, mpc_err_t *furthest) {
+  mpc_memo_t *m;
+  if (i->memo == NULL) {
+    i->memo = calloc(MPC_INPUT_MEMO_NUM, sizeof(mpc_memo_t));
+    if (i->memo == NULL) { return; }
+  }
+  m = mpc_memo_slot(i, p, pos);
+  free(m->error);
+  free(m->furthest);
+  m->p = p;
+  m->pos = pos;
+  m->success = success;
+  m->errors = !i->suppress;
+  m->state = i->state;
+  m->last = i->last;
+  m->output = success ? r->output : NULL;
+  m->error = !success && r->error ? mpc_err_pack(r->error) : NULL;
+  m->furthest = furthest ? mpc_err_pack(furthest) : NULL;
 }
 
 /*
@@ -917,7 +1016,10 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_APPLY_VIEW = 29,
+  MPC_TYPE_MEMO       = 30
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -933,6 +1035,7 @@ typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_t
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_t f; char *e; } mpc_pdata_check_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; char *e; } mpc_pdata_check_with_t;
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
+typedef struct { mpc_parser_t *x; } mpc_pdata_memo_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
@@ -952,6 +1055,7 @@ typedef union {
   mpc_pdata_check_t check;
   mpc_pdata_check_with_t check_with;
   mpc_pdata_predict_t predict;
+  mpc_pdata_memo_t memo;
   mpc_pdata_not_t not;
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
@@ -977,11 +1081,15 @@ static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { r
 
 static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
   int j;
-  size_t l = 0;
+  size_t l = 0, end;
   if (n == 0) { return mpc_calloc(i, 1, 1); }
   for (j = 0; j < n; j++) { l += strlen(xs[j]); }
+  end = strlen(xs[0]);
   xs[0] = mpc_realloc(i, xs[0], l + 1);
-  for (j = 1; j < n; j++) { strcat(xs[0], xs[j]); mpc_free(i, xs[j]); }
+  for (j = 1; j < n; j++) {
+    size_t m = strlen(xs[j]);
+    memcpy((char*)xs[0] + end, xs[j], m + 1); end += m; mpc_free(i, xs[j]);
+  }
   return xs[0];
 }
 
@@ -1030,6 +1138,12 @@ static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t
   return f(mpc_export(i, x), d);
 }
 
+static mpc_val_t *mpc_parse_apply_view(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
+  mpc_val_t *y = f(x);
+  mpc_free(i, x);
+  return y;
+}
+
 static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   if (d == free) { mpc_free(i, x); return; }
   d(mpc_export(i, x));
@@ -1047,6 +1161,38 @@ enum {
 
 #define MPC_MAX_RECURSION_DEPTH 1000
 
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth);
+
+/* Runs the parser of a memo once at each position of a string. Later runs
+** hand out the same result and make the same errors on the way. */
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+
+  int x;
+  long pos = i->state.pos;
+  mpc_err_t *furthest = NULL;
+  mpc_memo_t *m;
+
+  if (i->type != MPC_INPUT_STRING || !i->backtrack) {
+    return mpc_parse_run(i, p->data.memo.x, r, e, depth+1);
+  }
+
+  m = mpc_memo_find(i, p, pos);
+  if (m && (m->errors || i->suppress)) {
+    *e = mpc_err_merge(i, *e, mpc_err_unpack(i, m->furthest));
+    if (m->success) {
+      i->state = m->state;
+      i->last = m->last;
+      MPC_SUCCESS(m->output);
+    }
+    MPC_FAILURE(mpc_err_unpack(i, m->error));
+  }
+
+  x = mpc_parse_run(i, p->data.memo.x, r, &furthest, depth+1);
+  mpc_memo_add(i, p, pos, x, r, furthest);
+  *e = mpc_err_merge(i, *e, furthest);
+  return x;
+}
+
 static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
   int j = 0, k = 0;
@@ -1092,6 +1238,13 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         MPC_FAILURE(r->output);
       }
 
+    case MPC_TYPE_APPLY_VIEW:
+      if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
+        MPC_SUCCESS(mpc_parse_apply_view(i, p->data.apply.f, r->output));
+      } else {
+        MPC_FAILURE(r->output);
+      }
+
     case MPC_TYPE_APPLY_TO:
       if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
         MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
@@ -1143,6 +1296,8 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         MPC_FAILURE(r->error);
       }
 
+    case MPC_TYPE_MEMO: return mpc_parse_memo(i, p, r, e, depth);
+
     /* Optional Parsers */
 
     /* TODO: Update Not Error Message */
@@ -1252,21 +1407,16 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
       if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
-
+      /* Alternatives are tried one at a time, one result will do */
       for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        if (mpc_parse_run(i, p->data.or.xs[j], &results_stk[0], e, depth+1)) {
+          MPC_SUCCESS(results_stk[0].output);
         } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
+          *e = mpc_err_merge(i, *e, results_stk[0].error);
         }
       }
 
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      MPC_FAILURE(NULL);
 
     case MPC_TYPE_AND:
 
@@ -1411,8 +1561,10 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
       break;
 
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
+    case MPC_TYPE_APPLY_VIEW: mpc_undefine_unretained(p->data.apply.x, 0);  break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
 
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1519,8 +1671,10 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       break;
 
     case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
+    case MPC_TYPE_APPLY_VIEW: p->data.apply.x  = mpc_copy(a->data.apply.x);    break;
     case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
     case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    case MPC_TYPE_MEMO:     p->data.memo.x     = mpc_copy(a->data.memo.x);     break;
 
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1812,6 +1966,14 @@ mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
   return p;
 }
 
+mpc_parser_t *mpc_apply_view(mpc_parser_t *a, mpc_apply_t f) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_APPLY_VIEW;
+  p->data.apply.x = a;
+  p->data.apply.f = f;
+  return p;
+}
+
 mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_APPLY_TO;
@@ -1883,6 +2045,13 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_memo(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  return p;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -2656,16 +2825,19 @@ mpc_val_t *mpcf_all_free(int n, mpc_val_t** xs) {
 
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
   int i;
-  size_t l = 0;
+  size_t l = 0, end;
 
   if (n == 0) { return calloc(1, 1); }
 
   for (i = 0; i < n; i++) { l += strlen(xs[i]); }
 
+  end = strlen(xs[0]);
   xs[0] = realloc(xs[0], l + 1);
 
+  /* Appended at the end, strcat would scan the string again each time */
   for (i = 1; i < n; i++) {
-    strcat(xs[0], xs[i]); free(xs[i]);
+    size_t m = strlen(xs[i]);
+    memcpy((char*)xs[0] + end, xs[i], m + 1); end += m; free(xs[i]);
   }
 
   return xs[0];
@@ -2776,8 +2948,10 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   }
 
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_VIEW) { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -3862,8 +4036,10 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
 
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_VIEW) { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { return 1 + mpc_nodecount_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
@@ -3912,10 +4088,12 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
 
   if (p->type == MPC_TYPE_EXPECT)     { mpc_optimise_unretained(p->data.expect.x, 0); }
   if (p->type == MPC_TYPE_APPLY)      { mpc_optimise_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_VIEW) { mpc_optimise_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO)   { mpc_optimise_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)       { mpc_optimise_unretained(p->data.memo.x, 0); }
   if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
@@ -129,6 +129,8 @@ mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *e);
 mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...);
 mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f);
 mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x);
+/* Like mpc_apply but f only reads the value, which is released by mpc */
+mpc_parser_t *mpc_apply_view(mpc_parser_t *a, mpc_apply_t f);
 mpc_parser_t *mpc_check(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *e);
 mpc_parser_t *mpc_check_with(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *e);
 mpc_parser_t *mpc_checkf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *fmt, ...);
@@ -147,6 +149,10 @@ mpc_parser_t *mpc_or(int n, ...);
 mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
+/* Parses a at most once at each position of a string, the result is kept
+** for the rest of the parse and handed out again as it is. Only for parsers
+** whose outputs are never freed, such as plain values. */
+mpc_parser_t *mpc_memo(mpc_parser_t *a);
 
 /*
 ** Common Parsers
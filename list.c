@@ -98,39 +98,125 @@ void *list_drop_apply(void *list, void (*f)(void *)) {
     return NULL;
 }
 
-struct list *swap(struct list *l1, struct list *l2) {
-    void *tmp = l2->next;
+// merge_sort is a bottom-up merge sort. It merges runs of doubling width and
+// never recurses, so long lists don't blow up the stack. Pointer to the last
+// element is stored into `tail`.
+static struct list *merge_sort(struct list *list, bool (*f)(void *, void *), struct list **tail) {
 
-    l2->next = l1;
-    l1->next = tmp;
-    return l2;
+    if (list == NULL) {
+        *tail = NULL;
+        return NULL;
+    }
+
+    for (size_t width = 1;; width *= 2) {
+        struct list *p = list;
+        struct list *last = NULL;
+        size_t merges = 0;
+
+        list = NULL;
+        while (p != NULL) {
+            struct list *q = p;
+            size_t psize = 0;
+            size_t qsize = width;
+
+            merges++;
+            for (size_t i = 0; i < width && q != NULL; i++, q = q->next)
+                psize++;
+
+            while (psize > 0 || (qsize > 0 && q != NULL)) {
+                struct list *e;
+
+                // Take from the right run only if it strictly belongs first
+                if (psize == 0) {
+                    e = q;
+                    q = q->next;
+                    qsize--;
+                } else if (qsize == 0 || q == NULL || !f(p, q)) {
+                    e = p;
+                    p = p->next;
+                    psize--;
+                } else {
+                    e = q;
+                    q = q->next;
+                    qsize--;
+                }
+
+                if (last != NULL) {
+                    last->next = e;
+                } else {
+                    list = e;
+                }
+                last = e;
+            }
+            p = q;
+        }
+        last->next = NULL;
+
+        if (merges <= 1) {
+            *tail = last;
+            return list;
+        }
+    }
 }
 
 void *list_sort(void *list, bool (*f)(void *, void *)) {
+    struct list *tail;
 
-    int size = list_size(list);
-    struct list anchor = {.next = list };
+    return merge_sort(list, f, &tail);
+}
 
-    for (size_t i = 0; i < size; i++) {
+void list_handle_append(struct list_handle *h, void *new_entry) {
+    struct list *e = new_entry;
 
-        struct list *head = &anchor;
-        bool swapped = false;
+    e->next = NULL;
+    if (h->tail == NULL) {
+        h->head = e;
+    } else {
+        ((struct list *) h->tail)->next = e;
+    }
+    h->tail = e;
+    h->size++;
+}
 
-        for (size_t j = 0; j < size - i - 1; j++) {
+void list_handle_push(struct list_handle *h, void *new_entry) {
+    struct list *e = new_entry;
 
-            struct list *actual = head->next;
-            struct list *next = actual->next;
+    e->next = h->head;
+    h->head = e;
+    if (h->tail == NULL)
+        h->tail = e;
+    h->size++;
+}
 
-            if (f(actual, next)) {
-                head->next = swap(actual, next);
-                head = next;
-                swapped = true;
-            } else {
-                head = actual;
-            }
-        }
-        if (!swapped)
-            break;
+void *list_handle_pop(struct list_handle *h) {
+    struct list *e = h->head;
+
+    if (e == NULL)
+        return NULL;
+    h->head = e->next;
+    if (h->head == NULL)
+        h->tail = NULL;
+    h->size--;
+    e->next = NULL;
+    return e;
+}
+
+void list_handle_splice(struct list_handle *h, struct list_handle *other) {
+    if (other->head == NULL)
+        return;
+    if (h->tail == NULL) {
+        h->head = other->head;
+    } else {
+        ((struct list *) h->tail)->next = other->head;
     }
-    return anchor.next;
+    h->tail = other->tail;
+    h->size += other->size;
+    *other = (struct list_handle) { 0 };
+}
+
+void list_handle_sort(struct list_handle *h, bool (*f)(void *, void *)) {
+    struct list *tail;
+
+    h->head = merge_sort(h->head, f, &tail);
+    h->tail = tail;
 }
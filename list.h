@@ -1,11 +1,20 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct list {
     void *next;
 };
 
+// list_handle keeps both ends of a list together with its size, so appending,
+// pushing, popping and splicing run in constant time.
+struct list_handle {
+    void *head;
+    void *tail;
+    size_t size;
+};
+
 // list_append inserts the `new_entry` on the end of the list and returns the
 // head of the `list`. If `list` is empty it returns `new_entry`.
 void *list_append(void *list, void *new_entry);
@@ -41,6 +50,24 @@ void list_apply_ctx(void *list, void (*f)(void *, void *), void *ctx);
 // head of the`list`, or NULL if nothing left.
 void *list_drop_apply(void *list, void (*f)(void *));
 
-// list_sort performs stupid bubble sort on top of `list`. The `f` should
-// return true or false based on comparing condition.
+// list_sort performs stable merge sort on top of `list` and returns the new
+// head. The `f` should return true if the first argument belongs after the
+// second one.
 void *list_sort(void *list, bool (*f)(void *, void *));
+
+// list_handle_append inserts the `new_entry` on the end of the list.
+void list_handle_append(struct list_handle *h, void *new_entry);
+
+// list_handle_push inserts the `new_entry` on the beginning of the list.
+void list_handle_push(struct list_handle *h, void *new_entry);
+
+// list_handle_pop removes the first element of the list and returns it, or
+// NULL if the list is empty.
+void *list_handle_pop(struct list_handle *h);
+
+// list_handle_splice moves all the elements of `other` to the end of `h`.
+// The `other` is left empty.
+void list_handle_splice(struct list_handle *h, struct list_handle *other);
+
+// list_handle_sort sorts the list the same way as list_sort does.
+void list_handle_sort(struct list_handle *h, bool (*f)(void *, void *));
@@ -1,12 +1,16 @@
 #include <argp.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
-#include "list.h"
+#include "bind.h"
+#include "compiler.h"
 #include "listing.h"
 #include "parser.h"
 #include "scheduler.h"
+#include "stream.h"
 #include "translator.h"
 
 #define OPT_DEBUG 1
@@ -14,6 +18,12 @@
 #define OPT_PRINT_EVENTS 3
 #define OPT_CLIENT 4
 #define OPT_PORT 5
+#define OPT_PRINT_BYTECODE 6
+#define OPT_HORIZON 7
+#define OPT_POOL 8
+#define OPT_REALTIME 9
+#define OPT_CPU 10
+#define OPT_MEASURE 11
 
 const char *argp_program_version = "v0.1";
 const char *argp_program_bug_address = "<geomodular@gmail.com>";
@@ -23,12 +33,19 @@ static struct argp_option options[] = {
     {"debug", OPT_DEBUG, 0, 0, "Print additional debug info."},
     {"print-ast", OPT_PRINT_AST, 0, 0, "Print ast produced by parser and quit."},
     {"print-events", OPT_PRINT_EVENTS, 0, 0, "Print translated midi events and quit."},
+    {"print-bytecode", OPT_PRINT_BYTECODE, 0, 0, "Print compiled bytecode and quit."},
     {"list", 'l', 0, 0, "List clients and ports to connect to."},
     {"file", 'f', "FILENAME", 0, "Use file as an input instead of stdin."},
     {"source", 's', "CODE", 0, "Use this input instead of stdin."},
     {"connect-to", 'c', "ADDRESS", 0, "Device address to connect to in a <client>:<port> format."},
     {"client", OPT_CLIENT, "CLIENT_ID", 0, "Client id to connect to."},
     {"port", OPT_PORT, "PORT_ID", 0, "Port of the client to connect to."},
+    {"horizon", OPT_HORIZON, "MS", 0, "Keep the queue this many milliseconds ahead, 250 by default."},
+    {"pool", OPT_POOL, "EVENTS", 0, "Size of the output pool in events, 128 by default."},
+    {"realtime", OPT_REALTIME, "PRIORITY", OPTION_ARG_OPTIONAL,
+      "Lock memory and play under SCHED_FIFO at this priority, 50 by default."},
+    {"cpu", OPT_CPU, "CPU", 0, "Pin the playback thread to this cpu, with --realtime."},
+    {"measure", OPT_MEASURE, 0, 0, "Measure how late events are played and print it at the end."},
     {0}
 };
 
@@ -36,12 +53,14 @@ struct arguments {
     bool debug;
     bool print_ast;
     bool print_events;
+    bool print_bytecode;
     bool list_clients;
     char *filepath;
     char *source;
     char *address;
     int client;
     int port;
+    struct schedule_options schedule;
 };
 
 struct arguments init_arguments() {
@@ -49,12 +68,22 @@ struct arguments init_arguments() {
         .debug = false,
         .print_ast = false,
         .print_events = false,
+        .print_bytecode = false,
         .list_clients = false,
         .filepath = NULL,
         .source = NULL,
         .address = NULL,
         .client = 0,
         .port = 0,
+        .schedule = {
+            .horizon = DEFAULT_HORIZON,
+            .pool = DEFAULT_POOL_SIZE,
+            .debug = false,
+            .realtime = false,
+            .priority = DEFAULT_PRIORITY,
+            .cpu = -1,
+            .measure = false,
+        },
     };
 }
 
@@ -64,6 +93,7 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     switch (key) {
     case OPT_DEBUG:
         arguments->debug = true;
+        arguments->schedule.debug = true;
         break;
 
     case OPT_PRINT_AST:
@@ -74,6 +104,10 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         arguments->print_events = true;
         break;
 
+    case OPT_PRINT_BYTECODE:
+        arguments->print_bytecode = true;
+        break;
+
     case 'l':
         arguments->list_clients = true;
         break;
@@ -94,6 +128,58 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         arguments->port = atoi(arg);
         break;
 
+    case OPT_HORIZON:
+    {
+        int horizon = atoi(arg);
+
+        if (horizon <= 0)
+            argp_error(state, "invalid horizon: %s should be a number of milliseconds", arg);
+        arguments->schedule.horizon = horizon;
+        break;
+    }
+
+    case OPT_POOL:
+    {
+        int pool = atoi(arg);
+
+        if (pool <= 0)
+            argp_error(state, "invalid pool size: %s should be a number of events", arg);
+        arguments->schedule.pool = pool;
+        break;
+    }
+
+    case OPT_REALTIME:
+    {
+        int min = sched_get_priority_min(SCHED_FIFO);
+        int max = sched_get_priority_max(SCHED_FIFO);
+
+        arguments->schedule.realtime = true;
+        if (arg == NULL)
+            break;
+
+        int priority = atoi(arg);
+
+        if (priority < min || priority > max)
+            argp_error(state, "invalid priority: %s should be between %d and %d", arg, min, max);
+        arguments->schedule.priority = priority;
+        break;
+    }
+
+    case OPT_MEASURE:
+        arguments->schedule.measure = true;
+        break;
+
+    case OPT_CPU:
+    {
+        char *end = NULL;
+        long cpu = strtol(arg, &end, 10);
+
+        if (end == arg || *end != '\0' || cpu < 0 || cpu >= sysconf(_SC_NPROCESSORS_CONF))
+            argp_error(state, "invalid cpu: %s", arg);
+        arguments->schedule.cpu = cpu;
+        break;
+    }
+
     case 'c':
     {
         char *token = NULL;
@@ -114,8 +200,11 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 
     case ARGP_KEY_END:
         if (arguments->client == 0 &&
-          arguments->print_ast == false && arguments->print_events == false && arguments->list_clients == false)
+          arguments->print_ast == false && arguments->print_events == false && arguments->print_bytecode == false &&
+          arguments->list_clients == false)
             argp_failure(state, EXIT_FAILURE, 0, "use -c to connect to device");
+        if (arguments->schedule.cpu >= 0 && !arguments->schedule.realtime)
+            argp_error(state, "--cpu needs --realtime");
         break;
 
     default:
@@ -127,7 +216,7 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 
 static struct argp argp = { options, parse_opt, 0, doc, 0, 0, 0 };
 
-char *read_stdin();
+int play_stream(int client, int port, struct schedule_options options);
 
 int main(int argc, char **argv) {
 
@@ -139,11 +228,16 @@ int main(int argc, char **argv) {
         return list_devices();
     }
 
-    struct parser p = new_parser();
+    // Score from stdin is played as it comes, unless it is only printed
+    if (args.source == NULL && args.filepath == NULL && !args.print_ast && !args.print_bytecode && !args.print_events)
+        return play_stream(args.client, args.port, args.schedule);
+
     struct parse_result res;
+    const char *filename = "<stdin>";
 
     if (args.source) {
-        res = parse("<arg>", p, args.source);
+        filename = "<arg>";
+        res = parse(filename, args.source);
     } else if (args.filepath) {
         FILE *f = fopen(args.filepath, "r");
 
@@ -151,80 +245,106 @@ int main(int argc, char **argv) {
             fprintf(stderr, "failed opening file: %s\n", args.filepath);
             goto FAIL_1;
         }
-        res = parse_file(args.filepath, p, f);
+        filename = args.filepath;
+        res = parse_file(filename, f);
         fclose(f);
     } else {
-        char *in = read_stdin();
-
-        if (in == NULL) {
-            fprintf(stderr, "failed reading from stdin\n");
-            goto FAIL_1;
-        }
-        res = parse("<stdin>", p, in);
-        free(in);
+        res = parse_file(filename, stdin);
     }
 
     if (res.err != NULL) {
         fprintf(stderr, "%s", res.err);
         goto FAIL_2;
     }
+    if (res.ast == NULL) {
+        fprintf(stderr, "failed parsing score\n");
+        goto FAIL_2;
+    }
 
     if (args.print_ast) {
-        print_ast(res.n, stdout);
+        print_ast(res.ast, stdout);
         printf("\n");
         goto SUCCESS_2;
     }
 
-    struct event_list *list = translate(*res.n);
+    struct bind_result bound = bind(filename, res.ast);
+
+    if (bound.symbols == NULL) {
+        fprintf(stderr, "failed binding labels\n");
+        goto FAIL_2;
+    }
+    if (bound.err != NULL) {
+        fprintf(stderr, "%s", bound.err);
+        goto FAIL_3;
+    }
+
+    struct bytecode *b = compile(res.ast, bound.symbols);
+
+    if (b == NULL) {
+        fprintf(stderr, "failed compiling score\n");
+        goto FAIL_3;
+    }
+    report_off_grid(b, filename, stderr);
+
+    if (args.print_bytecode) {
+        print_bytecode(b, stdout);
+        goto SUCCESS_4;
+    }
 
     if (args.print_events) {
+        struct event_buffer *list = translate(b);
+
+        if (list == NULL) {
+            fprintf(stderr, "failed translating events\n");
+            goto FAIL_4;
+        }
         print_events(list, stdout);
         printf("\n");
-        goto SUCCESS_3;
+        free_event_buffer(list);
+        goto SUCCESS_4;
+    }
+
+    struct translator *t = new_translator(b);
+
+    if (t == NULL) {
+        fprintf(stderr, "failed preparing translator\n");
+        goto FAIL_4;
     }
     // Up to this point there should be no memory leaks
-    if (schedule_and_loop(list, args.client, args.port) == EXIT_FAILURE) {
-        goto FAIL_3;
+    if (schedule_and_loop(t, NULL, args.client, args.port, args.schedule) == EXIT_FAILURE) {
+        goto FAIL_5;
     }
 
-SUCCESS_3:
-    list_apply(list, free);
+    free_translator(t);
+SUCCESS_4:
+    free_bytecode(b);
+    free_bind_result(&bound);
 SUCCESS_2:
     free_parse_result(&res);
-    free_parser(&p);
     return EXIT_SUCCESS;
 
+FAIL_5:
+    free_translator(t);
+FAIL_4:
+    free_bytecode(b);
 FAIL_3:
-    list_apply(list, free);
+    free_bind_result(&bound);
 FAIL_2:
     free_parse_result(&res);
 FAIL_1:
-    free_parser(&p);
     return EXIT_FAILURE;
 }
 
-char *read_stdin() {
-    size_t buffer_size = 1024, i = 0;
-    char *buffer = calloc(sizeof (char), buffer_size + 1);
-
-    if (buffer == NULL)
-        return NULL;
+int play_stream(int client, int port, struct schedule_options options) {
+    struct stream *s = new_stream("<stdin>", STDIN_FILENO);
 
-    for (int c = getchar(); c != EOF; c = getchar()) {
-        if (i == buffer_size) {
-            buffer_size += 1024;
-            void *ptr = realloc(buffer, buffer_size * sizeof (char) + 1);
-
-            if (ptr != NULL) {
-                buffer = (char *) ptr;
-            } else {
-                free(buffer);
-                return NULL;
-            }
-        }
-        buffer[i++] = c; // possible data lost?
+    if (s == NULL) {
+        fprintf(stderr, "failed preparing stream\n");
+        return EXIT_FAILURE;
     }
 
-    buffer[i] = '\0';
-    return buffer;
+    int ret = schedule_and_loop(s->translator, s, client, port, options);
+
+    free_stream(s);
+    return ret;
 }
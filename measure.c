@@ -0,0 +1,67 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include "measure.h"
+
+// bucket returns the bucket of `us`.
+size_t bucket(uint64_t us) {
+    if (us < HISTOGRAM_EXACT)
+        return us;
+
+    int e = 63;
+
+    while (!(us >> e & 1))
+        e--;
+    // 2^e <= us < 2^(e+1), split by the bits below the highest one
+    return HISTOGRAM_EXACT + (e - 6) * HISTOGRAM_SPLIT + (us >> (e - 5) & (HISTOGRAM_SPLIT - 1));
+}
+
+// bucket_floor returns the lowest value of bucket `b`.
+uint64_t bucket_floor(size_t b) {
+    if (b < HISTOGRAM_EXACT)
+        return b;
+
+    size_t e = (b - HISTOGRAM_EXACT) / HISTOGRAM_SPLIT + 6;
+    uint64_t split = (b - HISTOGRAM_EXACT) % HISTOGRAM_SPLIT;
+
+    return ((uint64_t) 1 << e) + (split << (e - 5));
+}
+
+void init_histogram(struct histogram *h, const char *name) {
+    memset(h, 0, sizeof (struct histogram));
+    h->name = name;
+}
+
+void histogram_add(struct histogram *h, uint64_t us) {
+    h->counts[bucket(us)]++;
+    h->n++;
+    if (us > h->max)
+        h->max = us;
+}
+
+uint64_t histogram_percentile(struct histogram *h, double p) {
+    if (h->n == 0)
+        return 0;
+    if (p >= 100)
+        return h->max;
+
+    // Rank of the value, counted from 1
+    uint64_t rank = (uint64_t) (p / 100 * h->n);
+    uint64_t seen = 0;
+
+    if (rank < p / 100 * h->n)
+        rank++;
+    if (rank == 0)
+        rank = 1;
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank)
+            return bucket_floor(b);
+    }
+    return h->max;
+}
+
+void print_histogram(struct histogram *h, FILE * f) {
+    fprintf(f, "%s: %" PRIu64 " samples, p50 %" PRIu64 "us, p99 %" PRIu64 "us, max %" PRIu64 "us\n", h->name, h->n,
+      histogram_percentile(h, 50), histogram_percentile(h, 99), h->max);
+}
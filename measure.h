@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Values below HISTOGRAM_EXACT are counted one by one, above it every power
+// of two is split into HISTOGRAM_SPLIT buckets, so a value is off by at most
+// 1/HISTOGRAM_SPLIT of itself.
+#define HISTOGRAM_EXACT 64
+#define HISTOGRAM_SPLIT 32
+#define HISTOGRAM_BUCKETS (HISTOGRAM_EXACT + (64 - 6) * HISTOGRAM_SPLIT)
+
+// histogram counts microseconds. It is of fixed size, adding a value never
+// allocates.
+struct histogram {
+    const char *name;
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t n;
+    uint64_t max;
+};
+
+void init_histogram(struct histogram *h, const char *name);
+void histogram_add(struct histogram *h, uint64_t us);
+
+// histogram_percentile returns the lowest value of the bucket holding the
+// `p`th percentile, 0 < p <= 100, or the maximum for 100.
+uint64_t histogram_percentile(struct histogram *h, double p);
+
+// print_histogram prints the p50, p99 and the maximum on one line.
+void print_histogram(struct histogram *h, FILE * f);
@@ -1,7 +1,45 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "lib/mpc.h"
 #include "parser.h"
+#include "reader.h"
+
+#define DEFAULT_NODES 256
+#define DEFAULT_STRING_BLOCK 4096
+#define PIECE_SIZE (1 << 20) // Scores larger than this are read by all processors
+
+// Folds pass nodes around as their indices, 0 (no node) reads as NULL
+#define AS_VAL(i) ((mpc_val_t *) (uintptr_t) (i))
+#define AS_INDEX(x) ((size_t) (uintptr_t) (x))
+
+// Numbers and characters are passed as values too, so no token needs a heap
+// allocation of its own
+#define INT_VAL(v) ((mpc_val_t *) (intptr_t) (v))
+#define AS_INT(x) ((int) (intptr_t) (x))
+
+struct string_block {
+    struct string_block *next;
+    size_t size;
+    size_t capacity;
+    char data[];
+};
+
+// Tree being built by parse_mpc(), the folds have no other way to reach it.
+// Each thread builds its own.
+static __thread struct ast *tree = NULL;
+
+// The grammar is built once per process on first use and shared by every
+// parser, mpc only reads it while parsing
+static struct parser grammar;
+static pthread_once_t grammar_once = PTHREAD_ONCE_INIT;
 
 
 mpc_val_t *bpm_fold(int n, mpc_val_t ** xs);
@@ -10,23 +48,52 @@ mpc_val_t *interval_fold(int n, mpc_val_t ** xs);
 mpc_val_t *sheet_fold(int n, mpc_val_t ** xs);
 mpc_val_t *node_fold(int n, mpc_val_t ** xs);
 mpc_val_t *reference_fold(int n, mpc_val_t ** xs);
-mpc_val_t *duration_fold(int n, mpc_val_t ** xs);
-mpc_val_t *repeater_fold(int n, mpc_val_t ** xs);
 mpc_val_t *controller_fold(int n, mpc_val_t ** xs);
 mpc_val_t *program_fold(int n, mpc_val_t ** xs);
 mpc_val_t *ctor_int_default();
 mpc_val_t *ctor_one();
+mpc_val_t *ctor_empty();
+mpc_val_t *view_int(mpc_val_t * x);
+mpc_val_t *view_char(mpc_val_t * x);
+mpc_val_t *view_string(mpc_val_t * x);
 mpc_val_t *apply_rest(mpc_val_t * x);
 mpc_val_t *apply_tie(mpc_val_t * x);
 mpc_val_t *apply_divider(mpc_val_t * x);
 mpc_val_t *apply_eof(mpc_val_t * x);
-mpc_val_t *apply_as_duration(mpc_val_t * x);
 mpc_val_t *apply_loop(mpc_val_t * x);
 mpc_val_t *apply_off(mpc_val_t * x);
 mpc_val_t *apply_legato(mpc_val_t * x);
-void free_node(mpc_val_t * x);
+mpc_val_t *apply_chord(mpc_val_t * x);
+mpc_val_t *apply_voices(mpc_val_t * x);
+void drop_node(mpc_val_t * x);
+
+// number_parser reads digits as int
+mpc_parser_t *number_parser() {
+    return mpc_apply_view(mpc_digits(), view_int);
+}
+
+// integer_parser is number_parser named as mpc_int()
+mpc_parser_t *integer_parser() {
+    return mpc_expect(number_parser(), "integer");
+}
+
+void build_grammar();
+void free_grammar();
 
 struct parser new_parser() {
+    pthread_once(&grammar_once, build_grammar);
+    return grammar;
+}
+
+void free_parser(struct parser *p) {
+
+    if (p == NULL)
+        return;
+
+    *p = (struct parser) { 0 };
+}
+
+void build_grammar() {
 
     mpc_parser_t *note = mpc_new("note");
     mpc_parser_t *rest = mpc_new("rest");
@@ -42,105 +109,132 @@ struct parser new_parser() {
     mpc_parser_t *sheet = mpc_new("sheet");
     mpc_parser_t *legato = mpc_new("legato");
     mpc_parser_t *parser = mpc_new("parser");
+    mpc_parser_t *number = mpc_new("number");
+    mpc_parser_t *voices = mpc_new("voices");
+    mpc_parser_t *chord = mpc_new("chord");
+
+    // Number of a bpm or of sheet units, the one tried second at a position
+    // takes what the first read
+    mpc_define(number, mpc_memo(number_parser()));
 
     // Note: ch2:c#4
-    mpc_parser_t *channel = mpc_and(3, mpcf_snd_free, mpc_string("ch"), mpc_int(), mpc_char(':'), free, free);
-    mpc_parser_t *letter = mpc_oneof("cdefgabCDEFGAB");
-    mpc_parser_t *accidental = mpc_many1(mpcf_strfold, mpc_oneof("#b"));
-    mpc_parser_t *octave = mpc_int();
-    mpc_parser_t *velocity = mpc_apply(mpc_and(2, mpcf_snd_free, mpc_char('!'), mpc_digit(), free), mpcf_int);
+    mpc_parser_t *channel = mpc_and(3, mpcf_snd_free, mpc_string("ch"), integer_parser(), mpc_char(':'), free, mpcf_dtor_null);
+    mpc_parser_t *letter = mpc_apply_view(mpc_oneof("cdefgabCDEFGAB"), view_char);
+    mpc_parser_t *accidental = mpc_apply_view(mpc_many1(mpcf_strfold, mpc_oneof("#b")), view_string);
+    mpc_parser_t *octave = integer_parser();
+    mpc_parser_t *velocity = mpc_and(2, mpcf_snd_free, mpc_char('!'), mpc_apply_view(mpc_digit(), view_int), free);
 
     mpc_define(note, mpc_and(5, note_fold,
         mpc_maybe_lift(channel, ctor_int_default),
         letter,
-        mpc_maybe_lift(accidental, mpcf_ctor_str),
-        mpc_maybe_lift(octave, ctor_int_default), mpc_maybe_lift(velocity, ctor_int_default), free, free, free, free));
+        mpc_maybe_lift(accidental, ctor_empty),
+        mpc_maybe_lift(octave, ctor_int_default), mpc_maybe_lift(velocity, ctor_int_default),
+        mpcf_dtor_null, mpcf_dtor_null, mpcf_dtor_null, mpcf_dtor_null));
 
     // Bpm: 120bpm
     mpc_parser_t *bpm = mpc_and(2, bpm_fold,
-      mpc_digits(),
-      mpc_string("bpm"),
-      free);
+      number,
+      mpc_apply(mpc_string("bpm"), mpcf_free),
+      mpcf_dtor_null);
 
     // Rest: .
-    mpc_define(rest, mpc_apply(mpc_char('.'), apply_rest));
+    mpc_define(rest, mpc_apply_view(mpc_char('.'), apply_rest));
 
     // Tie: -
-    mpc_define(tie, mpc_apply(mpc_char('-'), apply_tie));
+    mpc_define(tie, mpc_apply_view(mpc_char('-'), apply_tie));
 
     // Divider: |
-    mpc_define(divider, mpc_apply(mpc_char('|'), apply_divider));
+    mpc_define(divider, mpc_apply_view(mpc_char('|'), apply_divider));
 
     // Control change: cc9:129
     mpc_define(controller, mpc_and(4, controller_fold,
-        mpc_or(2, mpc_string("cc"), mpc_string("CC")), mpc_digits(), mpc_char(':'), mpc_int(), free, free, free));
+        mpc_apply(mpc_or(2, mpc_string("cc"), mpc_string("CC")), mpcf_free),
+        number_parser(), mpc_apply(mpc_char(':'), mpcf_free), integer_parser(),
+        mpcf_dtor_null, mpcf_dtor_null, mpcf_dtor_null));
 
     // Program change: pgm12
-    mpc_define(program, mpc_and(2, program_fold, mpc_or(2, mpc_string("pgm"), mpc_string("PGM")), mpc_digits(), free));
+    mpc_define(program, mpc_and(2, program_fold,
+        mpc_apply(mpc_or(2, mpc_string("pgm"), mpc_string("PGM")), mpcf_free), number_parser(), mpcf_dtor_null));
 
     // Comment: // comment
-    mpc_define(comment, mpc_and(2, mpcf_all_free, mpc_string("//"), mpc_many1(mpcf_strfold, mpc_noneof("\n")), free));
+    mpc_define(comment, mpc_apply(mpc_and(2, mpcf_strfold, mpc_string("//"), mpc_many1(mpcf_strfold, mpc_noneof("\n")), free),
+        mpcf_free));
 
     // Reference: {label} {label1.label2}
     mpc_define(reference, mpc_and(2, reference_fold,
-        mpc_tok_brackets(mpc_and(2, mpcf_strfold,
-            mpc_ident(),
-            mpc_many(mpcf_strfold,
-              mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_ident(), free)), free), free), repeater, free));
+        mpc_tok_brackets(mpc_apply_view(mpc_and(2, mpcf_strfold,
+              mpc_ident(),
+              mpc_many(mpcf_strfold,
+                mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_ident(), free)), free), view_string), mpcf_dtor_null),
+        repeater, mpcf_dtor_null));
 
     // Intervals: +2 -2
-    mpc_define(interval, mpc_and(2, interval_fold, mpc_oneof("-+"), mpc_digits(), free));
+    mpc_define(interval, mpc_and(2, interval_fold, mpc_apply_view(mpc_oneof("-+"), view_char), number_parser(),
+        mpcf_dtor_null));
 
     // Legato: (a +1 c)
     mpc_define(legato,
       mpc_apply(mpc_tok_parens
         (mpc_many1(node_fold, mpc_or(4, mpc_tok(note), mpc_tok(interval), mpc_tok(tie), mpc_tok(divider))),
-          free_node), apply_legato));
+          drop_node), apply_legato));
+
+    // Chord: [c e g] [c +4 +7], tones sounding together
+    mpc_define(chord,
+      mpc_apply(mpc_tok_squares(mpc_many1(node_fold, mpc_or(2, mpc_tok(note), mpc_tok(interval))), drop_node),
+        apply_chord));
 
     // Label (part of sheet and group): myLabel:
-    mpc_define(label, mpc_and(2, mpcf_fst_free, mpc_ident(), mpc_char(':'), free));
+    mpc_define(label, mpc_apply_view(mpc_and(2, mpcf_fst_free, mpc_ident(), mpc_char(':'), free), view_string));
 
-    mpc_parser_t *duration = mpc_or(4,
-      mpc_and(3, duration_fold, mpc_digits(), mpc_string("is"), mpc_digits(), free, free),
-      mpc_and(3, duration_fold, mpc_digits(), mpc_string("as"), mpc_digits(), free, free),
-      mpc_and(3, duration_fold, mpc_digits(), mpc_string("to"), mpc_digits(), free, free),
-      mpc_apply(mpc_digits(), apply_as_duration));
+    // Duration (part of sheet): 4 2as3 2is3 2to3, read as units and
+    // duration, -1 in place of the missing one
+    mpc_parser_t *duration = mpc_maybe_lift(mpc_and(2, mpcf_snd,
+        mpc_apply(mpc_or(3, mpc_string("is"), mpc_string("as"), mpc_string("to")), mpcf_free),
+        number_parser(), mpcf_dtor_null), ctor_int_default);
 
     // Repeater (part of reference and sheet): {}x2
     mpc_define(repeater, mpc_maybe_lift(mpc_or(3,
-            mpc_and(2, repeater_fold,
+            mpc_and(2, mpcf_snd_free,
                 mpc_char('x'),
-                mpc_digits(), free),
-            mpc_apply(mpc_string("loop"), apply_loop),
-            mpc_apply(mpc_string("off"), apply_off)),
+                number_parser(), free),
+            mpc_apply_view(mpc_string("loop"), apply_loop),
+            mpc_apply_view(mpc_string("off"), apply_off)),
         ctor_one));
 
     // Sheet: label:4to3{...}
-    mpc_define(sheet, mpc_and(4, sheet_fold,
-        mpc_maybe_lift(label, mpcf_ctor_str),
+    mpc_define(sheet, mpc_and(6, sheet_fold,
+        mpc_state(),
+        mpc_maybe_lift(label, ctor_empty),
+        number,
         duration,
-        mpc_tok_brackets(mpc_many(node_fold, mpc_or(10,
+        mpc_tok_brackets(mpc_many(node_fold, mpc_or(11,
               mpc_tok(rest),
               mpc_tok(interval),
               mpc_tok(tie),
               mpc_tok(divider),
-              mpc_tok(comment), mpc_tok(legato), mpc_tok(sheet), mpc_tok(controller), mpc_tok(program), mpc_tok(note)
-            )), free_node), repeater, free, free, free_node));
+              mpc_tok(comment), mpc_tok(legato), mpc_tok(chord), mpc_tok(sheet), mpc_tok(controller), mpc_tok(program),
+              mpc_tok(note)
+            )), drop_node), repeater, free, mpcf_dtor_null, mpcf_dtor_null, mpcf_dtor_null, drop_node));
+
+    // Voices: [4{c d} {riff}], sheets starting together
+    mpc_define(voices, mpc_apply(mpc_tok_squares(mpc_many1(node_fold, mpc_or(2, mpc_tok(sheet), mpc_tok(reference))),
+          drop_node), apply_voices));
 
     // Top level statements
-    mpc_parser_t *crate = mpc_total(mpc_many(node_fold, mpc_or(6,
+    mpc_parser_t *crate = mpc_total(mpc_many(node_fold, mpc_or(7,
           mpc_tok(sheet),
           mpc_tok(reference),
+          mpc_tok(voices),
           mpc_tok(bpm),
           mpc_tok(controller),
           mpc_tok(program),
           mpc_tok(comment)
-        )), free_node);
+        )), drop_node);
 
     // Crate and EOF
     mpc_define(parser, mpc_apply(crate, apply_eof));
 
-    return (struct parser) {
+    grammar = (struct parser) {
         .note = note,
         .interval = interval,
         .rest = rest,
@@ -155,396 +249,440 @@ struct parser new_parser() {
         .sheet = sheet,
         .legato = legato,
         .root = parser,
+        .number = number,
+        .voices = voices,
+        .chord = chord,
     };
+    atexit(free_grammar);
 }
 
-void free_parser(struct parser *p) {
+void free_grammar() {
+    struct parser *p = &grammar;
 
-    if (p == NULL)
-        return;
-
-    mpc_cleanup(14,
+    mpc_cleanup(17,
       p->note,
       p->interval,
       p->rest,
       p->tie,
       p->divider,
-      p->controller, p->program, p->repeater, p->comment, p->reference, p->label, p->sheet, p->legato, p->root);
+      p->controller, p->program, p->repeater, p->comment, p->reference, p->label, p->sheet, p->legato, p->root, p->number,
+      p->voices, p->chord);
 
     *p = (struct parser) { 0 };
 }
 
-mpc_val_t *bpm_fold(int n, mpc_val_t ** xs) {
+struct ast *new_ast() {
+    struct ast *a = calloc(1, sizeof (struct ast));
 
-    struct node *node = calloc(1, sizeof (struct node));
-    struct bpm *bpm = calloc(1, sizeof (struct bpm));
+    if (a == NULL)
+        return NULL;
 
-    bpm->value = (unsigned int) strtoul(xs[0], NULL, 10);
+    a->nodes = calloc(DEFAULT_NODES, sizeof (struct node));
+    if (a->nodes == NULL) {
+        free(a);
+        return NULL;
+    }
+    a->capacity = DEFAULT_NODES;
+    a->size = 1; // Placeholder
+    return a;
+}
 
-    node->type = NODE_TYPE_BPM;
-    node->u.bpm = bpm;
+void free_ast(struct ast *a) {
+    if (a == NULL)
+        return;
 
-    free(xs[0]);
-    free(xs[1]);
+    while (a->strings != NULL) {
+        struct string_block *next = a->strings->next;
 
-    return node;
+        free(a->strings);
+        a->strings = next;
+    }
+    if (a->mapped)
+        munmap(a->source, a->source_len);
+    else
+        free(a->source);
+    free(a->nodes);
+    free(a->children);
+    free(a);
 }
 
-mpc_val_t *note_fold(int n, mpc_val_t ** xs) {
+size_t new_node(struct ast *a, enum node_type type) {
+    if (a->size == a->capacity) {
+        size_t capacity = a->capacity * 2;
+        void *ptr = realloc(a->nodes, capacity * sizeof (struct node));
+
+        if (ptr == NULL) {
+            a->failed = true;
+            return 0;
+        }
+        a->nodes = ptr;
+        a->capacity = capacity;
+    }
+    a->nodes[a->size] = (struct node) {.type = type};
+    return a->size++;
+}
 
-    struct node *node = calloc(1, sizeof (struct node));
-    struct note *note = calloc(1, sizeof (struct note));
+// reserve_children makes room for n more children.
+bool reserve_children(struct ast *a, size_t n) {
+    if (a->n_children + n <= a->children_capacity)
+        return true;
 
-    note->channel = *(int *) xs[0];
-    note->letter = *(char *) xs[1];
-    note->accidental = xs[2];
-    note->octave = *(int *) xs[3];
-    note->velocity = *(int *) xs[4];
+    size_t capacity = a->children_capacity == 0 ? DEFAULT_NODES : a->children_capacity * 2;
 
-    node->type = NODE_TYPE_NOTE;
-    node->u.note = note;
+    while (capacity < a->n_children + n)
+        capacity *= 2;
 
-    free(xs[0]); // channel/chars
-    free(xs[1]); // letter/char
-    // free(xs[2]); // accidental/chars, let's keep this one
-    free(xs[3]); // octave/int
-    free(xs[4]); // velocity/int
+    void *ptr = realloc(a->children, capacity * sizeof (size_t));
 
-    return node;
+    if (ptr == NULL) {
+        a->failed = true;
+        return false;
+    }
+    a->children = ptr;
+    a->children_capacity = capacity;
+    return true;
 }
 
-mpc_val_t *interval_fold(int n, mpc_val_t ** xs) {
+void set_children(struct ast *a, size_t node, const size_t *children, size_t n) {
+    if (!reserve_children(a, n))
+        return;
 
-    struct node *node = calloc(1, sizeof (struct node));
-    struct interval *interval = calloc(1, sizeof (struct interval));
+    if (n > 0)
+        memcpy(&a->children[a->n_children], children, n * sizeof (size_t));
+    a->nodes[node].first = a->n_children;
+    a->nodes[node].n = n;
+    a->n_children += n;
+}
 
-    char *sign = xs[0];
-    int value = strtoul(xs[1], NULL, 10);
+bool reserve_ast(struct ast *a, size_t nodes, size_t children) {
+    if (a->size + nodes > a->capacity) {
+        size_t capacity = a->capacity;
 
-    if (sign[0] == '-')
-        value *= -1;
+        while (capacity < a->size + nodes)
+            capacity *= 2;
 
-    interval->value = value;
+        void *ptr = realloc(a->nodes, capacity * sizeof (struct node));
 
-    node->type = NODE_TYPE_INTERVAL;
-    node->u.interval = interval;
+        if (ptr == NULL) {
+            a->failed = true;
+            return false;
+        }
+        a->nodes = ptr;
+        a->capacity = capacity;
+    }
+    return reserve_children(a, children);
+}
 
-    free(xs[0]); // sign/char
-    free(xs[1]); // digits/chars
+void copy_ast(struct ast *a, const struct ast *b, size_t offset, size_t first) {
+    for (size_t i = 1; i < b->size; i++) {
+        struct node node = b->nodes[i];
 
-    return node;
+        if (node.n > 0)
+            node.first += first;
+        a->nodes[i + offset] = node;
+    }
+    for (size_t i = 0; i < b->n_children; i++)
+        a->children[i + first] = b->children[i] + offset;
 }
 
-mpc_val_t *sheet_fold(int n, mpc_val_t ** xs) {
+void move_strings(struct ast *a, struct ast *b) {
+    // The blocks of b go after the one a is filling
+    struct string_block **tail = a->strings == NULL ? &a->strings : &a->strings->next;
+    struct string_block *rest = *tail;
 
-    struct sheet *sheet = calloc(1, sizeof (struct sheet));
-    struct node *crate = xs[2]; // Let's just reuse the crate for a sheet
+    *tail = b->strings;
+    while (*tail != NULL)
+        tail = &(*tail)->next;
+    *tail = rest;
+    b->strings = NULL;
+}
 
-    char *ptr = NULL;
+char *new_string(struct ast *a, const char *s) {
+    size_t len = strlen(s) + 1;
+    struct string_block *b = a->strings;
 
-    sheet->label = xs[0];
-    sheet->units = strtol(xs[1], &ptr, 10);
-    sheet->duration = strtol(&ptr[1], NULL, 10);
-    sheet->repeat_count = *(int *) xs[3];
+    // Blocks grow so there are only a few of them
+    if (b == NULL || b->capacity - b->size < len) {
+        size_t capacity = b == NULL ? DEFAULT_STRING_BLOCK : b->capacity * 2;
 
-    crate->type = NODE_TYPE_SHEET;
-    crate->u.sheet = sheet;
+        if (capacity < len)
+            capacity = len;
+        b = malloc(sizeof (struct string_block) + capacity);
+        if (b == NULL) {
+            a->failed = true;
+            return NULL;
+        }
+        b->next = a->strings;
+        b->size = 0;
+        b->capacity = capacity;
+        a->strings = b;
+    }
 
-    // free(xs[0]); // label/ident
-    free(xs[1]); // duration/digits
-    // free(xs[2]); // crate/node
-    free(xs[3]); // repeater/int
+    char *str = memcpy(&b->data[b->size], s, len);
 
-    return crate;
+    b->size += len;
+    return str;
 }
 
-mpc_val_t *node_fold(int n, mpc_val_t ** xs) {
-
-    int m = 0;
+struct view string_view(const char *s) {
+    return (struct view) {.s = s,.len = strlen(s)};
+}
 
-    for (size_t i = 0; i < n; i++)
-        if (xs[i] != NULL)
-            m++;
+struct node *child(const struct ast *a, const struct node *n, size_t i) {
+    return &a->nodes[a->children[n->first + i]];
+}
 
-    struct node *node = calloc(1, sizeof (struct node));
-    struct node **nodes = calloc(m, sizeof (struct node *));
+mpc_val_t *bpm_fold(int n, mpc_val_t ** xs) {
 
-    for (size_t i = 0, j = 0; i < n; i++) {
-        if (xs[i] != NULL) {
-            nodes[j] = xs[i];
-            j++;
-        }
-    }
+    size_t node = new_node(tree, NODE_TYPE_BPM);
 
-    node->type = NODE_TYPE_CRATE;
-    node->n = m;
-    node->nodes = nodes;
+    if (node != 0)
+        tree->nodes[node].u.bpm.value = AS_INT(xs[0]);
 
-    return node;
+    return AS_VAL(node);
 }
 
-mpc_val_t *reference_fold(int n, mpc_val_t ** xs) {
+mpc_val_t *note_fold(int n, mpc_val_t ** xs) {
 
-    struct node *node = calloc(1, sizeof (struct node));
-    struct reference *reference = calloc(1, sizeof (struct reference));
+    size_t node = new_node(tree, NODE_TYPE_NOTE);
 
-    int *count = xs[1];
+    if (node != 0) {
+        struct note *note = &tree->nodes[node].u.note;
 
-    reference->label = xs[0];
-    reference->repeat_count = *count;
+        note->channel = AS_INT(xs[0]);
+        note->letter = AS_INT(xs[1]);
+        note->accidental = string_view(xs[2]);
+        note->octave = AS_INT(xs[3]);
+        note->velocity = AS_INT(xs[4]);
+    }
 
-    node->type = NODE_TYPE_REFERENCE;
-    node->u.reference = reference;
+    return AS_VAL(node);
+}
+
+mpc_val_t *interval_fold(int n, mpc_val_t ** xs) {
+
+    size_t node = new_node(tree, NODE_TYPE_INTERVAL);
+
+    int value = AS_INT(xs[1]);
+
+    if (AS_INT(xs[0]) == '-')
+        value *= -1;
 
-    // free(xs[0]); // label/string
-    free(xs[1]); // repeater/digits
+    if (node != 0)
+        tree->nodes[node].u.interval.value = value;
 
-    return node;
+    return AS_VAL(node);
 }
 
-mpc_val_t *duration_fold(int n, mpc_val_t ** xs) {
+mpc_val_t *sheet_fold(int n, mpc_val_t ** xs) {
+
+    mpc_state_t *at = xs[0];
+    size_t crate = AS_INDEX(xs[4]); // Let's just reuse the crate for a sheet
 
-    char *units = xs[0];
-    char *duration = xs[2];
-    size_t len = strlen(units) + strlen(duration) + 2;
-    char *ret = calloc(len, sizeof (char));
+    if (crate != 0) {
+        struct sheet *sheet = &tree->nodes[crate].u.sheet;
 
-    snprintf(ret, len, "%s:%s", units, duration);
+        // A lone number is the duration
+        sheet->label = string_view(xs[1]);
+        sheet->units = AS_INT(xs[3]) == -1 ? 1 : AS_INT(xs[2]);
+        sheet->duration = AS_INT(xs[3]) == -1 ? AS_INT(xs[2]) : AS_INT(xs[3]);
+        sheet->repeat_count = AS_INT(xs[5]);
+        sheet->symbol = -1;
+        sheet->at = (struct position) {.line = at->row,.column = at->col};
 
-    free(xs[0]); // units/string
-    free(xs[1]); // 'is' | 'as' | 'to' /string
-    free(xs[2]); // duration/string
+        tree->nodes[crate].type = NODE_TYPE_SHEET;
+    }
+    free(at);
 
-    return ret;
+    return AS_VAL(crate);
 }
 
+mpc_val_t *node_fold(int n, mpc_val_t ** xs) {
 
-mpc_val_t *repeater_fold(int n, mpc_val_t ** xs) {
+    size_t m = 0;
 
-    int *ret = calloc(1, sizeof (int));
+    for (size_t i = 0; i < n; i++)
+        if (xs[i] != NULL)
+            m++;
+
+    size_t node = new_node(tree, NODE_TYPE_CRATE);
 
-    *ret = atoi(xs[1]);
+    if (node == 0 || !reserve_children(tree, m))
+        return NULL;
+
+    for (size_t i = 0, j = tree->n_children; i < n; i++) {
+        if (xs[i] != NULL) {
+            tree->children[j] = AS_INDEX(xs[i]);
+            j++;
+        }
+    }
 
-    free(xs[0]); // 'x'/char
-    free(xs[1]); // count/int
+    tree->nodes[node].first = tree->n_children;
+    tree->nodes[node].n = m;
+    tree->n_children += m;
 
-    return ret;
+    return AS_VAL(node);
 }
 
-mpc_val_t *controller_fold(int n, mpc_val_t ** xs) {
+mpc_val_t *reference_fold(int n, mpc_val_t ** xs) {
+
+    size_t node = new_node(tree, NODE_TYPE_REFERENCE);
+
+    if (node != 0) {
+        struct reference *reference = &tree->nodes[node].u.reference;
+
+        reference->label = string_view(xs[0]);
+        reference->repeat_count = AS_INT(xs[1]);
+        reference->symbol = -1;
+    }
 
-    struct node *node = calloc(1, sizeof (struct node));
-    struct controller *controller = calloc(1, sizeof (struct controller));
+    return AS_VAL(node);
+}
 
-    int *value = xs[3];
+mpc_val_t *controller_fold(int n, mpc_val_t ** xs) {
 
-    controller->param = strtoul(xs[1], NULL, 10);
-    controller->value = *value;
+    size_t node = new_node(tree, NODE_TYPE_CONTROLLER);
 
-    node->type = NODE_TYPE_CONTROLLER;
-    node->u.controller = controller;
+    if (node != 0) {
+        struct controller *controller = &tree->nodes[node].u.controller;
 
-    free(xs[0]); // 'cc'/string
-    free(xs[1]); // param/digits
-    free(xs[2]); // ':'/char
-    free(xs[3]); // value/int
+        controller->param = AS_INT(xs[1]);
+        controller->value = AS_INT(xs[3]);
+    }
 
-    return node;
+    return AS_VAL(node);
 }
 
 mpc_val_t *program_fold(int n, mpc_val_t ** xs) {
 
-    struct node *node = calloc(1, sizeof (struct node));
-    struct program *program = calloc(1, sizeof (struct program));
+    size_t node = new_node(tree, NODE_TYPE_PROGRAM);
 
-    program->value = strtoul(xs[1], NULL, 10); // Conversion to unsigned
+    if (node != 0)
+        tree->nodes[node].u.program.value = AS_INT(xs[1]);
 
-    node->type = NODE_TYPE_PROGRAM;
-    node->u.program = program;
+    return AS_VAL(node);
+}
 
-    free(xs[0]); // 'pgm'/string
-    free(xs[1]); // value/digits
+mpc_val_t *ctor_int_default() {
+    return INT_VAL(-1);
+}
 
-    return node;
+mpc_val_t *ctor_one() {
+    return INT_VAL(1);
 }
 
-mpc_val_t *ctor_int_default() {
-    int *x = calloc(1, sizeof (int));
+mpc_val_t *ctor_empty() {
+    return "";
+}
 
-    *x = -1;
-    return x;
+mpc_val_t *view_int(mpc_val_t * x) {
+    return INT_VAL(strtoul(x, NULL, 10));
 }
 
-mpc_val_t *ctor_one() {
-    int *x = calloc(1, sizeof (int));
+mpc_val_t *view_char(mpc_val_t * x) {
+    return INT_VAL(*(char *) x);
+}
 
-    *x = 1;
-    return x;
+// view_string keeps a copy in the tree.
+mpc_val_t *view_string(mpc_val_t * x) {
+    return new_string(tree, x);
 }
 
 mpc_val_t *apply_rest(mpc_val_t * x) {
-    struct node *node = calloc(1, sizeof (struct node));
-
-    node->type = NODE_TYPE_REST;
-    free(x);
-    return node;
+    return AS_VAL(new_node(tree, NODE_TYPE_REST));
 }
 
 mpc_val_t *apply_tie(mpc_val_t * x) {
-    struct node *node = calloc(1, sizeof (struct node));
-
-    node->type = NODE_TYPE_TIE;
-    free(x);
-    return node;
+    return AS_VAL(new_node(tree, NODE_TYPE_TIE));
 }
 
 mpc_val_t *apply_divider(mpc_val_t * x) {
-    struct node *node = calloc(1, sizeof (struct node));
-
-    node->type = NODE_TYPE_DIVIDER;
-    free(x);
-    return node;
+    return AS_VAL(new_node(tree, NODE_TYPE_DIVIDER));
 }
 
 mpc_val_t *apply_eof(mpc_val_t * x) {
-    struct node *n = x;
+    size_t crate = AS_INDEX(x);
+    size_t eof = new_node(tree, NODE_TYPE_EOF);
 
-    assert(n->type == NODE_TYPE_CRATE);
+    if (crate == 0 || eof == 0)
+        return NULL;
 
-    struct node *node = calloc(1, sizeof (struct node));
+    assert(tree->nodes[crate].type == NODE_TYPE_CRATE);
 
-    node->type = NODE_TYPE_EOF;
+    size_t first = tree->nodes[crate].first;
+    size_t n = tree->nodes[crate].n;
 
-    n->nodes = realloc(n->nodes, (n->n + 1) * sizeof (struct node *));
-    n->nodes[n->n] = node;
-    n->n += 1;
+    if (!reserve_children(tree, n + 1))
+        return NULL;
 
-    return x;
-}
-
-mpc_val_t *apply_as_duration(mpc_val_t * x) {
-    char *str = x;
-    size_t len = strlen(str) + 3;
-    char *ret = calloc(len, sizeof (char));
+    // Children of the crate are the last ones unless a failed attempt left
+    // some behind
+    if (first + n != tree->n_children) {
+        memcpy(&tree->children[tree->n_children], &tree->children[first], n * sizeof (size_t));
+        first = tree->n_children;
+        tree->n_children += n;
+    }
+    tree->children[tree->n_children++] = eof;
+    tree->nodes[crate].first = first;
+    tree->nodes[crate].n = n + 1;
 
-    snprintf(ret, len, "1:%s", str);
-    free(x);
-    return ret;
+    return x;
 }
 
 mpc_val_t *apply_loop(mpc_val_t * x) {
-    int *ret = calloc(1, sizeof (int));
-
-    *ret = -1;
-    free(x);
-    return ret;
+    return INT_VAL(-1);
 }
 
 mpc_val_t *apply_off(mpc_val_t * x) {
-    int *ret = calloc(1, sizeof (int));
-    free(x);
-    return ret;
+    return INT_VAL(0);
 }
 
 mpc_val_t *apply_legato(mpc_val_t * x) {
-    struct node *n = x;
+    size_t n = AS_INDEX(x);
 
     // Let's just keep the node and rename it to legato
-    n->type = NODE_TYPE_LEGATO;
+    if (n != 0)
+        tree->nodes[n].type = NODE_TYPE_LEGATO;
 
-    return n;
+    return x;
 }
 
-void free_node(mpc_val_t * x) {
-    if (x == NULL)
-        return;
+mpc_val_t *apply_chord(mpc_val_t * x) {
+    size_t n = AS_INDEX(x);
 
-    struct node *n = x;
-
-    switch (n->type) {
-    case NODE_TYPE_BPM:
-        free(n->u.bpm);
-        n->u.bpm = NULL;
-        break;
-
-    case NODE_TYPE_NOTE:
-        free(n->u.note->accidental);
-        n->u.note->accidental = NULL;
-        free(n->u.note);
-        n->u.note = NULL;
-        break;
-
-    case NODE_TYPE_INTERVAL:
-        free(n->u.interval);
-        n->u.interval = NULL;
-        break;
-
-    case NODE_TYPE_REST:
-    case NODE_TYPE_TIE:
-    case NODE_TYPE_DIVIDER:
-    case NODE_TYPE_EOF:
-        break;
+    if (n != 0)
+        tree->nodes[n].type = NODE_TYPE_CHORD;
 
-    case NODE_TYPE_SHEET:
-        for (size_t i = 0; i < n->n; i++) {
-            free_node(n->nodes[i]);
-            n->nodes[i] = NULL;
-        }
-        free(n->u.sheet->label);
-        n->u.sheet->label = NULL;
-        free(n->u.sheet);
-        n->u.sheet = NULL;
-        free(n->nodes);
-        n->nodes = NULL;
-        break;
-
-    case NODE_TYPE_REFERENCE:
-        free(n->u.reference->label);
-        n->u.reference->label = NULL;
-        free(n->u.reference);
-        n->u.reference = NULL;
-        break;
-
-    case NODE_TYPE_CONTROLLER:
-        free(n->u.controller);
-        n->u.controller = NULL;
-        break;
+    return x;
+}
 
-    case NODE_TYPE_PROGRAM:
-        free(n->u.program);
-        n->u.program = NULL;
-        break;
+mpc_val_t *apply_voices(mpc_val_t * x) {
+    size_t n = AS_INDEX(x);
 
-    case NODE_TYPE_LEGATO:
-    case NODE_TYPE_CRATE:
-        for (size_t i = 0; i < n->n; i++) {
-            free_node(n->nodes[i]);
-            n->nodes[i] = NULL;
-        }
-        free(n->nodes);
-        n->nodes = NULL;
-        break;
+    if (n != 0)
+        tree->nodes[n].type = NODE_TYPE_VOICES;
 
-    case NODE_TYPE_UNKNOWN:
-        break;
-    }
+    return x;
+}
 
-    free(n);
+// drop_node is a destructor of nodes thrown away by the parser. They stay in
+// the arena until the whole tree is freed.
+void drop_node(mpc_val_t * x) {
 }
 
-void print_ast(struct node *n, FILE * f) {
+void print_node(struct ast *a, struct node *n, FILE * f) {
     switch (n->type) {
     case NODE_TYPE_BPM:
-        fprintf(f, "(BPM v:%d)", n->u.bpm->value);
+        fprintf(f, "(BPM v:%d)", n->u.bpm.value);
         break;
 
     case NODE_TYPE_NOTE:
-        fprintf(f, "(NOTE ch:%d n:%c a:%s o:%d v:%d)", n->u.note->channel, n->u.note->letter, n->u.note->accidental,
-          n->u.note->octave, n->u.note->velocity);
+        fprintf(f, "(NOTE ch:%d n:%c a:%.*s o:%d v:%d)", n->u.note.channel, n->u.note.letter,
+          (int) n->u.note.accidental.len, n->u.note.accidental.s, n->u.note.octave, n->u.note.velocity);
         break;
 
     case NODE_TYPE_INTERVAL:
-        fprintf(f, "(INTERVAL v:%d)", n->u.interval->value);
+        fprintf(f, "(INTERVAL v:%d)", n->u.interval.value);
         break;
 
     case NODE_TYPE_REST:
@@ -560,11 +698,11 @@ void print_ast(struct node *n, FILE * f) {
         break;
 
     case NODE_TYPE_SHEET:
-        fprintf(f, "(SHEET l:%s u:%d d:%d r:%d", n->u.sheet->label, n->u.sheet->units, n->u.sheet->duration,
-          n->u.sheet->repeat_count);
+        fprintf(f, "(SHEET l:%.*s u:%d d:%d r:%d", (int) n->u.sheet.label.len, n->u.sheet.label.s, n->u.sheet.units,
+          n->u.sheet.duration, n->u.sheet.repeat_count);
         for (size_t i = 0; i < n->n; i++) {
             fprintf(f, " ");
-            print_ast(n->nodes[i], f);
+            print_node(a, child(a, n, i), f);
         }
         fprintf(f, ")");
         break;
@@ -573,28 +711,47 @@ void print_ast(struct node *n, FILE * f) {
         fprintf(f, "(LEGATO");
         for (size_t i = 0; i < n->n; i++) {
             fprintf(f, " ");
-            print_ast(n->nodes[i], f);
+            print_node(a, child(a, n, i), f);
         }
         fprintf(f, ")");
         break;
 
     case NODE_TYPE_REFERENCE:
-        fprintf(f, "(REFERENCE l:%s r:%d)", n->u.reference->label, n->u.reference->repeat_count);
+        fprintf(f, "(REFERENCE l:%.*s r:%d)", (int) n->u.reference.label.len, n->u.reference.label.s,
+          n->u.reference.repeat_count);
         break;
 
     case NODE_TYPE_CONTROLLER:
-        fprintf(f, "(CC p:%u v:%d)", n->u.controller->param, n->u.controller->value);
+        fprintf(f, "(CC p:%u v:%d)", n->u.controller.param, n->u.controller.value);
         break;
 
     case NODE_TYPE_PROGRAM:
-        fprintf(f, "(PGM v:%d)", n->u.program->value);
+        fprintf(f, "(PGM v:%d)", n->u.program.value);
+        break;
+
+    case NODE_TYPE_CHORD:
+        fprintf(f, "(CHORD");
+        for (size_t i = 0; i < n->n; i++) {
+            fprintf(f, " ");
+            print_node(a, child(a, n, i), f);
+        }
+        fprintf(f, ")");
+        break;
+
+    case NODE_TYPE_VOICES:
+        fprintf(f, "(VOICES");
+        for (size_t i = 0; i < n->n; i++) {
+            fprintf(f, " ");
+            print_node(a, child(a, n, i), f);
+        }
+        fprintf(f, ")");
         break;
 
     case NODE_TYPE_CRATE:
         fprintf(f, "(CRATE");
         for (size_t i = 0; i < n->n; i++) {
             fprintf(f, " ");
-            print_ast(n->nodes[i], f);
+            print_node(a, child(a, n, i), f);
         }
         fprintf(f, ")");
         break;
@@ -609,54 +766,144 @@ void print_ast(struct node *n, FILE * f) {
     }
 }
 
-struct parse_result parse(const char *filename, struct parser p, const char *in) {
-    assert(in != NULL);
+void print_ast(struct ast *a, FILE * f) {
+    print_node(a, &a->nodes[a->root], f);
+}
 
-    mpc_result_t r;
+char *memory_error(const char *filename) {
+    const char *format = "%s: error: out of memory\n";
+    size_t len = strlen(format) + strlen(filename);
+    char *err = calloc(len + 1, sizeof (char));
 
-    if (mpc_parse(filename, in, p.root, &r) == 0) {
-        char *err = mpc_err_string(r.error);
+    if (err != NULL)
+        snprintf(err, len + 1, format, filename);
+    return err;
+}
 
-        mpc_err_delete(r.error);
+// finish_parse takes the tree built by the folds.
+struct parse_result finish_parse(const char *filename, int ok, mpc_result_t *r) {
+    struct ast *a = tree;
+
+    tree = NULL;
+
+    if (!ok) {
+        char *err = mpc_err_string(r->error);
+
+        mpc_err_delete(r->error);
+        free_ast(a);
         return (struct parse_result) {
-            .n = NULL,
+            .ast = NULL,
             .err = err,
         };
     }
 
+    if (a->failed || r->output == NULL) {
+        free_ast(a);
+        return (struct parse_result) {
+            .ast = NULL,
+            .err = memory_error(filename),
+        };
+    }
+
+    a->root = AS_INDEX(r->output);
     return (struct parse_result) {
-        .n = r.output,
+        .ast = a,
         .err = NULL
     };
 }
 
-struct parse_result parse_file(const char *filename, struct parser p, FILE * in) {
+// read_source parses the source and hands it over to the tree. The source is
+// released when there is no tree to keep it.
+struct parse_result read_source(const char *filename, char *source, size_t len, bool mapped) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t pieces = len / PIECE_SIZE;
+
+    if (processors > 0 && pieces > (size_t) processors)
+        pieces = processors;
+
+    struct parse_result r = processors > 1 && pieces > 1 ? read_pieces(filename, source, len, pieces)
+      : read_score(filename, source, len);
+
+    if (r.ast == NULL) {
+        if (mapped)
+            munmap(source, len);
+        else
+            free(source);
+        return r;
+    }
+    r.ast->source = source;
+    r.ast->source_len = len;
+    r.ast->mapped = mapped;
+    return r;
+}
+
+struct parse_result parse(const char *filename, const char *in) {
     assert(in != NULL);
 
-    mpc_result_t r;
+    size_t len = strlen(in);
+    char *source = malloc(len + 1);
 
-    if (mpc_parse_file(filename, in, p.root, &r) == 0) {
-        char *err = mpc_err_string(r.error);
+    if (source == NULL)
+        return (struct parse_result) {.ast = NULL,.err = memory_error(filename)};
 
-        mpc_err_delete(r.error);
-        return (struct parse_result) {
-            .n = NULL,
-            .err = err,
-        };
+    return read_source(filename, memcpy(source, in, len + 1), len, false);
+}
+
+struct parse_result parse_file(const char *filename, FILE * in) {
+    assert(in != NULL);
+
+    struct stat st;
+
+    // Regular files are read right from the page cache
+    if (fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+
+        if (map != MAP_FAILED) {
+            posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+            return read_source(filename, map, st.st_size, true);
+        }
     }
 
-    return (struct parse_result) {
-        .n = r.output,
-        .err = NULL
-    };
+    char *buffer = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+
+    do {
+        if (size == capacity) {
+            capacity = capacity == 0 ? BUFSIZ : capacity * 2;
+
+            void *ptr = realloc(buffer, capacity);
+
+            if (ptr == NULL) {
+                free(buffer);
+                return (struct parse_result) {.ast = NULL,.err = memory_error(filename)};
+            }
+            buffer = ptr;
+        }
+        size += fread(&buffer[size], 1, capacity - size, in);
+    } while (!feof(in) && !ferror(in));
+
+    return read_source(filename, buffer, size, false);
+}
+
+struct parse_result parse_mpc(const char *filename, struct parser p, const char *in) {
+    assert(in != NULL);
+
+    mpc_result_t r;
+
+    tree = new_ast();
+    if (tree == NULL)
+        return (struct parse_result) {.ast = NULL,.err = NULL};
+
+    return finish_parse(filename, mpc_parse(filename, in, p.root, &r), &r);
 }
 
 void free_parse_result(struct parse_result *r) {
     if (r == NULL)
         return;
-    if (r->n != NULL) {
-        free_node(r->n);
-        r->n = NULL;
+    if (r->ast != NULL) {
+        free_ast(r->ast);
+        r->ast = NULL;
     }
     if (r->err != NULL) {
         free(r->err);
@@ -1,8 +1,22 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdio.h>
 #include "lib/mpc.h"
 
+// view is a piece of the source the tree was read from. It is not
+// terminated, it is `len` characters from `s`.
+struct view {
+    const char *s;
+    size_t len;
+};
+
+// position is a zero based line and column within the score.
+struct position {
+    size_t line;
+    size_t column;
+};
+
 struct bpm {
     unsigned int value;
 };
@@ -10,7 +24,7 @@ struct bpm {
 struct note {
     int channel;
     char letter;
-    char *accidental;
+    struct view accidental;
     int octave;
     int velocity;
 };
@@ -20,15 +34,19 @@ struct interval {
 };
 
 struct sheet {
-    char *label;
+    struct view label;
     int units;
     int duration;
     int repeat_count;
+    int symbol; // Index in the symbol table, -1 until bound
+    struct position at; // Start of the sheet in the score
 };
 
 struct reference {
-    char *label;
+    struct view label;
     int repeat_count;
+    int symbol; // Index in the symbol table, -1 until bound
+    size_t target; // Index of the sheet referred to, set by bind
 };
 
 struct controller {
@@ -55,25 +73,50 @@ enum node_type {
     NODE_TYPE_REFERENCE = 11,
     NODE_TYPE_CRATE = 12,
     NODE_TYPE_EOF = 13,
+    NODE_TYPE_VOICES = 14,
+    NODE_TYPE_CHORD = 15,
 };
 
 struct node {
     enum node_type type;
 
     union {
-        struct bpm *bpm;
-        struct note *note;
-        struct interval *interval;
-        struct sheet *sheet;
-        struct divider *divider;
-        struct reference *reference;
-        struct controller *controller;
-        struct program *program;
+        struct bpm bpm;
+        struct note note;
+        struct interval interval;
+        struct sheet sheet;
+        struct reference reference;
+        struct controller controller;
+        struct program program;
     } u;
 
-    // crate, legato and sheet
+    // crate, legato, chord, sheet and voices, children are `n` indices from
+    // `first` in children of the ast
+    size_t first;
     size_t n;
-    struct node **nodes;
+};
+
+struct string_block;
+
+// ast is the whole tree kept in one arena. Nodes refer to each other by index
+// into `nodes`, index 0 is a placeholder standing for no node. Labels and
+// accidentals are views into the source, which the tree owns: a file is
+// mapped, anything else is copied once. Strings of the tree that are not in
+// the source are allocated in blocks of the arena, so it is freed at once no
+// matter how large the tree is.
+struct ast {
+    struct node *nodes;
+    size_t size;
+    size_t capacity;
+    size_t *children;
+    size_t n_children;
+    size_t children_capacity;
+    struct string_block *strings;
+    char *source;
+    size_t source_len;
+    bool mapped; // The source is a mapped file
+    size_t root;
+    bool failed; // Out of memory while building
 };
 
 struct parser {
@@ -91,19 +134,61 @@ struct parser {
     mpc_parser_t *sheet;
     mpc_parser_t *legato;
     mpc_parser_t *root;
+    mpc_parser_t *number;
+    mpc_parser_t *voices;
+    mpc_parser_t *chord;
 };
 
 struct parse_result {
-    struct node *n;
+    struct ast *ast;
     char *err;
 };
 
+// new_parser returns the mpc grammar. It is built on the first call and then
+// shared read-only by every caller, in any thread, until the process exits;
+// free_parser only drops the handle.
 struct parser new_parser();
 void free_parser(struct parser *p);
 
-struct parse_result parse(const char *filename, struct parser p, const char *in);
-struct parse_result parse_file(const char *filename, struct parser p, FILE * in);
+// parse and parse_file read the score with the hand-written parser of
+// reader.h, which needs no grammar. parse copies the input, parse_file maps a
+// regular file and reads other files whole; either way the tree keeps its
+// source until it is freed. parse_mpc runs the grammar of `p` on the same
+// input and gives the same result, it is kept to compare the two.
+struct parse_result parse(const char *filename, const char *in);
+struct parse_result parse_file(const char *filename, FILE * in);
+struct parse_result parse_mpc(const char *filename, struct parser p, const char *in);
 void free_parse_result(struct parse_result *p);
 
+// memory_error formats the error of a parse that ran out of memory.
+char *memory_error(const char *filename);
+
+struct ast *new_ast();
+void free_ast(struct ast *a);
+
+// new_node appends a node and returns its index, 0 when out of memory.
+size_t new_node(struct ast *a, enum node_type type);
+
+// set_children gives the node a copy of the child indices.
+void set_children(struct ast *a, size_t node, const size_t *children, size_t n);
+
+// reserve_ast makes room for `nodes` more nodes and `children` more children
+// without adding them. copy_ast copies the nodes and children of `b` into
+// that room: node i of `b` to node i + `offset`, its children from `first`
+// on. Copies into different parts of the room may run at once. move_strings
+// hands the strings of `b` over to `a`.
+bool reserve_ast(struct ast *a, size_t nodes, size_t children);
+void copy_ast(struct ast *a, const struct ast *b, size_t offset, size_t first);
+void move_strings(struct ast *a, struct ast *b);
+
+// new_string copies the string into the arena.
+char *new_string(struct ast *a, const char *s);
+
+// string_view is a view of the whole string.
+struct view string_view(const char *s);
+
+// child returns i-th child of the node.
+struct node *child(const struct ast *a, const struct node *n, size_t i);
+
 // debug functions
-void print_ast(struct node *n, FILE * f);
+void print_ast(struct ast *a, FILE * f);
@@ -0,0 +1,1100 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser.h"
+#include "reader.h"
+
+#define DEFAULT_STACK 64
+#define MAX_DEPTH 1000
+#define MAX_PIECES 64
+
+// Items a failed alternative expected, spelled the way mpc spells them
+enum expected {
+    EXPECTED_LETTER,
+    EXPECTED_UNDERSCORE,
+    EXPECTED_ALPHANUMERIC,
+    EXPECTED_DIGIT,
+    EXPECTED_DIGITS,
+    EXPECTED_INTEGER,
+    EXPECTED_COLON,
+    EXPECTED_DOT,
+    EXPECTED_DASH,
+    EXPECTED_BAR,
+    EXPECTED_BANG,
+    EXPECTED_X,
+    EXPECTED_SIGN,
+    EXPECTED_NOTE_LETTER,
+    EXPECTED_ACCIDENTAL,
+    EXPECTED_ACCIDENTALS,
+    EXPECTED_TEXT,
+    EXPECTED_COMMENT_TEXT,
+    EXPECTED_COMMENT,
+    EXPECTED_CH,
+    EXPECTED_CC,
+    EXPECTED_CC_UPPER,
+    EXPECTED_PGM,
+    EXPECTED_PGM_UPPER,
+    EXPECTED_IS,
+    EXPECTED_AS,
+    EXPECTED_TO,
+    EXPECTED_BPM,
+    EXPECTED_LOOP,
+    EXPECTED_OFF,
+    EXPECTED_OPEN_BRACKET,
+    EXPECTED_CLOSE_BRACKET,
+    EXPECTED_OPEN_PAREN,
+    EXPECTED_CLOSE_PAREN,
+    EXPECTED_OPEN_SQUARE,
+    EXPECTED_CLOSE_SQUARE,
+    EXPECTED_END,
+    N_EXPECTED,
+};
+
+const char *expected_names[N_EXPECTED] = {
+    [EXPECTED_LETTER] = "letter",
+    [EXPECTED_UNDERSCORE] = "underscore",
+    [EXPECTED_ALPHANUMERIC] = "alphanumeric",
+    [EXPECTED_DIGIT] = "digit",
+    [EXPECTED_DIGITS] = "digits",
+    [EXPECTED_INTEGER] = "integer",
+    [EXPECTED_COLON] = "':'",
+    [EXPECTED_DOT] = "'.'",
+    [EXPECTED_DASH] = "'-'",
+    [EXPECTED_BAR] = "'|'",
+    [EXPECTED_BANG] = "'!'",
+    [EXPECTED_X] = "'x'",
+    [EXPECTED_SIGN] = "one of '-+'",
+    [EXPECTED_NOTE_LETTER] = "one of 'cdefgabCDEFGAB'",
+    [EXPECTED_ACCIDENTAL] = "one of '#b'",
+    [EXPECTED_ACCIDENTALS] = "one or more of one of '#b'",
+    [EXPECTED_TEXT] = "none of '\n'",
+    [EXPECTED_COMMENT_TEXT] = "one or more of none of '\n'",
+    [EXPECTED_COMMENT] = "\"//\"",
+    [EXPECTED_CH] = "\"ch\"",
+    [EXPECTED_CC] = "\"cc\"",
+    [EXPECTED_CC_UPPER] = "\"CC\"",
+    [EXPECTED_PGM] = "\"pgm\"",
+    [EXPECTED_PGM_UPPER] = "\"PGM\"",
+    [EXPECTED_IS] = "\"is\"",
+    [EXPECTED_AS] = "\"as\"",
+    [EXPECTED_TO] = "\"to\"",
+    [EXPECTED_BPM] = "\"bpm\"",
+    [EXPECTED_LOOP] = "\"loop\"",
+    [EXPECTED_OFF] = "\"off\"",
+    [EXPECTED_OPEN_BRACKET] = "\"{\"",
+    [EXPECTED_CLOSE_BRACKET] = "\"}\"",
+    [EXPECTED_OPEN_PAREN] = "\"(\"",
+    [EXPECTED_CLOSE_PAREN] = "\")\"",
+    [EXPECTED_OPEN_SQUARE] = "\"[\"",
+    [EXPECTED_CLOSE_SQUARE] = "\"]\"",
+    [EXPECTED_END] = "end of input",
+};
+
+// reader is a recursive-descent parser of the score. Every alternative is
+// decided by looking a few characters ahead, so the input is read once and no
+// node is built twice. Once a sheet, legato, chord, reference or voices got
+// its opening bracket it is committed and a failure inside fails the whole
+// parse.
+//
+// Alternatives that don't match are recorded as mpc records them: only the
+// furthest position counts and the items expected there are kept in the order
+// they were tried.
+struct reader {
+    const char *filename;
+    const char *in;
+    size_t len;
+    size_t pos;
+    struct position start; // Position of `in` within the score
+    size_t mark;
+    struct position marked; // Position of in[mark], sheets come in order
+    bool at_end; // Looked past the end of `in`
+    struct ast *ast;
+    int depth;
+
+    // Children of the open sheets, legatos, chords, voices and the crate
+    size_t *stack;
+    size_t top;
+    size_t stack_capacity;
+
+    size_t err_pos;
+    unsigned char expected[N_EXPECTED];
+    size_t n_expected;
+    uint64_t seen; // Bit set of expected
+    bool failed;
+    bool too_deep;
+};
+
+struct header {
+    size_t label; // Offset of the label
+    size_t label_len;
+    int units;
+    int duration;
+};
+
+size_t read_sheet(struct reader *r, struct header *h);
+
+char peek_at(struct reader *r, size_t pos) {
+    if (pos < r->len)
+        return r->in[pos];
+    r->at_end = true;
+    return '\0';
+}
+
+char peek(struct reader *r) {
+    return peek_at(r, r->pos);
+}
+
+bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+bool is_letter(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+bool is_alphanumeric(char c) {
+    return is_letter(c) || is_digit(c) || c == '_';
+}
+
+bool is_note_letter(char c) {
+    return c != '\0' && strchr("cdefgabCDEFGAB", c) != NULL;
+}
+
+// expect records the item expected at the position.
+void expect(struct reader *r, size_t pos, enum expected what) {
+    if (r->n_expected > 0 && pos < r->err_pos)
+        return;
+
+    if (r->n_expected == 0 || pos > r->err_pos) {
+        r->err_pos = pos;
+        r->n_expected = 0;
+        r->seen = 0;
+    }
+    if (r->seen & (UINT64_C(1) << what))
+        return;
+    r->seen |= UINT64_C(1) << what;
+    r->expected[r->n_expected++] = what;
+}
+
+void skip_blank(struct reader *r) {
+    for (char c = peek(r); c != '\0' && strchr(" \f\n\r\t\v", c) != NULL; c = peek(r))
+        r->pos++;
+}
+
+bool push_child(struct reader *r, size_t node) {
+    if (r->top == r->stack_capacity) {
+        size_t capacity = r->stack_capacity == 0 ? DEFAULT_STACK : r->stack_capacity * 2;
+        void *ptr = realloc(r->stack, capacity * sizeof (size_t));
+
+        if (ptr == NULL) {
+            r->ast->failed = true;
+            return false;
+        }
+        r->stack = ptr;
+        r->stack_capacity = capacity;
+    }
+    r->stack[r->top++] = node;
+    return true;
+}
+
+// pop_children moves the children pushed since `base` to the node.
+void pop_children(struct reader *r, size_t node, size_t base) {
+    if (node != 0)
+        set_children(r->ast, node, r->stack + base, r->top - base);
+    r->top = base;
+}
+
+bool read_char(struct reader *r, char c, enum expected what) {
+    if (peek(r) != c) {
+        expect(r, r->pos, what);
+        return false;
+    }
+    r->pos++;
+    return true;
+}
+
+bool read_keyword(struct reader *r, const char *s, enum expected what) {
+    size_t len = strlen(s);
+
+    for (size_t i = 0; i < len; i++) {
+        if (peek_at(r, r->pos + i) != s[i]) {
+            expect(r, r->pos, what);
+            return false;
+        }
+    }
+    r->pos += len;
+    return true;
+}
+
+// read_number reads digits the way strtoul does, saturated on overflow.
+bool read_number(struct reader *r, int *value, enum expected what) {
+    unsigned long v = 0;
+
+    if (!is_digit(peek(r))) {
+        expect(r, r->pos, what);
+        return false;
+    }
+    for (char c = peek(r); is_digit(c); c = peek(r)) {
+        unsigned long d = c - '0';
+
+        v = v > (ULONG_MAX - d) / 10 ? ULONG_MAX : v * 10 + d;
+        r->pos++;
+    }
+    *value = (int) v;
+    return true;
+}
+
+bool read_ident(struct reader *r) {
+    char c = peek(r);
+
+    if (!is_letter(c) && c != '_') {
+        expect(r, r->pos, EXPECTED_LETTER);
+        expect(r, r->pos, EXPECTED_UNDERSCORE);
+        return false;
+    }
+    do
+        r->pos++;
+    while (is_alphanumeric(peek(r)));
+    expect(r, r->pos, EXPECTED_ALPHANUMERIC);
+    return true;
+}
+
+struct view read_view(struct reader *r, size_t start, size_t len) {
+    return (struct view) {.s = &r->in[start],.len = len};
+}
+
+// Repeater: x2 loop off, 1 when missing
+int read_repeater(struct reader *r) {
+    size_t pos = r->pos;
+    int value;
+
+    if (read_char(r, 'x', EXPECTED_X)) {
+        if (read_number(r, &value, EXPECTED_DIGITS))
+            return value;
+        r->pos = pos;
+    }
+    if (read_keyword(r, "loop", EXPECTED_LOOP))
+        return -1;
+    if (read_keyword(r, "off", EXPECTED_OFF))
+        return 0;
+    return 1;
+}
+
+// Note: ch2:c#4!5
+bool read_note(struct reader *r, size_t *node) {
+    size_t pos = r->pos;
+    int channel = -1;
+    int octave = -1;
+    int velocity = -1;
+
+    if (read_keyword(r, "ch", EXPECTED_CH)
+      && !(read_number(r, &channel, EXPECTED_INTEGER) && read_char(r, ':', EXPECTED_COLON))) {
+        channel = -1;
+        r->pos = pos;
+    }
+
+    char letter = peek(r);
+
+    if (!is_note_letter(letter)) {
+        expect(r, r->pos, EXPECTED_NOTE_LETTER);
+        r->pos = pos;
+        return false;
+    }
+    r->pos++;
+
+    size_t accidental = r->pos;
+
+    while (peek(r) == '#' || peek(r) == 'b')
+        r->pos++;
+    expect(r, r->pos, r->pos > accidental ? EXPECTED_ACCIDENTAL : EXPECTED_ACCIDENTALS);
+
+    size_t accidental_len = r->pos - accidental;
+
+    read_number(r, &octave, EXPECTED_INTEGER);
+
+    if (read_char(r, '!', EXPECTED_BANG)) {
+        if (is_digit(peek(r)))
+            velocity = r->in[r->pos++] - '0';
+        else {
+            expect(r, r->pos, EXPECTED_DIGIT);
+            r->pos--;
+        }
+    }
+
+    *node = new_node(r->ast, NODE_TYPE_NOTE);
+    if (*node != 0) {
+        struct note *note = &r->ast->nodes[*node].u.note;
+
+        note->channel = channel;
+        note->letter = letter;
+        note->accidental = read_view(r, accidental, accidental_len);
+        note->octave = octave;
+        note->velocity = velocity;
+    }
+    return true;
+}
+
+// Intervals: +2 -2
+bool read_interval(struct reader *r, size_t *node) {
+    size_t pos = r->pos;
+    char sign = peek(r);
+    int value;
+
+    if (sign != '-' && sign != '+') {
+        expect(r, pos, EXPECTED_SIGN);
+        return false;
+    }
+    r->pos++;
+    if (!read_number(r, &value, EXPECTED_DIGITS)) {
+        r->pos = pos;
+        return false;
+    }
+    if (sign == '-')
+        value *= -1;
+
+    *node = new_node(r->ast, NODE_TYPE_INTERVAL);
+    if (*node != 0)
+        r->ast->nodes[*node].u.interval.value = value;
+    return true;
+}
+
+// Rest, tie and divider: . - |
+bool read_symbol(struct reader *r, char c, enum expected what, enum node_type type, size_t *node) {
+    if (!read_char(r, c, what))
+        return false;
+    *node = new_node(r->ast, type);
+    return true;
+}
+
+// Comment: // comment
+bool read_comment(struct reader *r) {
+    size_t pos = r->pos;
+
+    if (!read_keyword(r, "//", EXPECTED_COMMENT))
+        return false;
+    if (peek(r) == '\n' || peek(r) == '\0') {
+        expect(r, r->pos, EXPECTED_COMMENT_TEXT);
+        r->pos = pos;
+        return false;
+    }
+    while (peek(r) != '\n' && peek(r) != '\0')
+        r->pos++;
+    expect(r, r->pos, EXPECTED_TEXT);
+    return true;
+}
+
+// Control change: cc9:129
+bool read_controller(struct reader *r, size_t *node) {
+    size_t pos = r->pos;
+    int param;
+    int value;
+
+    if (!read_keyword(r, "cc", EXPECTED_CC) && !read_keyword(r, "CC", EXPECTED_CC_UPPER))
+        return false;
+    if (!read_number(r, &param, EXPECTED_DIGITS) || !read_char(r, ':', EXPECTED_COLON)
+      || !read_number(r, &value, EXPECTED_INTEGER)) {
+        r->pos = pos;
+        return false;
+    }
+
+    *node = new_node(r->ast, NODE_TYPE_CONTROLLER);
+    if (*node != 0) {
+        r->ast->nodes[*node].u.controller.param = param;
+        r->ast->nodes[*node].u.controller.value = value;
+    }
+    return true;
+}
+
+// Program change: pgm12
+bool read_program(struct reader *r, size_t *node) {
+    size_t pos = r->pos;
+    int value;
+
+    if (!read_keyword(r, "pgm", EXPECTED_PGM) && !read_keyword(r, "PGM", EXPECTED_PGM_UPPER))
+        return false;
+    if (!read_number(r, &value, EXPECTED_DIGITS)) {
+        r->pos = pos;
+        return false;
+    }
+
+    *node = new_node(r->ast, NODE_TYPE_PROGRAM);
+    if (*node != 0)
+        r->ast->nodes[*node].u.program.value = value;
+    return true;
+}
+
+// Bpm: 120bpm
+bool read_bpm(struct reader *r, size_t *node) {
+    size_t pos = r->pos;
+    int value;
+
+    if (!read_number(r, &value, EXPECTED_DIGITS))
+        return false;
+    if (!read_keyword(r, "bpm", EXPECTED_BPM)) {
+        r->pos = pos;
+        return false;
+    }
+
+    *node = new_node(r->ast, NODE_TYPE_BPM);
+    if (*node != 0)
+        r->ast->nodes[*node].u.bpm.value = value;
+    return true;
+}
+
+// Reference: {label} {label1.label2}, the opening bracket is read already
+size_t read_reference(struct reader *r) {
+    skip_blank(r);
+
+    size_t label = r->pos;
+
+    if (!read_ident(r)) {
+        r->failed = true;
+        return 0;
+    }
+    for (;;) {
+        size_t pos = r->pos;
+
+        if (!read_char(r, '.', EXPECTED_DOT))
+            break;
+        if (!read_ident(r)) {
+            r->pos = pos;
+            break;
+        }
+    }
+
+    size_t label_len = r->pos - label;
+
+    skip_blank(r);
+    if (!read_keyword(r, "}", EXPECTED_CLOSE_BRACKET)) {
+        r->failed = true;
+        return 0;
+    }
+    skip_blank(r);
+
+    int repeat_count = read_repeater(r);
+    size_t node = new_node(r->ast, NODE_TYPE_REFERENCE);
+
+    if (node != 0) {
+        struct reference *reference = &r->ast->nodes[node].u.reference;
+
+        reference->label = read_view(r, label, label_len);
+        reference->repeat_count = repeat_count;
+        reference->symbol = -1;
+    }
+    return node;
+}
+
+// Legato: (a +1 c), the opening parenthesis is read already
+size_t read_legato(struct reader *r) {
+    size_t base = r->top;
+    size_t node = 0;
+    size_t n = 0;
+
+    skip_blank(r);
+    while (read_note(r, &node) || read_interval(r, &node)
+      || read_symbol(r, '-', EXPECTED_DASH, NODE_TYPE_TIE, &node)
+      || read_symbol(r, '|', EXPECTED_BAR, NODE_TYPE_DIVIDER, &node)) {
+        if (node != 0)
+            push_child(r, node);
+        n++;
+        skip_blank(r);
+    }
+
+    if (n == 0 || !read_keyword(r, ")", EXPECTED_CLOSE_PAREN)) {
+        r->failed = true;
+        r->top = base;
+        return 0;
+    }
+    skip_blank(r);
+
+    node = new_node(r->ast, NODE_TYPE_LEGATO);
+    pop_children(r, node, base);
+    return node;
+}
+
+// Chord: [c e g] [c +4 +7], the opening bracket is read already
+size_t read_chord(struct reader *r) {
+    size_t base = r->top;
+    size_t node = 0;
+    size_t n = 0;
+
+    skip_blank(r);
+    while (read_note(r, &node) || read_interval(r, &node)) {
+        if (node != 0)
+            push_child(r, node);
+        n++;
+        skip_blank(r);
+    }
+
+    if (n == 0 || !read_keyword(r, "]", EXPECTED_CLOSE_SQUARE)) {
+        r->failed = true;
+        r->top = base;
+        return 0;
+    }
+    skip_blank(r);
+
+    node = new_node(r->ast, NODE_TYPE_CHORD);
+    pop_children(r, node, base);
+    return node;
+}
+
+// read_header reads the sheet up to its opening bracket: label:4to3{
+bool read_header(struct reader *r, struct header *h) {
+    size_t pos = r->pos;
+
+    h->label = pos;
+    h->label_len = 0;
+    if (read_ident(r)) {
+        if (read_char(r, ':', EXPECTED_COLON)) {
+            h->label = pos;
+            h->label_len = r->pos - pos - 1;
+        } else
+            r->pos = pos;
+    }
+
+    if (!read_number(r, &h->units, EXPECTED_DIGITS)) {
+        r->pos = pos;
+        return false;
+    }
+
+    size_t duration = r->pos;
+
+    h->duration = -1;
+    if ((read_keyword(r, "is", EXPECTED_IS) || read_keyword(r, "as", EXPECTED_AS)
+        || read_keyword(r, "to", EXPECTED_TO)) && !read_number(r, &h->duration, EXPECTED_DIGITS))
+        r->pos = duration;
+
+    if (!read_keyword(r, "{", EXPECTED_OPEN_BRACKET)) {
+        r->pos = pos;
+        return false;
+    }
+    return true;
+}
+
+// read_element reads one element of a sheet. A comment is read with no node.
+bool read_element(struct reader *r, size_t *node) {
+    struct header h;
+
+    *node = 0;
+    if (read_symbol(r, '.', EXPECTED_DOT, NODE_TYPE_REST, node)
+      || read_interval(r, node)
+      || read_symbol(r, '-', EXPECTED_DASH, NODE_TYPE_TIE, node)
+      || read_symbol(r, '|', EXPECTED_BAR, NODE_TYPE_DIVIDER, node)
+      || read_comment(r))
+        return true;
+
+    if (read_keyword(r, "(", EXPECTED_OPEN_PAREN)) {
+        *node = read_legato(r);
+        return !r->failed;
+    }
+
+    if (read_keyword(r, "[", EXPECTED_OPEN_SQUARE)) {
+        *node = read_chord(r);
+        return !r->failed;
+    }
+
+    if (read_header(r, &h)) {
+        *node = read_sheet(r, &h);
+        return !r->failed;
+    }
+
+    return read_controller(r, node) || read_program(r, node) || read_note(r, node);
+}
+
+// position_at returns the position of in[pos] within the score. Positions
+// are asked for mostly further on, so counting goes on from the last one.
+struct position position_at(struct reader *r, size_t pos) {
+    if (pos < r->mark) {
+        r->mark = 0;
+        r->marked = r->start;
+    }
+    r->marked = advance(r->marked, &r->in[r->mark], pos - r->mark);
+    r->mark = pos;
+    return r->marked;
+}
+
+// Sheet: label:4to3{...}, the header is read already
+size_t read_sheet(struct reader *r, struct header *h) {
+    size_t base = r->top;
+    size_t node;
+    struct position at = position_at(r, h->label);
+
+    if (++r->depth > MAX_DEPTH) {
+        r->failed = true;
+        r->too_deep = true;
+        return 0;
+    }
+
+    skip_blank(r);
+    while (read_element(r, &node)) {
+        if (node != 0)
+            push_child(r, node);
+        skip_blank(r);
+    }
+
+    if (r->failed || !read_keyword(r, "}", EXPECTED_CLOSE_BRACKET)) {
+        r->failed = true;
+        r->top = base;
+        return 0;
+    }
+    skip_blank(r);
+    r->depth--;
+
+    int repeat_count = read_repeater(r);
+
+    node = new_node(r->ast, NODE_TYPE_SHEET);
+    if (node != 0) {
+        struct sheet *sheet = &r->ast->nodes[node].u.sheet;
+
+        // A lone number is the duration
+        sheet->label = read_view(r, h->label, h->label_len);
+        sheet->units = h->duration == -1 ? 1 : h->units;
+        sheet->duration = h->duration == -1 ? h->units : h->duration;
+        sheet->repeat_count = repeat_count;
+        sheet->symbol = -1;
+        sheet->at = at;
+    }
+    pop_children(r, node, base);
+    return node;
+}
+
+// Voices: [4{c d} {riff}], the opening bracket is read already
+size_t read_voices(struct reader *r) {
+    size_t base = r->top;
+    size_t node = 0;
+    size_t n = 0;
+    struct header h;
+
+    skip_blank(r);
+    for (;;) {
+        if (read_header(r, &h)) {
+            node = read_sheet(r, &h);
+        } else if (read_keyword(r, "{", EXPECTED_OPEN_BRACKET)) {
+            node = read_reference(r);
+        } else
+            break;
+        if (r->failed) {
+            r->top = base;
+            return 0;
+        }
+        if (node != 0)
+            push_child(r, node);
+        n++;
+        skip_blank(r);
+    }
+
+    if (n == 0 || !read_keyword(r, "]", EXPECTED_CLOSE_SQUARE)) {
+        r->failed = true;
+        r->top = base;
+        return 0;
+    }
+    skip_blank(r);
+
+    node = new_node(r->ast, NODE_TYPE_VOICES);
+    pop_children(r, node, base);
+    return node;
+}
+
+// read_statement reads one top level statement.
+bool read_statement(struct reader *r, size_t *node) {
+    struct header h;
+
+    *node = 0;
+    if (read_header(r, &h)) {
+        *node = read_sheet(r, &h);
+        return !r->failed;
+    }
+
+    if (read_keyword(r, "{", EXPECTED_OPEN_BRACKET)) {
+        *node = read_reference(r);
+        return !r->failed;
+    }
+
+    if (read_keyword(r, "[", EXPECTED_OPEN_SQUARE)) {
+        *node = read_voices(r);
+        return !r->failed;
+    }
+
+    return read_bpm(r, node) || read_controller(r, node) || read_program(r, node) || read_comment(r);
+}
+
+// read_crate reads all of the input, the crate ends with an EOF node when
+// `eof` is set.
+size_t read_crate(struct reader *r, bool eof) {
+    size_t node;
+
+    skip_blank(r);
+    while (read_statement(r, &node)) {
+        if (node != 0)
+            push_child(r, node);
+        skip_blank(r);
+    }
+
+    if (r->failed)
+        return 0;
+    if (peek(r) != '\0') {
+        expect(r, r->pos, EXPECTED_END);
+        r->failed = true;
+        return 0;
+    }
+
+    if (eof)
+        push_child(r, new_node(r->ast, NODE_TYPE_EOF));
+    node = new_node(r->ast, NODE_TYPE_CRATE);
+    pop_children(r, node, 0);
+    return node;
+}
+
+// read_complete reads statements up to the first one which looked past the
+// end of the input. That one and the rest are left for later, `used` is where
+// they start. The crate has no EOF node.
+size_t read_complete(struct reader *r, size_t *used) {
+    size_t node;
+
+    skip_blank(r);
+    for (;;) {
+        size_t pos = r->pos;
+        size_t top = r->top;
+
+        r->at_end = false;
+        if (!read_statement(r, &node) && !r->failed && !r->at_end) {
+            expect(r, r->pos, EXPECTED_END);
+            r->failed = true;
+        }
+        if (r->at_end) {
+            r->pos = pos;
+            r->top = top;
+            r->depth = 0;
+            r->failed = false;
+            r->too_deep = false;
+            break;
+        }
+        if (r->failed)
+            return 0;
+        if (node != 0)
+            push_child(r, node);
+        skip_blank(r);
+    }
+
+    *used = r->pos;
+    node = new_node(r->ast, NODE_TYPE_CRATE);
+    pop_children(r, node, 0);
+    return node;
+}
+
+// describe names the character the way mpc does.
+const char *describe(char c, char *buffer) {
+    switch (c) {
+    case '\a': return "bell";
+    case '\b': return "backspace";
+    case '\f': return "formfeed";
+    case '\r': return "carriage return";
+    case '\v': return "vertical tab";
+    case '\0': return "end of input";
+    case '\n': return "newline";
+    case '\t': return "tab";
+    case ' ': return "space";
+    default:
+        snprintf(buffer, 4, "'%c'", c);
+        return buffer;
+    }
+}
+
+// read_error formats the furthest failure:
+//   file:line:column: error: expected A, B or C at 'x'
+char *read_error(struct reader *r) {
+    if (r->too_deep) {
+        const char *format = "%s: error: Maximum recursion depth exceeded!\n";
+        size_t len = strlen(format) + strlen(r->filename);
+        char *err = calloc(len + 1, sizeof (char));
+
+        if (err != NULL)
+            snprintf(err, len + 1, format, r->filename);
+        return err;
+    }
+
+    struct position at = advance(r->start, r->in, r->err_pos);
+
+    char buffer[4];
+    const char *received = describe(peek_at(r, r->err_pos), buffer);
+    size_t len = strlen(r->filename) + strlen(received) + 64;
+
+    for (size_t i = 0; i < r->n_expected; i++)
+        len += strlen(expected_names[r->expected[i]]) + 4;
+
+    char *err = calloc(len + 1, sizeof (char));
+
+    if (err == NULL)
+        return NULL;
+
+    size_t end = snprintf(err, len + 1, "%s:%zu:%zu: error: expected ", r->filename, at.line + 1, at.column + 1);
+
+    for (size_t i = 0; i < r->n_expected; i++) {
+        const char *separator = i == 0 ? "" : i + 1 == r->n_expected ? " or " : ", ";
+
+        end += snprintf(&err[end], len + 1 - end, "%s%s", separator, expected_names[r->expected[i]]);
+    }
+    snprintf(&err[end], len + 1 - end, " at %s\n", received);
+    return err;
+}
+
+// read_input reads the crate, all of the input or only its complete
+// statements when `used` is given. A crate of all the input ends with an EOF
+// node when `eof` is set.
+struct parse_result read_input(const char *filename, const char *in, size_t len, struct position start, size_t *used,
+  bool eof) {
+    struct reader r = {
+        .filename = filename,
+        .in = in,
+        .len = len,
+        .pos = 0,
+        .start = start,
+        .mark = 0,
+        .marked = start,
+        .ast = new_ast(),
+    };
+
+    if (r.ast == NULL)
+        return (struct parse_result) {.ast = NULL,.err = NULL};
+
+    size_t root = used == NULL ? read_crate(&r, eof) : read_complete(&r, used);
+
+    free(r.stack);
+
+    if (r.failed) {
+        free_ast(r.ast);
+        return (struct parse_result) {.ast = NULL,.err = read_error(&r)};
+    }
+    if (r.ast->failed || root == 0) {
+        free_ast(r.ast);
+        return (struct parse_result) {.ast = NULL,.err = memory_error(filename)};
+    }
+
+    r.ast->root = root;
+    return (struct parse_result) {.ast = r.ast,.err = NULL};
+}
+
+struct parse_result read_score(const char *filename, const char *in, size_t len) {
+    return read_input(filename, in, len, (struct position) {0, 0}, NULL, true);
+}
+
+struct parse_result read_rest(const char *filename, const char *in, size_t len, struct position start) {
+    return read_input(filename, in, len, start, NULL, true);
+}
+
+struct parse_result read_statements(const char *filename, const char *in, size_t len, struct position start,
+  size_t *used) {
+    return read_input(filename, in, len, start, used, false);
+}
+
+// piece is a part of the score read on its own, then copied `into` the tree
+// of the first piece with its nodes from `offset` and its children from
+// `first`. A piece starts a line, it's read as if it were the first one and
+// its sheets are moved down by the `lines` before it once it is copied.
+struct piece {
+    const char *filename;
+    const char *in;
+    size_t len;
+    size_t lines; // Newlines in the piece, then the ones before it
+    struct parse_result res;
+    struct ast *into;
+    size_t offset;
+    size_t first;
+};
+
+void *read_piece(void *arg) {
+    struct piece *p = arg;
+
+    p->res = read_input(p->filename, p->in, p->len, (struct position) {0, 0}, NULL, false);
+    p->lines = 0;
+    for (const char *c = memchr(p->in, '\n', p->len); c != NULL; c = memchr(c + 1, '\n', &p->in[p->len] - c - 1))
+        p->lines++;
+    return NULL;
+}
+
+void *copy_piece(void *arg) {
+    struct piece *p = arg;
+
+    if (p->res.ast == p->into)
+        return NULL;
+    copy_ast(p->into, p->res.ast, p->offset, p->first);
+    for (size_t i = 1; i < p->res.ast->size; i++) {
+        struct node *node = &p->into->nodes[i + p->offset];
+
+        if (node->type == NODE_TYPE_SHEET)
+            node->u.sheet.at.line += p->lines;
+    }
+    return NULL;
+}
+
+// run_pieces calls `fn` on every piece, on the first one right here and on
+// the rest in threads of their own, or here too when a thread won't start.
+void run_pieces(struct piece *pieces, size_t n, void *(*fn)(void *)) {
+    pthread_t threads[MAX_PIECES];
+    bool started[MAX_PIECES] = { false };
+
+    for (size_t i = 1; i < n; i++)
+        started[i] = pthread_create(&threads[i], NULL, fn, &pieces[i]) == 0;
+    fn(&pieces[0]);
+    for (size_t i = 1; i < n; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            fn(&pieces[i]);
+    }
+}
+
+// continues tells whether a line starting at `i` may continue the statement
+// before, or has nothing to read. `*next` is set to its first non-blank.
+bool continues(const char *in, size_t len, size_t i, size_t *next) {
+    while (i < len && strchr(" \f\n\r\t\v", in[i]) != NULL && in[i] != '\0')
+        i++;
+    *next = i;
+    return i == len || in[i] == '\0' || in[i] == 'x' || in[i] == 'l' || in[i] == 'o';
+}
+
+// cut_score cuts the score into at most `n` pieces of about the same length
+// and returns how many there are, piece i runs from cuts[i] to cuts[i + 1].
+// A cut is made after a newline outside of brackets and comments, where the
+// next line doesn't start with a repeater of the statement before. Brackets
+// may be unbalanced in a broken score, the cuts are then wrong but so is the
+// score.
+size_t cut_score(const char *in, size_t len, size_t n, size_t *cuts) {
+    size_t pieces = 1;
+    size_t depth = 0;
+    bool comment = false;
+
+    cuts[0] = 0;
+    for (size_t i = 0; i < len && pieces < n; i++) {
+        char c = in[i];
+
+        if (c == '\0')
+            break; // The reader stops here, the rest goes with the last piece
+        if (comment) {
+            comment = c != '\n';
+        } else if (c == '/' && i + 1 < len && in[i + 1] == '/') {
+            comment = true;
+            i++;
+            continue;
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if ((c == '}' || c == ']') && depth > 0) {
+            depth--;
+        }
+        if (c != '\n' || comment || depth > 0 || i + 1 < len / n * pieces)
+            continue;
+
+        size_t next;
+
+        if (continues(in, len, i + 1, &next)) {
+            // Every newline of the blanks would be turned down the same way
+            i = next - 1;
+            continue;
+        }
+        cuts[pieces++] = i + 1;
+    }
+    cuts[pieces] = len;
+    return pieces;
+}
+
+// join_pieces copies the trees of the pieces into the first one, each in a
+// thread of its own as they are large, under a crate of all their
+// statements in order.
+struct parse_result join_pieces(const char *filename, struct piece *pieces, size_t n) {
+    struct ast *a = pieces[0].res.ast;
+    size_t nodes = 0;
+    size_t children = 0;
+    size_t statements = 1; // EOF
+    size_t lines = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        const struct ast *b = pieces[i].res.ast;
+        size_t in_piece = pieces[i].lines;
+
+        pieces[i].lines = lines;
+        lines += in_piece;
+        pieces[i].into = a;
+        statements += b->nodes[b->root].n;
+        if (i == 0)
+            continue;
+        pieces[i].offset = a->size - 1 + nodes;
+        pieces[i].first = a->n_children + children;
+        nodes += b->size - 1; // Without the placeholder
+        children += b->n_children;
+    }
+
+    if (reserve_ast(a, nodes + 2, children + statements)) {
+        run_pieces(pieces, n, copy_piece);
+        a->size += nodes;
+        a->n_children += children;
+
+        size_t root = new_node(a, NODE_TYPE_CRATE);
+        size_t k = a->n_children;
+
+        for (size_t i = 0; i < n; i++) {
+            const struct node *crate = &a->nodes[pieces[i].res.ast->root + pieces[i].offset];
+
+            memcpy(&a->children[k], &a->children[crate->first], crate->n * sizeof (size_t));
+            k += crate->n;
+        }
+        a->children[k] = new_node(a, NODE_TYPE_EOF);
+        a->nodes[root].first = a->n_children;
+        a->nodes[root].n = statements;
+        a->n_children += statements;
+        a->root = root;
+    }
+
+    for (size_t i = 1; i < n; i++) {
+        move_strings(a, pieces[i].res.ast);
+        free_ast(pieces[i].res.ast);
+    }
+
+    if (a->failed) {
+        free_ast(a);
+        return (struct parse_result) {.ast = NULL,.err = memory_error(filename)};
+    }
+    return (struct parse_result) {.ast = a,.err = NULL};
+}
+
+struct parse_result read_pieces(const char *filename, const char *in, size_t len, size_t n) {
+    size_t cuts[MAX_PIECES + 1];
+    struct piece pieces[MAX_PIECES];
+
+    if (n > MAX_PIECES)
+        n = MAX_PIECES;
+    n = n < 2 ? 1 : cut_score(in, len, n, cuts);
+    if (n < 2)
+        return read_score(filename, in, len);
+
+    for (size_t i = 0; i < n; i++)
+        pieces[i] = (struct piece) {.filename = filename,.in = &in[cuts[i]],.len = cuts[i + 1] - cuts[i]};
+    run_pieces(pieces, n, read_piece);
+
+    bool failed = false;
+
+    for (size_t i = 0; i < n; i++)
+        failed |= pieces[i].res.ast == NULL;
+    if (!failed)
+        return join_pieces(filename, pieces, n);
+
+    // The error is reported at its place in the whole score
+    for (size_t i = 0; i < n; i++)
+        free_parse_result(&pieces[i].res);
+    return read_score(filename, in, len);
+}
+
+struct position advance(struct position p, const char *in, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        p.column++;
+        if (in[i] == '\n') {
+            p.column = 0;
+            p.line++;
+        }
+    }
+    return p;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "parser.h"
+
+// read_score parses `len` characters of the score with the hand-written
+// parser. It builds the same tree as the mpc grammar of new_parser() and
+// reports errors the same way, with the file, line and column of the
+// furthest failure and everything expected there. Labels and accidentals of
+// the tree are views into `in`.
+struct parse_result read_score(const char *filename, const char *in, size_t len);
+
+// read_statements parses the complete top level statements at the start of
+// `in`, a piece of the score at `start`. A statement is complete when it was
+// read without looking past the end of `in`, so what comes next can't change
+// it; a sheet is complete only once something other than a blank follows, as
+// a repeater may still come. `*used` is set to the length of the statements
+// read, the rest has to be read again with more input. The crate has no EOF
+// node. read_rest reads the last piece as read_score reads the whole score.
+struct parse_result read_statements(const char *filename, const char *in, size_t len, struct position start,
+  size_t *used);
+struct parse_result read_rest(const char *filename, const char *in, size_t len, struct position start);
+
+// read_pieces parses the score as read_score does, cut into at most `n`
+// pieces read at the same time by as many threads. Pieces start on lines
+// outside of any sheet or voices, so each holds whole statements, and their
+// trees are joined in order. A broken score is read again whole to report the
+// error where it is.
+struct parse_result read_pieces(const char *filename, const char *in, size_t len, size_t n);
+
+// advance returns the position after `len` characters of `in` at `p`.
+struct position advance(struct position p, const char *in, size_t len);
@@ -0,0 +1,73 @@
+#include <stdlib.h>
+
+#include "ring.h"
+
+struct ring *new_ring(size_t capacity) {
+    struct ring *r = calloc(1, sizeof (struct ring));
+
+    if (r == NULL)
+        return NULL;
+
+    r->capacity = 1;
+    while (r->capacity < capacity)
+        r->capacity *= 2;
+    r->events = calloc(r->capacity, sizeof (snd_seq_event_t));
+    if (r->events == NULL) {
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void free_ring(struct ring *r) {
+    if (r == NULL)
+        return;
+    free(r->events);
+    free(r);
+}
+
+size_t ring_push(struct ring *r, const snd_seq_event_t *events, size_t n) {
+    size_t tail = r->tail;
+    size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    size_t room = r->capacity - (tail - head);
+
+    if (n > room)
+        n = room;
+    for (size_t i = 0; i < n; i++)
+        r->events[(tail + i) & (r->capacity - 1)] = events[i];
+
+    // Events are written before the consumer may see them
+    __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+snd_seq_event_t *ring_peek(struct ring *r) {
+    size_t head = r->head;
+
+    if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->events[head & (r->capacity - 1)];
+}
+
+snd_seq_event_t *ring_at(struct ring *r, size_t i) {
+    size_t head = r->head;
+
+    if (i >= __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head)
+        return NULL;
+    return &r->events[(head + i) & (r->capacity - 1)];
+}
+
+void ring_pop(struct ring *r) {
+    // The slot is read before the producer may fill it again
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+size_t ring_fill(struct ring *r) {
+    size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+}
+
+size_t ring_room(struct ring *r) {
+    return r->capacity - ring_fill(r);
+}
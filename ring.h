@@ -0,0 +1,45 @@
+#pragma once
+
+#include <alsa/asoundlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// ring is a queue of events between one producer and one consumer thread.
+// Indexes only grow and are taken modulo the capacity, a power of two. The
+// producer alone moves `tail` and the consumer alone moves `head`; each side
+// publishes its index with release and reads the other one with acquire, so
+// neither takes a lock or waits for the other. The indexes live on cache
+// lines of their own.
+struct ring {
+    snd_seq_event_t *events;
+    size_t capacity;
+    char pad_head[64];
+    size_t head; // Next event to take
+    char pad_tail[64];
+    size_t tail; // Next slot to fill
+    char pad_end[64];
+};
+
+// new_ring allocates a ring for at least `capacity` events.
+struct ring *new_ring(size_t capacity);
+void free_ring(struct ring *r);
+
+// ring_push appends up to `n` events and returns how many fit. Only the
+// producer calls it.
+size_t ring_push(struct ring *r, const snd_seq_event_t *events, size_t n);
+
+// ring_peek returns the next event or NULL when the ring is empty, ring_pop
+// drops it. Only the consumer calls them.
+snd_seq_event_t *ring_peek(struct ring *r);
+void ring_pop(struct ring *r);
+
+// ring_at returns the `i`th event after the next one without taking it, NULL
+// when there are fewer events. Only the consumer calls it.
+snd_seq_event_t *ring_at(struct ring *r, size_t i);
+
+// ring_fill returns the number of events in the ring. Either side may ask,
+// the other one may have moved on by the time it is used.
+size_t ring_fill(struct ring *r);
+
+// ring_room returns the number of events which can be pushed.
+size_t ring_room(struct ring *r);
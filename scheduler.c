@@ -1,23 +1,112 @@
+#define _GNU_SOURCE // CPU affinity
+
 #include <alsa/asoundlib.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "korlessa.h"
+#include "measure.h"
+#include "ring.h"
 #include "scheduler.h"
+#include "stream.h"
 
-#define DEFAULT_BPM 120 // TODO: make as an argument
-#define DEFAULT_QUEUE_SIZE 128
+#define DEFAULT_BPM 120 // Until the first bpm of the score
 #define DEFAULT_DRAIN_SIZE 96
-#define DEFAULT_POLL_TIMEOUT 1000 // ms
+#define DEFAULT_RING_SIZE 4096
+#define PREFAULT_STACK_SIZE (64 * 1024)
+#define MAX_TEMPO_CHANGES 64
+
+// EVENT_ECHO comes back to the program at the tick of the last event of a
+// refill, stamped with the real time of the queue, while measuring.
+#define EVENT_ECHO SND_SEQ_EVENT_USR1
+
+// EVENT_LATE goes through the ring only, it marks input which came after the
+// stream starved.
+#define EVENT_LATE SND_SEQ_EVENT_USR2
+
+enum producer_state {
+    PRODUCER_RUNNING,
+    PRODUCER_WAITING, // For room in the ring or for input
+    PRODUCER_DONE,
+    PRODUCER_FAILED,
+};
+
+// producer translates the score into prepared events on a thread of its own.
+// It owns the translator and the stream while it runs; `stop` and `state`
+// are shared with the output thread and accessed atomically.
+struct producer {
+    struct translator *translator;
+    struct stream *stream; // Score being read, NULL if read already
+    struct event_buffer *chunk; // Events pulled from translator
+    struct ring *ring;
+    unsigned int nap; // ms to wait for room or input
+    int stop;
+    int state;
+    int client_id;
+    int port_out;
+    int port_in;
+    int queue_id;
+};
+
+// tempo_change is a tempo of the queue from `tick` on, in microseconds a
+// quarter; `ns` is the real time of the tick once an echo reached it.
+struct tempo_change {
+    snd_seq_tick_time_t tick;
+    uint64_t ns;
+    unsigned int tempo;
+};
 
+// measurement times the playback in microseconds. Echoes are expected at the
+// real time their tick falls on by the tempo changes sent to the queue.
+struct measurement {
+    struct histogram delivery; // Echo stamped by the queue after its time
+    struct histogram wakeup; // Echo read by loop after it was stamped
+    struct histogram poll; // Poll returned after its timeout
+    struct tempo_change anchor; // Last tempo change reached by the echoes
+    struct tempo_change changes[MAX_TEMPO_CHANGES]; // Sent, not reached yet
+    size_t head;
+    size_t n_changes;
+    unsigned long lost; // Tempo changes which didn't fit
+};
+
+// drain_context moves events from the ring to the queue and keeps it
+// `horizon` milliseconds ahead of its current tick, as far as the room in
+// the output pool allows. Nothing here allocates or translates: the ALSA
+// structures are allocated up front and the first failure is kept in
+// `failure` and `error` to be printed once the queue stops.
 struct drain_context {
-    struct event_list *current;
-    size_t index;
-    unsigned int offset;
+    struct producer *producer;
+    struct ring *ring;
+    struct schedule_options options;
+    unsigned int ppq;
+    int bpm; // Tempo the queue runs at
+    unsigned long underruns; // Refills which found the queue behind
+    size_t low; // Fill level of the ring seen by the refills
+    size_t high;
+    snd_seq_queue_status_t *status;
+    snd_seq_client_pool_t *room;
+    snd_seq_queue_tempo_t *tempo;
+    snd_seq_remove_events_t *remove;
+    struct pollfd *pfds;
+    int nfds;
+    struct measurement *measure; // NULL unless measuring
+    const char *failure;
+    int error; // Negative ALSA or errno code
+    bool late; // Input came after the stream starved
+    unsigned int shift; // Ticks the events of the stream are delayed by
+    int client_id;
+    int port_in;
+    int queue_id;
 };
 
+int prepare_list(struct event_buffer *list, int client_id, int port_out, int port_in, int queue_id);
+
 static volatile sig_atomic_t running = 1;
 
 static void sig_handler(int s) {
@@ -25,113 +114,383 @@ static void sig_handler(int s) {
     running = 0;
 }
 
-void clear_queue(snd_seq_t * client, int queue_id) {
-    snd_seq_remove_events_t *re = NULL;
-    int err = snd_seq_remove_events_malloc(&re);
+// fault keeps the first failure of the output thread. Function always
+// returns EXIT_FAILURE.
+int fault(struct drain_context *ctx, const char *failure, int error) {
+    if (ctx->failure == NULL) {
+        ctx->failure = failure;
+        ctx->error = error;
+    }
+    return EXIT_FAILURE;
+}
+
+// report_fault prints the failure kept by fault.
+void report_fault(struct drain_context *ctx) {
+    if (ctx->failure != NULL)
+        fprintf(stderr, "%s: %s\n", ctx->failure, snd_strerror(ctx->error));
+    ctx->failure = NULL;
+}
+
+void clear_queue(snd_seq_t * client, struct drain_context *ctx) {
+    snd_seq_remove_events_set_queue(ctx->remove, ctx->queue_id);
+    snd_seq_remove_events_set_condition(ctx->remove, SND_SEQ_REMOVE_OUTPUT | SND_SEQ_REMOVE_IGNORE_OFF);
+
+    int err = snd_seq_remove_events(client, ctx->remove);
+
+    if (err < 0)
+        fault(ctx, "failed removing events", err);
+}
+
+// tempo_us returns the microseconds of a quarter at `bpm`.
+unsigned int tempo_us(int bpm) {
+    if (bpm < 1)
+        bpm = 1;
+    else if (bpm > 60000000)
+        bpm = 60000000;
+    return 60000000 / bpm;
+}
+
+// set_tempo runs the queue at ctx->bpm.
+int set_tempo(snd_seq_t * client, struct drain_context *ctx) {
+    snd_seq_queue_tempo_set_tempo(ctx->tempo, tempo_us(ctx->bpm));
+    snd_seq_queue_tempo_set_ppq(ctx->tempo, ctx->ppq);
+
+    int err = snd_seq_set_queue_tempo(client, ctx->queue_id, ctx->tempo);
+
+    if (err < 0)
+        return fault(ctx, "failed changing queue tempo", err);
+    return EXIT_SUCCESS;
+}
+
+// queue_tick returns the current tick of the queue, 0 if it can't be told.
+snd_seq_tick_time_t queue_tick(snd_seq_t *client, struct drain_context *ctx) {
+    int err = snd_seq_get_queue_status(client, ctx->queue_id, ctx->status);
 
     if (err < 0) {
-        fprintf(stderr, "failed allocating remove events structure: %s", snd_strerror(err));
-        return;
+        fault(ctx, "failed getting queue status", err);
+        return 0;
     }
-    snd_seq_remove_events_set_queue(re, queue_id);
-    snd_seq_remove_events_set_condition(re, SND_SEQ_REMOVE_OUTPUT | SND_SEQ_REMOVE_IGNORE_OFF);
-    err = snd_seq_remove_events(client, re);
+    return snd_seq_queue_status_get_tick_time(ctx->status);
+}
+
+// pool_room returns the number of events the output pool has room for.
+size_t pool_room(snd_seq_t *client, struct drain_context *ctx) {
+    int err = snd_seq_get_client_pool(client, ctx->room);
+
     if (err < 0) {
-        fprintf(stderr, "failed removing events: %s\n", snd_strerror(err));
+        fault(ctx, "failed getting client pool", err);
+        return 0;
     }
-    snd_seq_remove_events_free(re);
+    return snd_seq_client_pool_get_output_free(ctx->room);
 }
 
-int set_tempo(snd_seq_t * client, int queue_id, int bpm) {
-    snd_seq_queue_tempo_t *qt = NULL;
+// horizon_ticks returns the horizon in ticks at the current tempo.
+snd_seq_tick_time_t horizon_ticks(struct drain_context *ctx) {
+    return (unsigned long long) ctx->options.horizon * ctx->bpm * ctx->ppq / 60000;
+}
 
-    double tempo = 6e7 / (double) bpm;
+// new_measurement allocates the histograms and the tempo map starting at
+// `tempo`.
+struct measurement *new_measurement(unsigned int tempo) {
+    struct measurement *m = calloc(1, sizeof (struct measurement));
+
+    if (m == NULL)
+        return NULL;
+    init_histogram(&m->delivery, "delivery");
+    init_histogram(&m->wakeup, "wakeup");
+    init_histogram(&m->poll, "poll");
+    m->anchor = (struct tempo_change) {.tick = 0,.ns = 0,.tempo = tempo};
+    return m;
+}
 
-    int err = snd_seq_queue_tempo_malloc(&qt);
+// measure_tempo notes a tempo change sent to the queue.
+void measure_tempo(struct measurement *m, snd_seq_tick_time_t tick, unsigned int tempo) {
+    if (m->n_changes == MAX_TEMPO_CHANGES) {
+        m->lost++;
+        return;
+    }
+    m->changes[(m->head + m->n_changes++) % MAX_TEMPO_CHANGES] = (struct tempo_change) {.tick = tick,.tempo = tempo};
+}
 
-    if (err < 0) {
-        fprintf(stderr, "failed allocating queue tempo structure: %s\n", snd_strerror(err));
-        return EXIT_FAILURE;
+// tick_ns returns the real time of `tick`. Ticks are asked for in order.
+uint64_t tick_ns(struct measurement *m, snd_seq_tick_time_t tick, unsigned int ppq) {
+    struct tempo_change *a = &m->anchor;
+
+    while (m->n_changes > 0 && m->changes[m->head].tick <= tick) {
+        struct tempo_change *c = &m->changes[m->head];
+
+        c->ns = a->ns + (uint64_t) (c->tick - a->tick) * a->tempo * 1000 / ppq;
+        *a = *c;
+        m->head = (m->head + 1) % MAX_TEMPO_CHANGES;
+        m->n_changes--;
     }
+    return a->ns + (uint64_t) (tick - a->tick) * a->tempo * 1000 / ppq;
+}
+
+// real_ns returns a real time of the queue in nanoseconds.
+uint64_t real_ns(const snd_seq_real_time_t *t) {
+    return (uint64_t) t->tv_sec * 1000000000ULL + t->tv_nsec;
+}
 
-    snd_seq_queue_tempo_set_tempo(qt, (unsigned int) tempo);
-    snd_seq_queue_tempo_set_ppq(qt, PULSE_PER_QUARTER);
-    err = snd_seq_set_queue_tempo(client, queue_id, qt);
+// late_us returns microseconds from `expected` to `actual`, 0 if early.
+uint64_t late_us(uint64_t expected, uint64_t actual) {
+    return actual > expected ? (actual - expected) / 1000 : 0;
+}
+
+// measure_echo records how late an echo was stamped and read.
+void measure_echo(snd_seq_t *client, struct drain_context *ctx, snd_seq_event_t *e) {
+    struct measurement *m = ctx->measure;
+    uint64_t stamped = real_ns(&e->time.time);
+    int err = snd_seq_get_queue_status(client, ctx->queue_id, ctx->status);
+
+    histogram_add(&m->delivery, late_us(tick_ns(m, e->data.raw32.d[0], ctx->ppq), stamped));
     if (err < 0) {
-        fprintf(stderr, "failed changing queue tempo: %s\n", snd_strerror(err));
-        snd_seq_queue_tempo_free(qt);
-        return EXIT_FAILURE;
+        fault(ctx, "failed getting queue status", err);
+        return;
     }
+    histogram_add(&m->wakeup, late_us(stamped, real_ns(snd_seq_queue_status_get_real_time(ctx->status))));
+}
+
+// send_echo schedules an echo at `tick`.
+int send_echo(snd_seq_t *client, struct drain_context *ctx, snd_seq_tick_time_t tick) {
+    snd_seq_event_t echo;
+
+    snd_seq_ev_clear(&echo);
+    echo.type = EVENT_ECHO;
+    echo.time.tick = tick;
+    echo.queue = ctx->queue_id;
+    echo.data.raw32.d[0] = tick;
+    snd_seq_ev_set_dest(&echo, ctx->client_id, ctx->port_in);
 
-    snd_seq_queue_tempo_free(qt);
+    int err = snd_seq_event_output(client, &echo);
+
+    if (err < 0)
+        return fault(ctx, "failed outputing echo", err);
     return EXIT_SUCCESS;
 }
 
-int drain_events(struct event_list *list, snd_seq_t *client, struct drain_context *ctx, int n, snd_seq_event_t usr1) {
+// producer_set publishes the state of the producer.
+void producer_set(struct producer *p, int state) {
+    __atomic_store_n(&p->state, state, __ATOMIC_RELEASE);
+}
 
-    size_t i = ctx->index;
-    struct event_list *entry = ctx->current;
-    if (entry == NULL)
-        return EXIT_SUCCESS;
-    
-    for (int k = 0; k < n; k++) {
-
-        snd_seq_event_t e = entry->e;
-        e.time.tick += ctx->offset;
-
-        if (i % DEFAULT_DRAIN_SIZE == (DEFAULT_DRAIN_SIZE - 1)) {
-            usr1.time.tick = e.time.tick;
-            int err = snd_seq_event_output(client, &usr1);
-            if (err < 0) {
-                fprintf(stderr, "failed outputing event: %s\n", snd_strerror(err));
-                return EXIT_FAILURE;
+int producer_state(struct producer *p) {
+    return __atomic_load_n(&p->state, __ATOMIC_ACQUIRE);
+}
+
+// wait_input waits a nap for more of the stream and reads it.
+int wait_input(struct producer *p) {
+    struct pollfd pfd = {.fd = p->stream->fd,.events = POLLIN};
+    int ret = poll(&pfd, 1, p->nap);
+
+    if (ret < 0 && errno != EINTR) {
+        fprintf(stderr, "poll error occurred: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (ret > 0)
+        return stream_read(p->stream);
+    return EXIT_SUCCESS;
+}
+
+// produce fills the ring a chunk at a time until the score is over or the
+// output thread stops it. The first events after the stream starved are
+// preceded by EVENT_LATE.
+void *produce(void *arg) {
+    struct producer *p = arg;
+    struct event_buffer *chunk = p->chunk;
+    struct timespec nap = {.tv_sec = p->nap / 1000,.tv_nsec = (p->nap % 1000) * 1000000L};
+    bool starved = false;
+
+    while (!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+        size_t n;
+
+        // Chunks go in whole
+        if (ring_room(p->ring) < DEFAULT_DRAIN_SIZE + 1) {
+            producer_set(p, PRODUCER_WAITING);
+            nanosleep(&nap, NULL);
+            continue;
+        }
+
+        chunk->size = 0;
+        if (p->stream != NULL) {
+            n = stream_pull(p->stream, chunk, DEFAULT_DRAIN_SIZE);
+            if (p->stream->failed) {
+                producer_set(p, PRODUCER_FAILED);
+                return NULL;
+            }
+            if (n == 0 && stream_starving(p->stream)) {
+                starved = true;
+                producer_set(p, PRODUCER_WAITING);
+                if (wait_input(p) == EXIT_FAILURE) {
+                    producer_set(p, PRODUCER_FAILED);
+                    return NULL;
+                }
+                continue;
+            }
+        } else {
+            n = translator_pull(p->translator, chunk, DEFAULT_DRAIN_SIZE);
+            if (translator_failed(p->translator)) {
+                producer_set(p, PRODUCER_FAILED);
+                return NULL;
             }
-            k++;
-            i++;
         }
+        if (n == 0)
+            break;
 
-        int err = snd_seq_event_output(client, &e);
+        producer_set(p, PRODUCER_RUNNING);
+        prepare_list(chunk, p->client_id, p->port_out, p->port_in, p->queue_id);
+        if (starved) {
+            snd_seq_event_t late;
 
-        if (err < 0) {
-            fprintf(stderr, "failed outputing event: %s\n", snd_strerror(err));
-            return EXIT_FAILURE;
+            snd_seq_ev_clear(&late);
+            late.type = EVENT_LATE;
+            ring_push(p->ring, &late, 1);
+            starved = false;
         }
+        ring_push(p->ring, chunk->events, n);
+    }
+    producer_set(p, PRODUCER_DONE);
+    return NULL;
+}
 
-        if (entry->end_loop)
-            ctx->offset += entry->loop_offset;
+// next_event returns the next event to be sent, NULL if there is none yet.
+// Late input is played from now on rather than all at once.
+snd_seq_event_t *next_event(snd_seq_t *client, struct drain_context *ctx) {
+    snd_seq_event_t *e;
 
-        i++;
-        entry = entry->l.next;
-        if (entry == NULL)
+    for (e = ring_peek(ctx->ring); e != NULL && e->type == EVENT_LATE; e = ring_peek(ctx->ring)) {
+        ctx->late = true;
+        ring_pop(ctx->ring);
+    }
+    if (e != NULL && ctx->late) {
+        snd_seq_tick_time_t now = queue_tick(client, ctx);
+
+        if (e->time.tick + ctx->shift < now)
+            ctx->shift = now - e->time.tick;
+        ctx->late = false;
+    }
+    return e;
+}
+
+// chord_size returns the number of events from the next one on which share
+// its tick, counting no further than `limit`.
+size_t chord_size(struct ring *r, size_t limit) {
+    snd_seq_event_t *first = ring_peek(r);
+    size_t n = 0;
+
+    for (snd_seq_event_t *e = first; e != NULL && n < limit; e = ring_at(r, n)) {
+        if (e->type == EVENT_LATE || e->time.tick != first->time.tick)
             break;
+        n++;
     }
-    ctx->current = entry;
-    ctx->index = i;
+    return n;
+}
 
-    int err = snd_seq_drain_output(client);
-    if (err < 0) {
-        fprintf(stderr, "failed draining output: %s", snd_strerror(err));
-        return EXIT_FAILURE;
+// drain_events sends the events up to the tick `until`, at most `room` of them
+// and one for the echo when measuring. A chord is never cut in two, it waits
+// for room unless it is larger than the whole pool.
+int drain_events(snd_seq_t *client, struct drain_context *ctx, snd_seq_tick_time_t until, size_t room) {
+    bool sent = false;
+    bool empty = room >= ctx->options.pool;
+    snd_seq_tick_time_t tick = 0;
+    size_t chord = 0; // Events left of the chord being sent
+
+    if (ctx->measure != NULL && room > 0)
+        room--;
+    for (size_t k = 0; k < room; k++) {
+        snd_seq_event_t *next = next_event(client, ctx);
+
+        if (next == NULL || next->time.tick + ctx->shift > until)
+            break;
+        if (chord == 0) {
+            chord = chord_size(ctx->ring, room - k + 1);
+            if (chord > room - k && !(empty && k == 0))
+                break;
+        }
+
+        snd_seq_event_t e = *next;
+
+        ring_pop(ctx->ring);
+        e.time.tick += ctx->shift;
+
+        int err = snd_seq_event_output(client, &e);
+
+        if (err < 0)
+            return fault(ctx, "failed outputing event", err);
+        if (e.type == SND_SEQ_EVENT_TEMPO) {
+            // The queue changes its tempo by itself, the horizon follows
+            // once the change is sent
+            ctx->bpm = 60000000 / e.data.queue.param.value;
+            if (ctx->measure != NULL)
+                measure_tempo(ctx->measure, e.time.tick, e.data.queue.param.value);
+        }
+
+        sent = true;
+        tick = e.time.tick;
+        chord--;
     }
+
+    if (sent && ctx->measure != NULL && send_echo(client, ctx, tick) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    int err = snd_seq_drain_output(client);
+
+    if (err < 0)
+        return fault(ctx, "failed draining output", err);
     return EXIT_SUCCESS;
 }
 
-int loop(struct event_list *list, snd_seq_t * client, struct drain_context *ctx, snd_seq_event_t usr1) {
-    int nfds = snd_seq_poll_descriptors_count(client, POLLIN);
-    struct pollfd *pfds = calloc(nfds, sizeof (struct pollfd));
-
-    if (pfds == NULL)
+// refill sends the events within the horizon the pool has room for. The next
+// event being due already means the queue ran dry before it was refilled.
+int refill(snd_seq_t *client, struct drain_context *ctx) {
+    if (producer_state(ctx->producer) == PRODUCER_FAILED)
         return EXIT_FAILURE;
 
-    snd_seq_poll_descriptors(client, pfds, nfds, POLLIN);
+    snd_seq_tick_time_t now = queue_tick(client, ctx);
+    snd_seq_event_t *e = next_event(client, ctx);
+    size_t fill = ring_fill(ctx->ring);
+
+    if (e != NULL && e->time.tick + ctx->shift < now)
+        ctx->underruns++;
+    if (fill > ctx->high)
+        ctx->high = fill;
+
+    int ret = drain_events(client, ctx, now + horizon_ticks(ctx), pool_room(client, ctx));
+
+    fill = ring_fill(ctx->ring);
+    if (fill < ctx->low)
+        ctx->low = fill;
+    return ret;
+}
+
+// loop refills the queue a few times within the horizon and on every event
+// coming back from it.
+int loop(snd_seq_t * client, struct drain_context *ctx) {
+    struct pollfd *pfds = ctx->pfds;
+    int nfds = ctx->nfds;
+
+    int timeout = ctx->options.horizon / 4 + 1;
+    struct timespec before, after;
 
     running = 1;
     while (running) {
-        int ret = poll(pfds, nfds, DEFAULT_POLL_TIMEOUT);
+        if (ctx->measure != NULL)
+            clock_gettime(CLOCK_MONOTONIC, &before);
+
+        int ret = poll(pfds, nfds, timeout);
+
+        if (ctx->measure != NULL && ret == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &after);
+
+            uint64_t slept = (after.tv_sec - before.tv_sec) * 1000000000ULL + after.tv_nsec - before.tv_nsec;
+
+            histogram_add(&ctx->measure->poll, late_us(timeout * 1000000ULL, slept));
+        }
 
         if (ret < 0) {
-            fprintf(stderr, "poll error occurred: %s", strerror(errno));
             // NOTE: not going to stop here
+            if (errno != EINTR)
+                fault(ctx, "poll error occurred", -errno);
             continue;
         }
 
@@ -139,92 +498,167 @@ int loop(struct event_list *list, snd_seq_t * client, struct drain_context *ctx,
             unsigned short revents;
             int err = snd_seq_poll_descriptors_revents(client, pfds, nfds, &revents);
 
-            if (err < 0) {
-                fprintf(stderr, "failed getting revents: %s", snd_strerror(err));
-                goto FAIL_1;
-            }
+            if (err < 0)
+                return fault(ctx, "failed getting revents", err);
 
             if (revents > 0) {
                 snd_seq_event_t *e;
                 do {
-                    snd_seq_event_input(client, &e);
+                    if (snd_seq_event_input(client, &e) < 0)
+                        break;
                     switch (e->type) {
                     case SND_SEQ_EVENT_USR0: // Stop the sequencer and program
                         //printf("got usr0; stopping poll\n");
                         running = 0;
                         break;
 
-                    case SND_SEQ_EVENT_USR1: // Drain another output
-                        //printf("got usr1 draining event\n");
-                        if (drain_events(list, client, ctx, DEFAULT_DRAIN_SIZE, usr1) == EXIT_FAILURE)
-                            goto FAIL_1;
-                        break;
-
-                    case SND_SEQ_EVENT_TEMPO: // Change tempo
-                        //printf("got tempo; changing tempo\n");
-                        set_tempo(client, e->data.queue.queue, e->data.queue.param.value);
+                    case EVENT_ECHO:
+                        if (ctx->measure != NULL)
+                            measure_echo(client, ctx, e);
                         break;
                     }
                     snd_seq_free_event(e);
                 } while (snd_seq_event_input_pending(client, 0) > 0);
             }
+
         }
+
+        if (running && refill(client, ctx) == EXIT_FAILURE)
+            return EXIT_FAILURE;
     }
 
-    free(pfds);
     return EXIT_SUCCESS;
+}
 
-FAIL_1:
-    free(pfds);
-    return EXIT_FAILURE;
+// prefault touches every page of `size` bytes at `p` so the output thread
+// doesn't fault on them once the queue runs.
+void prefault(void *p, size_t size) {
+    volatile char *c = p;
+    long page = sysconf(_SC_PAGESIZE);
+
+    for (size_t i = 0; i < size; i += page)
+        c[i] = c[i];
 }
 
-int run(struct event_list *list, snd_seq_t * client, int queue_id, snd_seq_event_t usr1) {
+// prefault_stack grows the stack of the calling thread by as much as the
+// output thread may ever use.
+void prefault_stack(void) {
+    char stack[PREFAULT_STACK_SIZE];
 
-    int err = set_tempo(client, queue_id, DEFAULT_BPM);
+    memset(stack, 0, sizeof (stack));
+    prefault(stack, sizeof (stack));
+}
 
-    if (err == EXIT_FAILURE)
+// lock_memory keeps the program in memory and faults the ring in before the
+// producer writes to it.
+int lock_memory(struct drain_context *ctx) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        fprintf(stderr, "failed locking memory: %s\n", strerror(errno));
         return EXIT_FAILURE;
+    }
+    memset(ctx->ring->events, 0, ctx->ring->capacity * sizeof (snd_seq_event_t));
+    prefault_stack();
+    return EXIT_SUCCESS;
+}
+
+// raise_priority moves the calling thread to SCHED_FIFO at the priority of
+// the options and pins it to their CPU, if any.
+int raise_priority(struct drain_context *ctx) {
+    struct sched_param param = {.sched_priority = ctx->options.priority};
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+    if (err != 0) {
+        fprintf(stderr, "failed raising priority to %d: %s\n", ctx->options.priority, strerror(err));
+        return EXIT_FAILURE;
+    }
+    if (ctx->options.cpu < 0)
+        return EXIT_SUCCESS;
+
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(ctx->options.cpu, &cpus);
+    err = pthread_setaffinity_np(pthread_self(), sizeof (cpus), &cpus);
+    if (err != 0) {
+        fprintf(stderr, "failed pinning to cpu %d: %s\n", ctx->options.cpu, strerror(err));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int run_queue(snd_seq_t * client, struct drain_context *ctx) {
+
+    int queue_id = ctx->queue_id;
+    struct producer *p = ctx->producer;
+    pthread_t thread;
+
+    int err = set_tempo(client, ctx);
+
+    if (err == EXIT_FAILURE) {
+        report_fault(ctx);
+        return EXIT_FAILURE;
+    }
+    if (ctx->options.realtime && lock_memory(ctx) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    // The producer keeps the priority of the program
+    err = pthread_create(&thread, NULL, produce, p);
+    if (err != 0) {
+        fprintf(stderr, "failed starting producer: %s\n", strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    // The ring is filled before the queue starts
+    struct timespec nap = {.tv_sec = 0,.tv_nsec = 1000000L};
+
+    while (producer_state(p) == PRODUCER_RUNNING)
+        nanosleep(&nap, NULL);
+
+    if (ctx->options.realtime && raise_priority(ctx) == EXIT_FAILURE)
+        goto FAIL_1;
 
     err = snd_seq_control_queue(client, queue_id, SND_SEQ_EVENT_START, 0, NULL);
     if (err < 0) {
         fprintf(stderr, "failed starting queue: %s\n", snd_strerror(err));
-        return EXIT_FAILURE;
+        goto FAIL_1;
     }
 
-    struct drain_context ctx = {
-        .current = list,
-        .index = 0,
-        .offset = 0,
-    };
-
-    err = drain_events(list, client, &ctx, DEFAULT_QUEUE_SIZE, usr1);
+    err = refill(client, ctx);
     if (err == EXIT_FAILURE)
         goto FAIL_1;
 
     signal(SIGINT, sig_handler); // catch ctrl+c
-    err = loop(list, client, &ctx, usr1);
+    err = loop(client, ctx);
     if (err == EXIT_FAILURE)
         goto FAIL_1;
 
-    clear_queue(client, queue_id);
+    __atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    clear_queue(client, ctx);
     snd_seq_control_queue(client, queue_id, SND_SEQ_EVENT_STOP, 0, NULL);
+    report_fault(ctx);
     sleep(1);
     return EXIT_SUCCESS;
 
 FAIL_1:
-    clear_queue(client, queue_id);
+    __atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    if (p->stream != NULL && p->stream->failed && p->stream->err != NULL)
+        fprintf(stderr, "%s", p->stream->err);
+    if (translator_failed(p->translator))
+        fprintf(stderr, "failed translating events: out of memory\n");
+    clear_queue(client, ctx);
     snd_seq_control_queue(client, queue_id, SND_SEQ_EVENT_STOP, 0, NULL);
+    report_fault(ctx);
     sleep(1);
     return EXIT_FAILURE;
 }
 
 // prepare_list fills up remaining info for events
-int prepare_list(struct event_list *list, int client_id, int port_out, int port_in, int queue_id) {
+int prepare_list(struct event_buffer *list, int client_id, int port_out, int port_in, int queue_id) {
 
-    struct event_list *loop_start = NULL, *loop_end = NULL;
-    for (struct event_list *entry = list; entry != NULL; entry = entry->l.next) {
-        snd_seq_event_t *e = &entry->e;
+    for (size_t i = 0; i < list->size; i++) {
+        snd_seq_event_t *e = &list->events[i];
 
         switch (e->type) {
 
@@ -240,46 +674,48 @@ int prepare_list(struct event_list *list, int client_id, int port_out, int port_
             e->queue = queue_id;
             break;
 
-        case SND_SEQ_EVENT_TEMPO:
-            snd_seq_ev_set_dest(e, client_id, port_in);
+        case SND_SEQ_EVENT_TEMPO: // Applied by the queue at its tick
+            snd_seq_ev_set_source(e, port_out);
+            snd_seq_ev_set_queue_tempo(e, queue_id, tempo_us(e->data.queue.param.value));
             e->queue = queue_id;
-            e->data.queue.queue = queue_id;
             break;
 
         default:
             fprintf(stderr, "unhandled midi event: %u\n", e->type);
             break;
         }
-
-        if (entry->start_loop)
-            loop_start = entry;
-        if (entry->end_loop)
-            loop_end = entry;
     }
 
-    if (loop_start != NULL && loop_end != NULL)
-        loop_end->l.next = loop_start;
-
     return EXIT_SUCCESS;
 }
 
-snd_seq_event_t prepare_usr1(int client_id, int port_in, int queue_id) {
-    snd_seq_event_t usr1;
-
-    snd_seq_ev_clear(&usr1);
-    usr1.type = SND_SEQ_EVENT_USR1;
-    snd_seq_ev_set_dest(&usr1, client_id, port_in);
-    snd_seq_ev_schedule_tick(&usr1, queue_id, 0, 0);
-    return usr1;
-}
+// stamp_input has the events coming back to `port_in` stamped with the real
+// time of the queue.
+int stamp_input(snd_seq_t *client, int port_in, int queue_id) {
+    snd_seq_port_info_t *info = NULL;
+    int err = snd_seq_port_info_malloc(&info);
 
-void break_cycle(void *element) {
-    struct event_list *e = element;
-    if (e->end_loop)
-        e->l.next = NULL;
+    if (err < 0) {
+        fprintf(stderr, "failed allocating port info: %s\n", snd_strerror(err));
+        return EXIT_FAILURE;
+    }
+    err = snd_seq_get_port_info(client, port_in, info);
+    if (err >= 0) {
+        snd_seq_port_info_set_timestamping(info, 1);
+        snd_seq_port_info_set_timestamp_real(info, 1);
+        snd_seq_port_info_set_timestamp_queue(info, queue_id);
+        err = snd_seq_set_port_info(client, port_in, info);
+    }
+    snd_seq_port_info_free(info);
+    if (err < 0) {
+        fprintf(stderr, "failed stamping in port: %s\n", snd_strerror(err));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
 }
 
-int schedule_and_loop(struct event_list *list, int target_client, int target_port) {
+int schedule_and_loop(struct translator *t, struct stream *s, int target_client, int target_port,
+  struct schedule_options options) {
 
     snd_seq_t *client;
     int err = snd_seq_open(&client, "default", SND_SEQ_OPEN_DUPLEX, 0);
@@ -332,25 +768,99 @@ int schedule_and_loop(struct event_list *list, int target_client, int target_por
     }
 
     // Valgrind reporting error here!
-    err = snd_seq_set_client_pool_output(client, DEFAULT_QUEUE_SIZE);
+    err = snd_seq_set_client_pool_output(client, options.pool);
     if (err < 0) {
         fprintf(stderr, "failed setting pool output: %s\n", snd_strerror(err));
         goto FAIL_5;
     }
+    if (options.measure && stamp_input(client, port_in, queue_id) == EXIT_FAILURE)
+        goto FAIL_5;
 
-    int ret = prepare_list(list, client_id, port_out, port_in, queue_id);
+    struct event_buffer *chunk = new_event_buffer(DEFAULT_DRAIN_SIZE);
+    struct ring *ring = new_ring(options.pool * 2 > DEFAULT_RING_SIZE ? options.pool * 2 : DEFAULT_RING_SIZE);
+    snd_seq_queue_status_t *status = NULL;
+    snd_seq_client_pool_t *room = NULL;
+    snd_seq_queue_tempo_t *tempo = NULL;
+    snd_seq_remove_events_t *remove = NULL;
+    int nfds = snd_seq_poll_descriptors_count(client, POLLIN);
+    struct pollfd *pfds = calloc(nfds, sizeof (struct pollfd));
+    int bpm = translator_bpm(t) > 0 ? translator_bpm(t) : DEFAULT_BPM;
+    struct measurement *measure = options.measure ? new_measurement(tempo_us(bpm)) : NULL;
 
-    if (ret == EXIT_FAILURE)
-        goto FAIL_5;
+    if (chunk == NULL || ring == NULL || pfds == NULL || (options.measure && measure == NULL)) {
+        fprintf(stderr, "failed allocating event buffers\n");
+        goto FAIL_6;
+    }
+    if (snd_seq_queue_status_malloc(&status) < 0 || snd_seq_client_pool_malloc(&room) < 0
+      || snd_seq_queue_tempo_malloc(&tempo) < 0 || snd_seq_remove_events_malloc(&remove) < 0) {
+        fprintf(stderr, "failed allocating queue status structures\n");
+        goto FAIL_6;
+    }
+    snd_seq_poll_descriptors(client, pfds, nfds, POLLIN);
 
-    snd_seq_event_t usr1 = prepare_usr1(client_id, port_in, queue_id);
+    struct producer producer = {
+        .translator = t,
+        .stream = s,
+        .chunk = chunk,
+        .ring = ring,
+        .nap = options.horizon / 8 + 1,
+        .stop = 0,
+        .state = PRODUCER_RUNNING,
+        .client_id = client_id,
+        .port_out = port_out,
+        .port_in = port_in,
+        .queue_id = queue_id,
+    };
+    struct drain_context ctx = {
+        .producer = &producer,
+        .ring = ring,
+        .options = options,
+        .ppq = translator_ppq(t),
+        .bpm = bpm,
+        .underruns = 0,
+        .low = ring->capacity,
+        .high = 0,
+        .status = status,
+        .room = room,
+        .tempo = tempo,
+        .remove = remove,
+        .pfds = pfds,
+        .nfds = nfds,
+        .measure = measure,
+        .failure = NULL,
+        .error = 0,
+        .late = false,
+        .shift = 0,
+        .client_id = client_id,
+        .port_in = port_in,
+        .queue_id = queue_id,
+    };
 
-    ret = run(list, client, queue_id, usr1);
+    int ret = run_queue(client, &ctx);
+
+    if (ctx.underruns > 0)
+        fprintf(stderr, "queue ran dry %lu times, consider a longer horizon or a larger pool\n", ctx.underruns);
+    if (options.debug)
+        fprintf(stderr, "ring filled between %zu and %zu of %zu events\n", ctx.low > ctx.high ? 0 : ctx.low, ctx.high,
+          ring->capacity);
+    if (measure != NULL) {
+        print_histogram(&measure->delivery, stderr);
+        print_histogram(&measure->wakeup, stderr);
+        print_histogram(&measure->poll, stderr);
+        if (measure->lost > 0)
+            fprintf(stderr, "%lu tempo changes weren't measured\n", measure->lost);
+    }
+    free(measure);
+    snd_seq_remove_events_free(remove);
+    snd_seq_queue_tempo_free(tempo);
+    snd_seq_client_pool_free(room);
+    snd_seq_queue_status_free(status);
+    free(pfds);
+    free_ring(ring);
+    free_event_buffer(chunk);
     if (ret == EXIT_FAILURE)
         goto FAIL_5;
 
-    list_apply(list, break_cycle);
-
     snd_seq_free_queue(client, queue_id);
     snd_seq_disconnect_to(client, port_out, target_client, target_port);
     snd_seq_delete_simple_port(client, port_in);
@@ -358,6 +868,15 @@ int schedule_and_loop(struct event_list *list, int target_client, int target_por
     snd_seq_close(client);
     return EXIT_SUCCESS;
 
+FAIL_6:
+    free(measure);
+    snd_seq_remove_events_free(remove);
+    snd_seq_queue_tempo_free(tempo);
+    snd_seq_client_pool_free(room);
+    snd_seq_queue_status_free(status);
+    free(pfds);
+    free_ring(ring);
+    free_event_buffer(chunk);
 FAIL_5:
     snd_seq_free_queue(client, queue_id);
 FAIL_4:
@@ -1,5 +1,37 @@
 #pragma once
 
+#include "stream.h"
 #include "translator.h"
 
-int schedule_and_loop(struct event_list *list, int target_client, int target_port);
+#define DEFAULT_HORIZON 250 // ms
+#define DEFAULT_POOL_SIZE 128 // events
+#define DEFAULT_PRIORITY 50 // SCHED_FIFO
+
+// schedule_options tune the queue. It is kept `horizon` milliseconds ahead of
+// the time it plays, in an output pool of `pool` events. With `debug` the fill
+// level of the ring between the threads is reported at the end.
+//
+// With `realtime` the memory of the program is locked and the buffers of the
+// output thread are prefaulted before the queue starts; the output thread then
+// runs under SCHED_FIFO at `priority`, pinned to `cpu` unless it is negative.
+//
+// With `measure` echoes are scheduled back to the program along the score.
+// How late the queue stamped them, how late the program read them and how
+// late poll returned after its timeout are printed as p50/p99/max at the end.
+struct schedule_options {
+    unsigned int horizon;
+    size_t pool;
+    bool debug;
+    bool realtime;
+    int priority;
+    int cpu;
+    bool measure;
+};
+
+// schedule_and_loop plays the score until its end or until interrupted. The
+// score is translated on a thread of its own into a ring of prepared events,
+// which the calling thread moves into the queue. With a stream `t` is its
+// translator and the score is read as it is played. The times the queue ran
+// dry are reported at the end.
+int schedule_and_loop(struct translator *t, struct stream *s, int target_client, int target_port,
+  struct schedule_options options);
@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bind.h"
+#include "compiler.h"
+#include "parser.h"
+#include "reader.h"
+#include "stream.h"
+#include "translator.h"
+
+#define DEFAULT_READ_SIZE 65536
+
+struct stream *new_stream(const char *filename, int fd) {
+    struct stream *s = calloc(1, sizeof (struct stream));
+
+    if (s == NULL)
+        return NULL;
+
+    s->filename = filename;
+    s->fd = fd;
+    s->symbols = new_symbol_table();
+    s->compiler = new_compiler();
+    if (s->symbols == NULL || s->compiler == NULL)
+        goto FAIL_1;
+
+    s->translator = new_translator(compiler_bytecode(s->compiler));
+    if (s->translator == NULL)
+        goto FAIL_1;
+
+    // Score goes on as long as there is input
+    if (!translator_resume(s->translator, NULL, 0, true))
+        goto FAIL_2;
+    return s;
+
+FAIL_2:
+    free_translator(s->translator);
+FAIL_1:
+    free_compiler(s->compiler);
+    free_symbol_table(s->symbols);
+    free(s);
+    return NULL;
+}
+
+void free_stream(struct stream *s) {
+    if (s == NULL)
+        return;
+    free_translator(s->translator);
+    free_compiler(s->compiler);
+    free_symbol_table(s->symbols);
+    free(s->buffer);
+    free(s->err);
+    free(s);
+}
+
+// reserve makes room for `len` more characters of input.
+bool reserve(struct stream *s, size_t len) {
+    if (s->size + len <= s->capacity)
+        return true;
+
+    size_t capacity = s->capacity == 0 ? DEFAULT_READ_SIZE : s->capacity;
+
+    while (capacity < s->size + len)
+        capacity *= 2;
+
+    void *ptr = realloc(s->buffer, capacity);
+
+    if (ptr == NULL)
+        return false;
+    s->buffer = ptr;
+    s->capacity = capacity;
+    return true;
+}
+
+int stream_read(struct stream *s) {
+    if (s->closed)
+        return EXIT_SUCCESS;
+    if (!reserve(s, DEFAULT_READ_SIZE)) {
+        fprintf(stderr, "failed allocating input buffer\n");
+        return EXIT_FAILURE;
+    }
+
+    ssize_t n = read(s->fd, &s->buffer[s->size], DEFAULT_READ_SIZE);
+
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return EXIT_SUCCESS;
+        fprintf(stderr, "failed reading %s: %s\n", s->filename, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (n == 0)
+        s->closed = true;
+    s->size += n;
+    return EXIT_SUCCESS;
+}
+
+bool stream_write(struct stream *s, const char *in, size_t len) {
+    if (!reserve(s, len))
+        return false;
+    memcpy(&s->buffer[s->size], in, len);
+    s->size += len;
+    return true;
+}
+
+void stream_close(struct stream *s) {
+    s->closed = true;
+}
+
+// prune drops the code run through since the last time it doubled.
+bool prune(struct stream *s, size_t **map, size_t *n_map) {
+    struct bytecode *b = compiler_bytecode(s->compiler);
+
+    *map = NULL;
+    *n_map = 0;
+    if (b->size <= s->pruned * 2)
+        return true;
+
+    *map = calloc(b->n_functions + 1, sizeof (size_t));
+    if (*map == NULL)
+        return false;
+    *n_map = b->n_functions;
+    if (!prune_bytecode(s->compiler, *map))
+        return false;
+    s->pruned = b->size;
+    return true;
+}
+
+// compile_next compiles the complete statements of the input and lets the
+// translator go on with them. Function returns false if there is nothing new
+// to translate.
+bool compile_next(struct stream *s) {
+    if (s->failed || !translator_waiting(s->translator))
+        return false;
+
+    size_t used = s->size;
+    struct parse_result res = s->closed ? read_rest(s->filename, s->buffer, s->size, s->position)
+      : read_statements(s->filename, s->buffer, s->size, s->position, &used);
+
+    if (res.err != NULL) {
+        s->err = res.err;
+        res.err = NULL;
+        goto FAIL_1;
+    }
+    if (res.ast == NULL) {
+        fprintf(stderr, "failed parsing score\n");
+        goto FAIL_1;
+    }
+    if (!s->closed && res.ast->nodes[res.ast->root].n == 0) {
+        free_parse_result(&res);
+        return false;
+    }
+
+    struct bind_result bound = bind_more(s->filename, res.ast, s->symbols);
+
+    if (bound.symbols == NULL) {
+        fprintf(stderr, "failed binding labels\n");
+        goto FAIL_1;
+    }
+    if (bound.err != NULL) {
+        s->err = bound.err;
+        goto FAIL_1;
+    }
+
+    size_t *map;
+    size_t n_map;
+
+    if (!prune(s, &map, &n_map) || !compile_piece(s->compiler, res.ast, s->symbols)) {
+        fprintf(stderr, "failed compiling score\n");
+        goto FAIL_2;
+    }
+    report_off_grid(compiler_bytecode(s->compiler), s->filename, stderr);
+    if (!translator_resume(s->translator, map, n_map, !s->closed)) {
+        fprintf(stderr, "failed preparing translator\n");
+        goto FAIL_2;
+    }
+    free(map);
+    free_parse_result(&res);
+
+    if (used > 0) {
+        s->position = advance(s->position, s->buffer, used);
+        memmove(s->buffer, &s->buffer[used], s->size - used);
+        s->size -= used;
+    }
+    return true;
+
+FAIL_2:
+    free(map);
+FAIL_1:
+    free_parse_result(&res);
+    s->failed = true;
+    return false;
+}
+
+size_t stream_pull(struct stream *s, struct event_buffer *out, size_t n) {
+    size_t moved = 0;
+
+    while (moved < n) {
+        moved += translator_pull(s->translator, out, n - moved);
+        if (translator_failed(s->translator)) {
+            s->failed = true;
+            break;
+        }
+        if (moved < n && !compile_next(s))
+            break;
+    }
+    return moved;
+}
+
+bool stream_starving(struct stream *s) {
+    return !s->closed && !s->failed && translator_waiting(s->translator);
+}
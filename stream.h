@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "bind.h"
+#include "compiler.h"
+#include "reader.h"
+#include "translator.h"
+
+// stream plays a score while it is being read. Input is taken in bulk and
+// only when the translator has run through everything compiled so far, then
+// the complete statements of it are read, bound against the labels defined
+// before, compiled and appended where the translation stopped. What has been
+// played is pruned from the bytecode, so memory depends on the labeled sheets
+// and on one read of the input, not on the length of the score.
+//
+// A statement is complete once something follows it. The last tone is kept
+// back in the same way: a tie of the next statement may still extend it.
+struct stream {
+    const char *filename;
+    int fd; // Input, -1 when written to by stream_write
+    char *buffer; // Input not compiled yet
+    size_t size;
+    size_t capacity;
+    struct position position; // Position of the buffer within the score
+    struct symbol_table *symbols;
+    struct compiler *compiler;
+    struct translator *translator;
+    size_t pruned; // Size of the bytecode after it was pruned last time
+    bool closed; // End of input reached
+    bool failed;
+    char *err; // Error of the score, if that is why it failed
+};
+
+struct stream *new_stream(const char *filename, int fd);
+void free_stream(struct stream *s);
+
+// stream_read reads what is available from the input of the stream at once;
+// the end of the file closes the stream. stream_write appends `len`
+// characters of input and stream_close ends it.
+int stream_read(struct stream *s);
+bool stream_write(struct stream *s, const char *in, size_t len);
+void stream_close(struct stream *s);
+
+// stream_pull is translator_pull of the score read so far. Fewer than `n`
+// events are pulled when the input is needed to go on, when the score is over
+// or on an error, which marks the stream failed. Errors of the score are kept
+// in `err`, the other ones are printed to stderr.
+size_t stream_pull(struct stream *s, struct event_buffer *out, size_t n);
+
+// stream_starving returns true if nothing can be pulled until more input is
+// read.
+bool stream_starving(struct stream *s);
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utest.h"
+#include "../bind.h"
+
+struct test_case {
+    char *source;
+    char *expected;
+};
+
+typedef struct test_case tc;
+
+char *get_symbols(struct bind_result *r);
+
+void test_symbols(struct test *t) {
+    tc *cases[] = {
+        &(tc) {"4{c}", ""},
+        &(tc) {"a:4{c} b:4{d}", "a b"},
+        &(tc) {"main:8{label:1{c} 2{x:4{d}}}", "main main.label main.x"},
+        &(tc) {"a:4{b:4{}} a:4{b:4{} c:4{}}", "a a.b a.c"},
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]->source);
+        struct bind_result bound = bind("<test>", res.ast);
+
+        char *actual = get_symbols(&bound);
+        if (strcmp(cases[i]->expected, actual) != 0)
+            failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
+
+        free(actual);
+        free_bind_result(&bound);
+        free_parse_result(&res);
+    }
+}
+
+// References point to the first definition of the label
+void test_target(struct test *t) {
+    struct parse_result res = parse("<test>", "main:8{label:1{c}} main:8{label:1{d}} {main.label}x2 {main}");
+    struct bind_result bound = bind("<test>", res.ast);
+
+    struct ast *a = res.ast;
+    struct node *root = &a->nodes[a->root];
+    struct node *first = child(a, root, 0);
+
+    if (bound.err != NULL)
+        failf(t, "unexpected error: %s", bound.err);
+    if (&a->nodes[child(a, root, 2)->u.reference.target] != child(a, first, 0))
+        fail(t, "{main.label} points to a wrong sheet");
+    if (&a->nodes[child(a, root, 3)->u.reference.target] != first)
+        fail(t, "{main} points to a wrong sheet");
+
+    free_bind_result(&bound);
+    free_parse_result(&res);
+}
+
+void test_unresolved(struct test *t) {
+    tc *cases[] = {
+        &(tc) {"a:4{c} {a}", ""},
+        &(tc) {"{a}", "<test>: error: unresolved reference {a}\n"},
+        &(tc) {"{a} a:4{c}", "<test>: error: reference {a} comes before its definition\n"},
+        &(tc) {"a:4{b:4{c}} {b} {a.c} {a.b}",
+          "<test>: error: unresolved reference {b}\n<test>: error: unresolved reference {a.c}\n"},
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]->source);
+        struct bind_result bound = bind("<test>", res.ast);
+
+        char *actual = bound.err == NULL ? "" : bound.err;
+        if (strcmp(cases[i]->expected, actual) != 0)
+            failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
+
+        free_bind_result(&bound);
+        free_parse_result(&res);
+    }
+}
+
+// Hash table keeps working as it grows
+void test_many_symbols(struct test *t) {
+    size_t n = 10000;
+    char *source = calloc(n * 16, sizeof (char));
+    size_t end = 0;
+
+    for (size_t i = 0; i < n; i++)
+        end += sprintf(&source[end], "s%zu:4{c} ", i);
+
+    struct parse_result res = parse("<test>", source);
+    struct bind_result bound = bind("<test>", res.ast);
+
+    if (bound.symbols->size != n)
+        failf(t, "expected %zu symbols got %zu", n, bound.symbols->size);
+    for (size_t i = 0; i < n; i++) {
+        char name[16];
+
+        sprintf(name, "s%zu", i);
+        struct symbol *s = find_symbol(bound.symbols, name);
+
+        if (s == NULL || &res.ast->nodes[s->node] != child(res.ast, &res.ast->nodes[res.ast->root], i)) {
+            failf(t, "symbol %s not found", name);
+            break;
+        }
+    }
+    if (find_symbol(bound.symbols, "missing") != NULL)
+        fail(t, "found a missing symbol");
+
+    free_bind_result(&bound);
+    free_parse_result(&res);
+    free(source);
+}
+
+int main(int argc, char **argv) {
+
+    static test_fn tests[] = {
+        test_symbols,
+        test_target,
+        test_unresolved,
+        test_many_symbols,
+        NULL,
+    };
+
+    if (run("Bind", tests))
+        return EXIT_SUCCESS;
+    return EXIT_FAILURE;
+}
+
+char *get_symbols(struct bind_result *r) {
+    char *buffer = NULL;
+    size_t size = 0;
+
+    FILE* f = open_memstream(&buffer, &size);
+    for (size_t i = 0; i < r->symbols->size; i++) {
+        if (i > 0)
+            fprintf(f, " ");
+        fprintf(f, "%s", r->symbols->symbols[i].name);
+    }
+    fclose(f);
+
+    return buffer;
+}
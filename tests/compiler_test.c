@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utest.h"
+#include "../compiler.h"
+
+struct test_case {
+    char *source;
+    char *expected;
+};
+
+typedef struct test_case tc;
+
+char *get_bytecode(struct parse_result *r);
+
+void test_note(struct test *t) {
+    tc *cases[] = {
+        &(tc) {"8{c}", "#0: step 48 pure\n     0  NOTE ch:0 n:60 v:127\n     1  RET\nmain:\n     2  CALL #0\n     3  EOF\n     4  HALT\n"},
+        &(tc) {"8{ch2:c#4!4 d}", "#0: step 48 pure\n     0  NOTE ch:2 n:49 v:56\n     1  NOTE ch:2 n:50 v:56\n     2  RET\nmain:\n     3  CALL #0\n     4  EOF\n     5  HALT\n"},
+        &(tc) {"8{+1 c}", "#0: step 48\n     0  INTERVAL 1\n     1  NOTE ch:0 n:60 v:127\n     2  RET\nmain:\n     3  CALL #0\n     4  EOF\n     5  HALT\n"},
+        &(tc) {"8{[c +4 g] -}", "#0: step 48 pure\n     0  CHORD on\n     1  NOTE ch:0 n:60 v:127\n     2  INTERVAL 4\n     3  NOTE ch:0 n:67 v:127\n     4  CHORD off\n     5  TIE\n     6  RET\nmain:\n     7  CALL #0\n     8  EOF\n     9  HALT\n"},
+        &(tc) {"8{(c +2 -)}", "#0: step 48 pure\n     0  LEGATO on\n     1  NOTE ch:0 n:60 v:127\n     2  INTERVAL 2\n     3  LEGATO off\n     4  TIE\n     5  RET\nmain:\n     6  CALL #0\n     7  EOF\n     8  HALT\n"},
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]->source);
+
+        char *actual = get_bytecode(&res);
+        if (strcmp(cases[i]->expected, actual) != 0)
+            failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
+
+        free(actual);
+        free_parse_result(&res);
+    }
+}
+
+void test_call(struct test *t) {
+    tc *cases[] = {
+        &(tc) {"8{c}x3", "#0: step 48 pure\n     0  NOTE ch:0 n:60 v:127\n     1  RET\nmain:\n     2  REPEAT 3\n     3  CALL #0\n     4  EOF\n     5  HALT\n"},
+        &(tc) {"a:4{b:8{c}}off {a.b}loop", "a.b: step 12 pure\n     0  NOTE ch:0 n:60 v:127\n     1  RET\na: step 96 pure\n     2  CALL a.b\n     3  RET\nmain:\n     4  SKIP ch:0 n:60 v:127\n     5  LOOP\n     6  CALL a.b\n     7  EOF\n     8  HALT\n"},
+        &(tc) {"a:8{+1 .}off {a}", "a: step 48\n     0  INTERVAL 1\n     1  REST\n     2  RET\nmain:\n     3  REPEAT 0\n     4  CALL a\n     5  CALL a\n     6  EOF\n     7  HALT\n"},
+        &(tc) {"a:8{c .}off", "a: step 48 pure\n     0  NOTE ch:0 n:60 v:127\n     1  REST\n     2  RET\nmain:\n     3  SKIP ch:0 n:60 v:127 rest\n     4  EOF\n     5  HALT\n"},
+        &(tc) {"[8{c} {missing} 4{d}]", "#0: step 48 pure\n     0  NOTE ch:0 n:60 v:127\n     1  RET\n#1: step 96 pure\n     2  NOTE ch:0 n:62 v:127\n     3  RET\nmain:\n     4  VOICES\n     5  CALL #0\n     6  VOICE\n     7  VOICE\n     8  CALL #1\n     9  MERGE\n    10  EOF\n    11  HALT\n"},
+        &(tc) {"{missing} 120bpm", "main:\n     0  TEMPO 120\n     1  EOF\n     2  HALT\n"},
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]->source);
+
+        char *actual = get_bytecode(&res);
+        if (strcmp(cases[i]->expected, actual) != 0)
+            failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
+
+        free(actual);
+        free_parse_result(&res);
+    }
+}
+
+// Referenced sheet leaves its channel, octave and velocity behind
+void test_reference_context(struct test *t) {
+    tc c = {"a:8{ch2:e3}off {a} 8{d}", "a: step 48 pure\n     0  NOTE ch:2 n:40 v:127\n     1  RET\n#1: step 48 pure\n     2  NOTE ch:2 n:38 v:127\n     3  RET\nmain:\n     4  SKIP ch:2 n:40 v:127\n     5  CALL a\n     6  CALL #1\n     7  EOF\n     8  HALT\n"};
+
+    struct parse_result res = parse("<test>", c.source);
+
+    char *actual = get_bytecode(&res);
+    if (strcmp(c.expected, actual) != 0)
+        failf(t, "expected: %s got: %s", c.expected, actual);
+
+    free(actual);
+    free_parse_result(&res);
+}
+
+struct ppq_case {
+    char *source;
+    unsigned int ppq;
+    char *steps;
+    char *off_grid;
+};
+
+// Steps are whole numbers of ticks whenever the pulse allows
+void test_ppq(struct test *t) {
+    struct ppq_case *cases[] = {
+        &(struct ppq_case) {"8{c}", 96, "48 ", ""},
+        &(struct ppq_case) {"4{3{c d e}}", 96, "96 32 ", ""},
+        &(struct ppq_case) {"4{c} 7{d} 2to3{e}", 672, "672 384 1792 ", ""},
+        &(struct ppq_case) {"5{c 7{d}}", 3360, "2688 384 ", ""},
+        &(struct ppq_case) {"4{c}\n  65537{d} 3{e}\n", 96, "96 0 128 ", "<test>:2:3: warning: sheet is not in pulse at 96 ticks a quarter, its steps are rounded\n"},
+        &(struct ppq_case) {"a:2to3{c}off 4{1to0{d}}", 96, "256 96 0 ", "<test>:1:16: warning: sheet is not in pulse at 96 ticks a quarter, its steps are rounded\n"},
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]->source);
+        struct bind_result bound = bind("<test>", res.ast);
+        struct bytecode *b = compile(res.ast, bound.symbols);
+        char *steps = NULL;
+        char *off_grid = NULL;
+        size_t size = 0;
+
+        FILE *f = open_memstream(&steps, &size);
+        for (size_t j = 0; j < b->n_functions; j++)
+            fprintf(f, "%u ", b->functions[j].step);
+        fclose(f);
+        f = open_memstream(&off_grid, &size);
+        report_off_grid(b, "<test>", f);
+        report_off_grid(b, "<test>", f);
+        fclose(f);
+
+        if (b->ppq != cases[i]->ppq)
+            failf(t, "  source: %s\n    expected ppq: %u\n         got: %u", cases[i]->source, cases[i]->ppq, b->ppq);
+        if (strcmp(cases[i]->steps, steps) != 0)
+            failf(t, "  source: %s\n    expected steps: %s\n         got: %s", cases[i]->source, cases[i]->steps, steps);
+        if (strcmp(cases[i]->off_grid, off_grid) != 0)
+            failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->off_grid, off_grid);
+
+        free(steps);
+        free(off_grid);
+        free_bytecode(b);
+        free_bind_result(&bound);
+        free_parse_result(&res);
+    }
+}
+
+struct bpm_case {
+    char *source;
+    int bpm;
+};
+
+// A bpm at tick 0 is the initial tempo, a later one is only a tempo change
+void test_first_bpm(struct test *t) {
+    struct bpm_case *cases[] = {
+        &(struct bpm_case) {"4{c}", 0},
+        &(struct bpm_case) {"90bpm 4{c} 140bpm", 90},
+        &(struct bpm_case) {"4{c} 4{d} 75bpm 4{e} 200bpm", 0},
+        &(struct bpm_case) {"a:4{c} 60bpm {a} 180bpm", 0},
+        &(struct bpm_case) {"a:4{c}off 60bpm {a} 180bpm", 60},
+        &(struct bpm_case) {"CC1:2 110bpm 4{c} 180bpm", 110},
+        &(struct bpm_case) {"[4{c} 8{d}] 110bpm", 0},
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]->source);
+        struct bind_result bound = bind("<test>", res.ast);
+        struct bytecode *b = compile(res.ast, bound.symbols);
+
+        if (b->bpm != cases[i]->bpm)
+            failf(t, "  source: %s\n    expected bpm: %d\n         got: %d", cases[i]->source, cases[i]->bpm, b->bpm);
+
+        free_bytecode(b);
+        free_bind_result(&bound);
+        free_parse_result(&res);
+    }
+}
+
+int main(int argc, char **argv) {
+
+    static test_fn tests[] = {
+        test_note,
+        test_call,
+        test_reference_context,
+        test_ppq,
+        test_first_bpm,
+        NULL,
+    };
+
+    if (run("Compiler", tests))
+        return EXIT_SUCCESS;
+    return EXIT_FAILURE;
+}
+
+char *get_bytecode(struct parse_result *r) {
+    char *buffer = NULL;
+    size_t size = 0;
+
+    struct bind_result bound = bind("<test>", r->ast);
+    struct bytecode *b = compile(r->ast, bound.symbols);
+
+    FILE* f = open_memstream(&buffer, &size);
+    print_bytecode(b, f);
+    fclose(f);
+
+    free_bytecode(b);
+    free_bind_result(&bound);
+    return buffer;
+}
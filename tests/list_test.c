@@ -242,6 +242,156 @@ void test_sort(struct test *t) {
     }
 }
 
+struct item {
+    struct list l;
+    int key;
+    int order;
+};
+
+bool compare_key(void *item1, void *item2) {
+    struct item *i1 = item1;
+    struct item *i2 = item2;
+    return i1->key > i2->key;
+}
+
+void test_handle_append(struct test *t) {
+    Person ps[3] = {{.name = "Maria"}, {.name = "Marta"}, {.name = "Mima"}};
+    struct list_handle h = {0};
+
+    for (size_t i = 0; i < 3; i++)
+        list_handle_append(&h, &ps[i]);
+
+    if (h.head != &ps[0])
+        fail(t, "head should point to Maria");
+    if (h.tail != &ps[2])
+        fail(t, "tail should point to Mima");
+    if (h.size != 3 || list_size(h.head) != 3)
+        failf(t, "expected size 3 got %zu", h.size);
+}
+
+void test_handle_push_pop(struct test *t) {
+    Person ps[3] = {{.name = "Maria"}, {.name = "Marta"}, {.name = "Mima"}};
+    struct list_handle h = {0};
+
+    for (size_t i = 0; i < 3; i++)
+        list_handle_push(&h, &ps[i]);
+
+    for (int i = 2; i >= 0; i--) {
+        Person *p = list_handle_pop(&h);
+        if (p != &ps[i])
+            failf(t, "expected %s got %s", ps[i].name, p == NULL ? "NULL" : p->name);
+    }
+
+    if (h.head != NULL || h.tail != NULL || h.size != 0)
+        fail(t, "handle should be empty");
+    if (list_handle_pop(&h) != NULL)
+        fail(t, "pop on empty handle should return NULL");
+}
+
+void test_handle_splice(struct test *t) {
+    Person ps[4] = {{.name = "Maria"}, {.name = "Marta"}, {.name = "Mima"}, {.name = "Monika"}};
+    struct list_handle h1 = {0}, h2 = {0}, empty = {0};
+
+    list_handle_append(&h1, &ps[0]);
+    list_handle_append(&h1, &ps[1]);
+    list_handle_append(&h2, &ps[2]);
+    list_handle_append(&h2, &ps[3]);
+
+    list_handle_splice(&h1, &empty);
+    list_handle_splice(&h1, &h2);
+
+    if (h1.size != 4 || list_size(h1.head) != 4)
+        failf(t, "expected size 4 got %zu", h1.size);
+    if (h1.tail != &ps[3])
+        fail(t, "tail should point to Monika");
+    if (h2.head != NULL || h2.size != 0)
+        fail(t, "spliced handle should be empty");
+
+    list_handle_splice(&empty, &h1);
+    if (empty.head != &ps[0] || empty.tail != &ps[3])
+        fail(t, "splice into empty handle should take both ends");
+}
+
+void test_sort_stable(struct test *t) {
+    struct item items[6];
+    int keys[] = {3, 1, 3, 2, 1, 3};
+    struct list_handle h = {0};
+
+    for (int i = 0; i < 6; i++) {
+        items[i] = (struct item) {.key = keys[i], .order = i};
+        list_handle_append(&h, &items[i]);
+    }
+    list_handle_sort(&h, compare_key);
+
+    int expected[] = {1, 4, 3, 0, 2, 5};
+    size_t i = 0;
+    for (struct item *it = h.head; it != NULL; it = it->l.next, i++) {
+        if (it->order != expected[i])
+            failf(t, "expected %d. entry with order %d got %d", i+1, expected[i], it->order);
+    }
+    if (h.tail != &items[5])
+        fail(t, "tail should point to the last sorted entry");
+}
+
+// Scaling tests; quadratic implementations don't finish these in time.
+
+#define SCALE_SIZE 1000000
+
+void test_handle_append_scaling(struct test *t) {
+    struct item *items = calloc(SCALE_SIZE, sizeof (struct item));
+    struct list_handle h = {0};
+
+    for (int i = 0; i < SCALE_SIZE; i++)
+        list_handle_append(&h, &items[i]);
+
+    if (h.size != SCALE_SIZE)
+        failf(t, "expected size %d got %zu", SCALE_SIZE, h.size);
+    if (h.tail != &items[SCALE_SIZE - 1])
+        fail(t, "tail should point to the last item");
+    free(items);
+}
+
+void test_handle_splice_scaling(struct test *t) {
+    struct item *items = calloc(SCALE_SIZE, sizeof (struct item));
+    struct list_handle h = {0};
+
+    for (int i = 0; i < SCALE_SIZE; i++) {
+        struct list_handle part = {0};
+        list_handle_append(&part, &items[i]);
+        list_handle_splice(&h, &part);
+    }
+
+    if (h.size != SCALE_SIZE || list_size(h.head) != SCALE_SIZE)
+        failf(t, "expected size %d got %zu", SCALE_SIZE, h.size);
+    free(items);
+}
+
+void test_sort_scaling(struct test *t) {
+    struct item *items = calloc(SCALE_SIZE, sizeof (struct item));
+    struct list_handle h = {0};
+
+    srand(42);
+    for (int i = 0; i < SCALE_SIZE; i++) {
+        items[i] = (struct item) {.key = rand() % 1000, .order = i};
+        list_handle_append(&h, &items[i]);
+    }
+    list_handle_sort(&h, compare_key);
+
+    size_t size = 0;
+    for (struct item *it = h.head; it != NULL; it = it->l.next, size++) {
+        struct item *next = it->l.next;
+        if (next == NULL)
+            break;
+        if (it->key > next->key || (it->key == next->key && it->order > next->order)) {
+            failf(t, "entries out of order at %zu", size);
+            break;
+        }
+    }
+    if (list_size(h.head) != SCALE_SIZE)
+        failf(t, "expected size %d got %d", SCALE_SIZE, list_size(h.head));
+    free(items);
+}
+
 int main(int argc, char **argv) {
 
     static test_fn tests[] = {
@@ -266,6 +416,13 @@ int main(int argc, char **argv) {
         test_drop_apply,
         test_drop_apply_null_list,
         test_sort,
+        test_handle_append,
+        test_handle_push_pop,
+        test_handle_splice,
+        test_sort_stable,
+        test_handle_append_scaling,
+        test_handle_splice_scaling,
+        test_sort_scaling,
         NULL,
     };
 
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "utest.h"
+#include "../measure.h"
+
+struct test_case {
+    uint64_t from; // Values added, one of each
+    uint64_t to;
+    uint64_t p50;
+    uint64_t p99;
+};
+
+typedef struct test_case tc;
+
+// Percentiles are exact below HISTOGRAM_EXACT and within 1/HISTOGRAM_SPLIT
+// above it
+void test_percentiles(struct test *t) {
+    tc *cases[] = {
+        &(tc) {0, 0, 0, 0},
+        &(tc) {1, 1, 1, 1},
+        &(tc) {1, 10, 5, 10},
+        &(tc) {0, 99, 49, 98},
+        &(tc) {1, 1000, 496, 976},
+        &(tc) {1000000, 1000999, 999424, 999424},
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct histogram h;
+
+        init_histogram(&h, "test");
+        for (uint64_t v = cases[i]->from; v <= cases[i]->to; v++)
+            histogram_add(&h, v);
+
+        uint64_t p50 = histogram_percentile(&h, 50);
+        uint64_t p99 = histogram_percentile(&h, 99);
+
+        if (p50 != cases[i]->p50 || p99 != cases[i]->p99 || h.max != cases[i]->to)
+            failf(t, "  values %lu to %lu\n    expected p50 %lu p99 %lu got %lu %lu max %lu",
+              (unsigned long) cases[i]->from, (unsigned long) cases[i]->to, (unsigned long) cases[i]->p50,
+              (unsigned long) cases[i]->p99, (unsigned long) p50, (unsigned long) p99, (unsigned long) h.max);
+    }
+}
+
+// No values, no percentiles; the largest values still have a bucket
+void test_bounds(struct test *t) {
+    struct histogram h;
+
+    init_histogram(&h, "test");
+    if (histogram_percentile(&h, 50) != 0 || histogram_percentile(&h, 100) != 0)
+        fail(t, "  empty histogram has percentiles");
+
+    histogram_add(&h, UINT64_MAX);
+    if (h.n != 1 || h.counts[HISTOGRAM_BUCKETS - 1] != 1 || histogram_percentile(&h, 100) != UINT64_MAX)
+        fail(t, "  largest value not in the last bucket");
+}
+
+int main(int argc, char **argv) {
+
+    static test_fn tests[] = {
+        test_percentiles,
+        test_bounds,
+        NULL,
+    };
+
+    if (run("Measure", tests))
+        return EXIT_SUCCESS;
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utest.h"
+#include "../parser.h"
+
+// Allocation count regression test. The test is linked with malloc, calloc
+// and realloc wrapped, see the Makefile. A score is parsed twice, with a few
+// and with many repetitions of one element, the difference tells the
+// allocations made per element.
+
+#define FEW 100
+#define MANY 1100
+
+size_t allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    allocations++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    if (ptr == NULL)
+        allocations++;
+    return __real_realloc(ptr, size);
+}
+
+struct test_case {
+    char *element;
+    int in_sheet;
+    double max; // Allocations per element
+};
+
+typedef struct test_case tc;
+
+size_t count_allocations(tc *c, size_t n);
+
+void test_allocations(struct test *t) {
+    tc *cases[] = {
+        &(tc) {"c ", 1, 0.05},
+        &(tc) {"ch1:c#4!5 ", 1, 0.05},
+        &(tc) {"+2 ", 1, 0.05},
+        &(tc) {". - | ", 1, 0.05},
+        &(tc) {"(c d) ", 1, 0.05},
+        &(tc) {"CC7:100 pgm3 ", 1, 0.05},
+        &(tc) {"120bpm ", 0, 0.05},
+        &(tc) {"{riff}x2 ", 0, 0.05},
+        &(tc) {"riff:2to3{c}loop ", 0, 1.05},
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        size_t few = count_allocations(cases[i], FEW);
+        size_t many = count_allocations(cases[i], MANY);
+        double actual = (many - (double) few) / (MANY - FEW);
+
+        if (actual > cases[i]->max)
+            failf(t, "  element: %s\n    expected at most %.2f allocations got %.2f", cases[i]->element,
+              cases[i]->max, actual);
+    }
+}
+
+int main(int argc, char **argv) {
+
+    static test_fn tests[] = {
+        test_allocations,
+        NULL,
+    };
+
+    if (run("Parser allocations", tests))
+        return EXIT_SUCCESS;
+    return EXIT_FAILURE;
+}
+
+size_t count_allocations(tc *c, size_t n) {
+    char *source = calloc(strlen(c->element) * n + 4, sizeof (char));
+    size_t end = 0;
+
+    if (c->in_sheet)
+        end += sprintf(&source[end], "8{");
+    for (size_t i = 0; i < n; i++)
+        end += sprintf(&source[end], "%s", c->element);
+    if (c->in_sheet)
+        end += sprintf(&source[end], "}");
+
+    size_t before = allocations;
+    struct parse_result res = parse("<test>", source);
+    size_t after = allocations;
+
+    free_parse_result(&res);
+    free(source);
+    return after - before;
+}
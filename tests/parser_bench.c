@@ -0,0 +1,204 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../parser.h"
+
+// Parse benchmark. A score of the given size in bytes (5 MB by default) is
+// made of a repeated verse touching every element of the notation. The
+// hand-written parser is compared with the mpc grammar, parsing and freeing of
+// the tree are timed separately. Time to the first parse of a tiny score is
+// timed for both as well, it includes building the grammar for mpc.
+//
+// Adversarial scores are parsed at growing sizes last. Time per byte stays
+// flat when parsing is linear. Nesting is kept below the depth mpc allows.
+
+#define VERSE "// verse %zu\nv%zu:8{ch1:c4!7 d e (f +2 g) . - | c#3 eb a b}x2 {v%zu} 4{CC7:100 pgm3 a -2 b}\n120bpm\n"
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+char *new_score(size_t size) {
+    char *score = calloc(size + 1, sizeof (char));
+    char verse[256];
+    size_t end = 0;
+
+    for (size_t i = 0;; i++) {
+        int len = snprintf(verse, sizeof (verse), VERSE, i, i, i);
+
+        if (end + len > size)
+            break;
+        memcpy(&score[end], verse, len);
+        end += len;
+    }
+    return score;
+}
+
+int bench(const char *name, struct parser p, char *score,
+  struct parse_result (*f)(const char *, struct parser, const char *)) {
+
+    double start = now();
+    struct parse_result res = f("<bench>", p, score);
+    double parsed = now() - start;
+
+    if (res.err != NULL) {
+        fprintf(stderr, "%s", res.err);
+        free_parse_result(&res);
+        return EXIT_FAILURE;
+    }
+
+    start = now();
+    free_parse_result(&res);
+    double freed = now() - start;
+
+    printf("%10s %10zu %12.2f %12.2f %12.2f\n", name, strlen(score), parsed * 1e3, strlen(score) / parsed / 1e6,
+      freed * 1e3);
+    return EXIT_SUCCESS;
+}
+
+// reader is parse with the signature of parse_mpc
+struct parse_result reader(const char *filename, struct parser p, const char *in) {
+    return parse(filename, in);
+}
+
+// first times the first parse of a tiny score, grammar included
+int first(const char *name, struct parse_result (*f)(const char *, struct parser, const char *), bool grammar) {
+
+    double start = now();
+    struct parser p = grammar ? new_parser() : (struct parser) { 0 };
+    struct parse_result res = f("<bench>", p, "8{c}");
+    double parsed = now() - start;
+
+    if (res.err != NULL) {
+        fprintf(stderr, "%s", res.err);
+        free_parse_result(&res);
+        return EXIT_FAILURE;
+    }
+    free_parse_result(&res);
+    free_parser(&p);
+
+    printf("%10s %12.1f\n", name, parsed * 1e6);
+    return EXIT_SUCCESS;
+}
+
+// repeat returns `n` times `s` between `head` and `tail`.
+char *repeat(const char *head, const char *s, size_t n, const char *tail) {
+    size_t len = strlen(s);
+    char *score = malloc(strlen(head) + n * len + strlen(tail) + 1);
+    char *end = stpcpy(score, head);
+
+    for (size_t i = 0; i < n; i++)
+        end = stpcpy(end, s);
+    strcpy(end, tail);
+    return score;
+}
+
+// nested is a sheet nested `n` deep, closed when `closed` is set
+char *nested(size_t n, bool closed) {
+    char *open = repeat("", "8{", n, "c");
+    char *score = repeat(open, "}", closed ? n : 0, "");
+
+    free(open);
+    return score;
+}
+
+char *deep(size_t n) {
+    return nested(n, true);
+}
+
+char *unclosed(size_t n) {
+    return nested(n, false);
+}
+
+char *digits(size_t n) {
+    return repeat("", "1", n, "bpm");
+}
+
+char *broken_digits(size_t n) {
+    return repeat("", "1", n, "?");
+}
+
+char *label(size_t n) {
+    return repeat("", "a", n, ":8{c}");
+}
+
+char *octave(size_t n) {
+    return repeat("8{c", "4", n, "}");
+}
+
+struct adversary {
+    const char *name;
+    char *(*score)(size_t n);
+    size_t n;
+};
+
+// adversarial parses each score at n, 2n, 4n and 8n
+int adversarial(const char *name, struct parser p, struct parse_result (*f)(const char *, struct parser, const char *)) {
+    struct adversary adversaries[] = {
+        {"nesting", deep, 20},
+        {"unclosed", unclosed, 20},
+        {"digits", digits, 10000},
+        {"bad digits", broken_digits, 10000},
+        {"label", label, 10000},
+        {"octave", octave, 10000},
+    };
+
+    for (size_t i = 0; i < sizeof (adversaries) / sizeof (adversaries[0]); i++) {
+        printf("%10s %12s", name, adversaries[i].name);
+
+        for (size_t n = adversaries[i].n; n <= 8 * adversaries[i].n; n *= 2) {
+            char *score = adversaries[i].score(n);
+            size_t rounds = 0;
+            double start = now();
+            double elapsed;
+
+            // Small scores are parsed many times over
+            do {
+                struct parse_result res = f("<bench>", p, score);
+
+                free_parse_result(&res);
+                rounds++;
+                elapsed = now() - start;
+            } while (elapsed < 0.01);
+
+            printf(" %8zu %8.1f", strlen(score), elapsed / rounds / strlen(score) * 1e9);
+            free(score);
+        }
+        printf("\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+
+    size_t size = argc > 1 ? strtoul(argv[1], NULL, 10) : 5 * 1024 * 1024;
+    char *score = new_score(size);
+    int status = EXIT_SUCCESS;
+
+    printf("%10s %12s\n", "parser", "first [us]");
+    if (first("reader", reader, false) != EXIT_SUCCESS || first("mpc", parse_mpc, true) != EXIT_SUCCESS) {
+        free(score);
+        return EXIT_FAILURE;
+    }
+
+    struct parser p = new_parser();
+
+    printf("\n");
+    printf("%10s %10s %12s %12s %12s\n", "parser", "bytes", "parse [ms]", "MB/s", "free [ms]");
+    if (bench("reader", p, score, reader) != EXIT_SUCCESS || bench("mpc", p, score, parse_mpc) != EXIT_SUCCESS)
+        status = EXIT_FAILURE;
+
+    printf("\n");
+    printf("%10s %12s %8s %8s %8s %8s %8s %8s %8s %8s\n", "parser", "score", "bytes", "ns/B", "bytes", "ns/B", "bytes",
+      "ns/B", "bytes", "ns/B");
+    adversarial("reader", p, reader);
+    adversarial("mpc", p, parse_mpc);
+
+    free_parser(&p);
+    free(score);
+    return status;
+}
@@ -16,8 +16,7 @@ char *get_ast(struct parse_result *r);
 void test_empty(struct test *t) {
     tc c = {"", "(CRATE (EOF))"};
 
-    struct parser p = new_parser();
-    struct parse_result res = parse("<test>", p, c.source);
+    struct parse_result res = parse("<test>", c.source);
 
     char *actual = get_ast(&res);
     if (strcmp(c.expected, actual) != 0)
@@ -25,7 +24,6 @@ void test_empty(struct test *t) {
 
     free(actual);
     free_parse_result(&res);
-    free_parser(&p);
 }
 
 void test_comment(struct test *t) {
@@ -35,18 +33,14 @@ void test_comment(struct test *t) {
         NULL,
     };
 
-    struct parser p = new_parser();
-
     for (size_t i = 0; cases[i] != NULL; i++) {
-        struct parse_result res = parse("<test>", p, cases[i]->source);
+        struct parse_result res = parse("<test>", cases[i]->source);
         char *actual = get_ast(&res);
         if (strcmp(cases[i]->expected, actual) != 0)
             failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
         free(actual);
         free_parse_result(&res);
     }
-
-    free_parser(&p);
 }
 
 void test_crate(struct test *t) {
@@ -56,21 +50,18 @@ void test_crate(struct test *t) {
         &(tc) {"120bpm 160bpm", "(CRATE (BPM v:120) (BPM v:160) (EOF))"},
         &(tc) {"CC0:0 CC90:127", "(CRATE (CC p:0 v:0) (CC p:90 v:127) (EOF))"},
         &(tc) {"pgm0 pgm1", "(CRATE (PGM v:0) (PGM v:1) (EOF))"},
+        &(tc) {"[4{} {ref}x2]", "(CRATE (VOICES (SHEET l: u:1 d:4 r:1) (REFERENCE l:ref r:2)) (EOF))"},
         NULL,
     };
 
-    struct parser p = new_parser();
-
     for (size_t i = 0; cases[i] != NULL; i++) {
-        struct parse_result res = parse("<test>", p, cases[i]->source);
+        struct parse_result res = parse("<test>", cases[i]->source);
         char *actual = get_ast(&res);
         if (strcmp(cases[i]->expected, actual) != 0)
             failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
         free(actual);
         free_parse_result(&res);
     }
-
-    free_parser(&p);
 }
 
 void test_sheet(struct test *t) {
@@ -89,18 +80,14 @@ void test_sheet(struct test *t) {
         NULL,
     };
 
-    struct parser p = new_parser();
-
     for (size_t i = 0; cases[i] != NULL; i++) {
-        struct parse_result res = parse("<test>", p, cases[i]->source);
+        struct parse_result res = parse("<test>", cases[i]->source);
         char *actual = get_ast(&res);
         if (strcmp(cases[i]->expected, actual) != 0)
             failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
         free(actual);
         free_parse_result(&res);
     }
-
-    free_parser(&p);
 }
 
 void test_note(struct test *t) {
@@ -110,21 +97,18 @@ void test_note(struct test *t) {
         &(tc) {"4{ch1:c}", "(CRATE (SHEET l: u:1 d:4 r:1 (NOTE ch:1 n:c a: o:-1 v:-1)) (EOF))"},
         &(tc) {"4{c!3}", "(CRATE (SHEET l: u:1 d:4 r:1 (NOTE ch:-1 n:c a: o:-1 v:3)) (EOF))"},
         &(tc) {"4{c#}", "(CRATE (SHEET l: u:1 d:4 r:1 (NOTE ch:-1 n:c a:# o:-1 v:-1)) (EOF))"},
+        &(tc) {"4{[c +4]}", "(CRATE (SHEET l: u:1 d:4 r:1 (CHORD (NOTE ch:-1 n:c a: o:-1 v:-1) (INTERVAL v:4))) (EOF))"},
         NULL,
     };
 
-    struct parser p = new_parser();
-
     for (size_t i = 0; cases[i] != NULL; i++) {
-        struct parse_result res = parse("<test>", p, cases[i]->source);
+        struct parse_result res = parse("<test>", cases[i]->source);
         char *actual = get_ast(&res);
         if (strcmp(cases[i]->expected, actual) != 0)
             failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
         free(actual);
         free_parse_result(&res);
     }
-
-    free_parser(&p);
 }
 
 int main(int argc, char **argv) {
@@ -147,7 +131,7 @@ char *get_ast(struct parse_result *r) {
     char *buffer = NULL;
     size_t size = 0;
     FILE* f = open_memstream(&buffer, &size);
-    print_ast(r->n, f);
+    print_ast(r->ast, f);
     fclose(f);
     return buffer;
 }
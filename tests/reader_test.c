@@ -0,0 +1,250 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utest.h"
+#include "../parser.h"
+#include "../reader.h"
+
+struct test_case {
+    char *source;
+    char *expected;
+};
+
+typedef struct test_case tc;
+
+char *get_output(struct parse_result *r);
+
+// Errors are the ones the mpc grammar reports
+void test_error(struct test *t) {
+    tc *cases[] = {
+        &(tc) {"4{c d}}", "<test>:1:7: error: expected 'x', \"loop\", \"off\", letter, underscore, digits, \"{\", \"[\", \"cc\", \"CC\", \"pgm\", \"PGM\", \"//\" or end of input at '}'\n"},
+        &(tc) {"4x{}", "<test>:1:2: error: expected \"is\", \"as\", \"to\", \"{\" or \"bpm\" at 'x'\n"},
+        &(tc) {"{a.}", "<test>:1:4: error: expected letter or underscore at '}'\n"},
+        &(tc) {"cc7:", "<test>:1:5: error: expected digits or integer at end of input\n"},
+        &(tc) {"4{c!}", "<test>:1:5: error: expected digit at '}'\n"},
+        &(tc) {"4{(c d}", "<test>:1:7: error: expected one or more of one of '#b', integer, '!', \"ch\", one of 'cdefgabCDEFGAB', one of '-+', '-', '|' or \")\" at '}'\n"},
+        &(tc) {"4{}\n8{c}\n  ?", "<test>:3:3: error: expected 'x', \"loop\", \"off\", letter, underscore, digits, \"{\", \"[\", \"cc\", \"CC\", \"pgm\", \"PGM\", \"//\" or end of input at '?'\n"},
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]->source);
+        char *actual = get_output(&res);
+        if (strcmp(cases[i]->expected, actual) != 0)
+            failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
+        free(actual);
+        free_parse_result(&res);
+    }
+}
+
+#define THREADS 4
+#define ROUNDS 50
+
+char *sources[] = {
+    "a:2to3{ch1:c#4!7 d e (f +2 g) . - | c#3 eb a b}x2 {a}loop // end",
+    "8{cc7:1 pgm2 CC9:4 PGM3 b:4{c}off {b}x2}\n120bpm\npgm1 cc1:2",
+    "_x:4as3{ (c -2 | -) bb4 +12 }x10",
+    "8{c}x",
+    "4{ch1c}",
+    "4{c} 4{d",
+    "120bp",
+    "[4{c d} a:8{e}x2 {a}loop]\n[ {b} ]",
+    "[4{c}",
+    "[]",
+    "[4{c} 120bpm]",
+    "4{[c e g] [ch2:d#4!5 +4 -3] -}",
+    "4{[c .]}",
+    "4{[]}",
+    NULL,
+};
+
+// Both parsers agree on valid and broken scores alike
+void test_same_as_mpc(struct test *t) {
+    struct parser p = new_parser();
+
+    for (size_t i = 0; sources[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", sources[i]);
+        struct parse_result expected = parse_mpc("<test>", p, sources[i]);
+        char *a = get_output(&res);
+        char *b = get_output(&expected);
+        if (strcmp(a, b) != 0)
+            failf(t, "  source: %s\n    expected: %s\n         got: %s", sources[i], b, a);
+        free(a);
+        free(b);
+        free_parse_result(&res);
+        free_parse_result(&expected);
+    }
+
+    free_parser(&p);
+}
+
+// compare_in_thread parses the sources with both parsers again and again,
+// returning how many times they disagreed
+void *compare_in_thread(void *arg) {
+    struct parser p = new_parser();
+    size_t *mismatches = arg;
+
+    for (size_t round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; sources[i] != NULL; i++) {
+            struct parse_result res = parse("<test>", sources[i]);
+            struct parse_result expected = parse_mpc("<test>", p, sources[i]);
+            char *a = get_output(&res);
+            char *b = get_output(&expected);
+            if (strcmp(a, b) != 0)
+                (*mismatches)++;
+            free(a);
+            free(b);
+            free_parse_result(&res);
+            free_parse_result(&expected);
+        }
+    }
+
+    free_parser(&p);
+    return NULL;
+}
+
+// Threads share the grammar, the first ones race to build it
+void test_threads(struct test *t) {
+    pthread_t threads[THREADS];
+    size_t mismatches[THREADS] = { 0 };
+    size_t started = 0;
+
+    for (; started < THREADS; started++) {
+        if (pthread_create(&threads[started], NULL, compare_in_thread, &mismatches[started]) != 0) {
+            failf(t, "failed starting thread %zu", started);
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if (mismatches[i] > 0)
+            failf(t, "thread %zu: parsers disagreed %zu times", i, mismatches[i]);
+    }
+}
+
+char *scores[] = {
+    "4{c}\n8{d}\n120bpm\n{a}\n",
+    "8{c}\nx2\n8{d}\n\n  loop\n4{e}\n   \n\noff\n",
+    "xa:4{c}\nlead:8{d}\noboe:4{e}\n{xa}\n{lead}\n{oboe}\n",
+    "// {\n4{c}\n// }\n8{d} // {{\n{a}\n",
+    "a:4{\n  c d\n  b:8{\n    e // }\n  }\n}\n{a}\n{a.b}x3\n",
+    "4{c}\n8{d}\n4{e}\n8{f}\n4{g}\n8{a\n",
+    "4{c}\n8{d}\n4{e}\n8{f}\n4{g}\n  ?\n",
+    "4{c}\n}\n8{d}\n4{e}\n",
+    "[4{c}\n8{d}\n]\n4{e}\n[\n{a}]\n",
+    NULL,
+};
+
+// Pieces read at once give the tree or the error of the whole score
+void test_pieces(struct test *t) {
+    for (size_t i = 0; scores[i] != NULL; i++) {
+        struct parse_result expected = read_score("<test>", scores[i], strlen(scores[i]));
+        char *b = get_output(&expected);
+
+        for (size_t n = 1; n <= 8; n++) {
+            struct parse_result res = read_pieces("<test>", scores[i], strlen(scores[i]), n);
+            char *a = get_output(&res);
+            if (strcmp(a, b) != 0)
+                failf(t, "  source: %s\n  pieces: %zu\n    expected: %s\n         got: %s", scores[i], n, b, a);
+            free(a);
+            free_parse_result(&res);
+        }
+        free(b);
+        free_parse_result(&expected);
+    }
+}
+
+// A large score is cut into as many pieces as asked for
+void test_large_pieces(struct test *t) {
+    const char *line = "a:4{c d (e f)}x2 // {\n{a}loop\n120bpm cc7:1\nb:8{\n  g\n}\n";
+    size_t len = strlen(line);
+    size_t lines = 1000;
+    char *score = malloc(len * lines + 1);
+
+    for (size_t i = 0; i < lines; i++)
+        memcpy(&score[i * len], line, len);
+    score[len * lines] = '\0';
+
+    struct parse_result expected = read_score("<test>", score, len * lines);
+    struct parse_result res = read_pieces("<test>", score, len * lines, 8);
+    char *a = get_output(&res);
+    char *b = get_output(&expected);
+    if (strcmp(a, b) != 0)
+        fail(t, "pieces differ from the whole score");
+
+    free(a);
+    free(b);
+    free_parse_result(&res);
+    free_parse_result(&expected);
+    free(score);
+}
+
+// print_positions prints the positions of the sheets in the order of the tree.
+void print_positions(struct ast *a, struct node *n, FILE *f) {
+    if (n->type == NODE_TYPE_SHEET)
+        fprintf(f, "%zu:%zu ", n->u.sheet.at.line + 1, n->u.sheet.at.column + 1);
+    for (size_t i = 0; i < n->n; i++)
+        print_positions(a, child(a, n, i), f);
+}
+
+char *get_positions(struct parse_result *r) {
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE* f = open_memstream(&buffer, &size);
+    if (r->ast != NULL)
+        print_positions(r->ast, &r->ast->nodes[r->ast->root], f);
+    fclose(f);
+    return buffer;
+}
+
+// Sheets know where they start, whichever way the score was read
+void test_positions(struct test *t) {
+    const char *source = "4{c}\n  a:8{d b:2to3{e}}x2\n[4{f}\n {a} 16{g}]\n";
+    const char *expected = "1:1 2:3 2:9 3:2 4:6 ";
+    struct parser p = new_parser();
+    struct parse_result res[] = {
+        parse("<test>", source),
+        parse_mpc("<test>", p, source),
+        read_pieces("<test>", source, strlen(source), 3),
+    };
+
+    for (size_t i = 0; i < sizeof (res) / sizeof (res[0]); i++) {
+        char *actual = get_positions(&res[i]);
+        if (strcmp(expected, actual) != 0)
+            failf(t, "  reader %zu\n    expected: %s\n         got: %s", i, expected, actual);
+        free(actual);
+        free_parse_result(&res[i]);
+    }
+    free_parser(&p);
+}
+
+int main(int argc, char **argv) {
+
+    static test_fn tests[] = {
+        test_threads,
+        test_error,
+        test_same_as_mpc,
+        test_pieces,
+        test_large_pieces,
+        test_positions,
+        NULL,
+    };
+
+    if (run("Reader", tests))
+        return EXIT_SUCCESS;
+    return EXIT_FAILURE;
+}
+
+char *get_output(struct parse_result *r) {
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE* f = open_memstream(&buffer, &size);
+    if (r->err != NULL)
+        fprintf(f, "%s", r->err);
+    else
+        print_ast(r->ast, f);
+    fclose(f);
+    return buffer;
+}
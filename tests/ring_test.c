@@ -0,0 +1,111 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "utest.h"
+#include "../ring.h"
+
+#define PASSED_EVENTS 100000
+
+// Capacity is rounded up to a power of two and events wrap around it
+void test_wrap(struct test *t) {
+    struct ring *r = new_ring(5);
+
+    if (r == NULL) {
+        fail(t, "  failed allocating ring");
+        return;
+    }
+    if (r->capacity != 8)
+        failf(t, "  capacity of 5 rounded to %zu", r->capacity);
+
+    snd_seq_event_t events[6] = {0};
+    unsigned int next = 0;
+
+    for (int round = 0; round < 10; round++) {
+        for (size_t i = 0; i < 6; i++)
+            events[i].time.tick = round * 6 + i;
+
+        size_t pushed = ring_push(r, events, 6);
+
+        if (pushed != 6)
+            failf(t, "  round %d pushed %zu of 6 events", round, pushed);
+        if (ring_fill(r) != 6 || ring_room(r) != 2)
+            failf(t, "  round %d: fill %zu, room %zu", round, ring_fill(r), ring_room(r));
+        for (size_t i = 0; i < 6; i++) {
+            if (ring_at(r, i) == NULL || ring_at(r, i)->time.tick != next + i)
+                failf(t, "  round %d: event %zu ahead is missing", round, i);
+        }
+        if (ring_at(r, 6) != NULL)
+            failf(t, "  round %d: event past the last one", round);
+
+        for (snd_seq_event_t *e = ring_peek(r); e != NULL; e = ring_peek(r), next++) {
+            if (e->time.tick != next)
+                failf(t, "  round %d: expected tick %u, got %u", round, next, e->time.tick);
+            ring_pop(r);
+        }
+    }
+
+    // Only as many as there is room for
+    size_t pushed = ring_push(r, events, 6) + ring_push(r, events, 6);
+
+    if (pushed != 8 || ring_room(r) != 0)
+        failf(t, "  full ring took %zu events, has room for %zu", pushed, ring_room(r));
+    free_ring(r);
+}
+
+void *produce(void *arg) {
+    struct ring *r = arg;
+    snd_seq_event_t e = {0};
+
+    for (unsigned int tick = 0; tick < PASSED_EVENTS;) {
+        e.time.tick = tick;
+        size_t pushed = ring_push(r, &e, 1);
+
+        if (pushed == 0)
+            sched_yield();
+        tick += pushed;
+    }
+    return NULL;
+}
+
+// Events come out of the other thread in order
+void test_threads(struct test *t) {
+    struct ring *r = new_ring(64);
+    pthread_t thread;
+
+    if (r == NULL || pthread_create(&thread, NULL, produce, r) != 0) {
+        fail(t, "  failed starting producer");
+        free_ring(r);
+        return;
+    }
+
+    for (unsigned int tick = 0; tick < PASSED_EVENTS;) {
+        snd_seq_event_t *e = ring_peek(r);
+
+        if (e == NULL) {
+            sched_yield();
+            continue;
+        }
+        if (e->time.tick != tick) {
+            failf(t, "  expected tick %u, got %u", tick, e->time.tick);
+            break;
+        }
+        ring_pop(r);
+        tick++;
+    }
+    pthread_join(thread, NULL);
+    free_ring(r);
+}
+
+int main(int argc, char **argv) {
+
+    static test_fn tests[] = {
+        test_wrap,
+        test_threads,
+        NULL,
+    };
+
+    if (run("Ring", tests))
+        return EXIT_SUCCESS;
+    return EXIT_FAILURE;
+}
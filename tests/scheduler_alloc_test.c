@@ -0,0 +1,407 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "utest.h"
+#include "../bind.h"
+#include "../compiler.h"
+#include "../scheduler.h"
+
+// Allocation test of the output thread. The test is linked with malloc,
+// calloc and realloc wrapped, see the Makefile, and with the sequencer below
+// in place of ALSA. Allocations are counted on the thread which started the
+// queue until it stops it; the producer thread may allocate all it wants.
+
+#define MAX_QUEUED 4096
+#define TICKS_PER_STATUS 24
+#define NS_PER_TICK 5208333 // At 120 bpm and 96 ticks a quarter
+
+bool armed = false;
+pthread_t output;
+size_t allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+bool counted(void) {
+    return __atomic_load_n(&armed, __ATOMIC_ACQUIRE) && pthread_equal(pthread_self(), output);
+}
+
+void *__wrap_malloc(size_t size) {
+    if (counted())
+        allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    if (counted())
+        allocations++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    if (counted())
+        allocations++;
+    return __real_realloc(ptr, size);
+}
+
+// Sequencer which plays TICKS_PER_STATUS ticks every time after its queue
+// status is asked for. It applies the tempo events addressed to its timer and
+// sends USR0 and USR1 events back to the program, stamped with its real time.
+
+struct _snd_seq {
+    snd_seq_event_t queued[MAX_QUEUED];
+    size_t n_queued;
+    snd_seq_event_t input[MAX_QUEUED];
+    size_t n_input;
+    snd_seq_event_t current; // Event being input
+    size_t pool;
+    snd_seq_tick_time_t tick;
+    bool started;
+    size_t played;
+    size_t tempos;
+    bool stamped;
+    int fds[2]; // Always readable
+};
+
+struct _snd_seq_queue_status {
+    snd_seq_tick_time_t tick;
+    snd_seq_real_time_t time;
+};
+
+struct _snd_seq_port_info {
+    int timestamping;
+};
+
+struct _snd_seq_client_pool {
+    size_t free;
+};
+
+struct _snd_seq_queue_tempo {
+    unsigned int tempo;
+};
+
+struct _snd_seq_remove_events {
+    int queue;
+};
+
+struct _snd_seq seq;
+struct _snd_seq_queue_status status;
+struct _snd_seq_client_pool room;
+struct _snd_seq_queue_tempo tempo;
+struct _snd_seq_remove_events remove_events;
+
+snd_seq_real_time_t real_time(snd_seq_tick_time_t tick) {
+    unsigned long long ns = (unsigned long long) tick * NS_PER_TICK;
+
+    return (snd_seq_real_time_t) {.tv_sec = ns / 1000000000,.tv_nsec = ns % 1000000000};
+}
+
+// play delivers the queued events up to the current tick.
+void play(snd_seq_t *s) {
+    size_t kept = 0;
+
+    for (size_t i = 0; i < s->n_queued; i++) {
+        snd_seq_event_t *e = &s->queued[i];
+
+        if (e->time.tick > s->tick) {
+            s->queued[kept++] = *e;
+            continue;
+        }
+        if (e->type == SND_SEQ_EVENT_TEMPO && e->dest.client == SND_SEQ_CLIENT_SYSTEM
+          && e->dest.port == SND_SEQ_PORT_SYSTEM_TIMER)
+            s->tempos++;
+        if (e->type == SND_SEQ_EVENT_USR0 || e->type == SND_SEQ_EVENT_USR1) {
+            s->input[s->n_input] = *e;
+            if (s->stamped)
+                s->input[s->n_input].time.time = real_time(e->time.tick);
+            s->n_input++;
+        }
+        s->played++;
+    }
+    s->n_queued = kept;
+}
+
+const char *snd_strerror(int errnum) {
+    return strerror(errnum < 0 ? -errnum : errnum);
+}
+
+int snd_seq_open(snd_seq_t **handle, const char *name, int streams, int mode) {
+    memset(&seq, 0, sizeof (seq));
+    if (pipe(seq.fds) < 0 || write(seq.fds[1], "x", 1) != 1)
+        return -errno;
+    *handle = &seq;
+    return 0;
+}
+
+int snd_seq_close(snd_seq_t *handle) {
+    close(handle->fds[0]);
+    close(handle->fds[1]);
+    return 0;
+}
+
+int snd_seq_client_id(snd_seq_t *handle) {
+    return 128;
+}
+
+int snd_seq_set_client_name(snd_seq_t *seq, const char *name) {
+    return 0;
+}
+
+int snd_seq_create_simple_port(snd_seq_t *seq, const char *name, unsigned int caps, unsigned int type) {
+    static int port = 0;
+
+    return port++;
+}
+
+int snd_seq_port_info_malloc(snd_seq_port_info_t **ptr) {
+    *ptr = calloc(1, sizeof (snd_seq_port_info_t));
+    return *ptr == NULL ? -ENOMEM : 0;
+}
+
+void snd_seq_port_info_free(snd_seq_port_info_t *ptr) {
+    free(ptr);
+}
+
+int snd_seq_get_port_info(snd_seq_t *handle, int port, snd_seq_port_info_t *info) {
+    return 0;
+}
+
+int snd_seq_set_port_info(snd_seq_t *handle, int port, snd_seq_port_info_t *info) {
+    handle->stamped = info->timestamping;
+    return 0;
+}
+
+void snd_seq_port_info_set_timestamping(snd_seq_port_info_t *info, int enable) {
+    info->timestamping = enable;
+}
+
+void snd_seq_port_info_set_timestamp_real(snd_seq_port_info_t *info, int realtime) {
+}
+
+void snd_seq_port_info_set_timestamp_queue(snd_seq_port_info_t *info, int queue) {
+}
+
+int snd_seq_delete_simple_port(snd_seq_t *seq, int port) {
+    return 0;
+}
+
+int snd_seq_connect_to(snd_seq_t *seq, int my_port, int dest_client, int dest_port) {
+    return 0;
+}
+
+int snd_seq_disconnect_to(snd_seq_t *seq, int my_port, int dest_client, int dest_port) {
+    return 0;
+}
+
+int snd_seq_alloc_queue(snd_seq_t *handle) {
+    return 0;
+}
+
+int snd_seq_free_queue(snd_seq_t *handle, int q) {
+    return 0;
+}
+
+int snd_seq_set_client_pool_output(snd_seq_t *handle, size_t size) {
+    handle->pool = size < MAX_QUEUED ? size : MAX_QUEUED;
+    return 0;
+}
+
+int snd_seq_client_pool_malloc(snd_seq_client_pool_t **ptr) {
+    *ptr = &room;
+    return 0;
+}
+
+void snd_seq_client_pool_free(snd_seq_client_pool_t *ptr) {
+}
+
+int snd_seq_get_client_pool(snd_seq_t *handle, snd_seq_client_pool_t *info) {
+    info->free = handle->n_queued < handle->pool ? handle->pool - handle->n_queued : 0;
+    return 0;
+}
+
+size_t snd_seq_client_pool_get_output_free(const snd_seq_client_pool_t *info) {
+    return info->free;
+}
+
+int snd_seq_control_queue(snd_seq_t *seq, int q, int type, int value, snd_seq_event_t *ev) {
+    if (type == SND_SEQ_EVENT_START) {
+        seq->started = true;
+        output = pthread_self();
+        __atomic_store_n(&armed, true, __ATOMIC_RELEASE);
+    } else if (type == SND_SEQ_EVENT_STOP) {
+        __atomic_store_n(&armed, false, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+int snd_seq_event_output(snd_seq_t *handle, snd_seq_event_t *ev) {
+    if (handle->n_queued == MAX_QUEUED)
+        return -EAGAIN;
+    handle->queued[handle->n_queued++] = *ev;
+    return 1;
+}
+
+int snd_seq_drain_output(snd_seq_t *handle) {
+    return 0;
+}
+
+int snd_seq_event_input(snd_seq_t *handle, snd_seq_event_t **ev) {
+    if (handle->n_input == 0)
+        return -EAGAIN;
+    handle->current = handle->input[0];
+    memmove(handle->input, handle->input + 1, --handle->n_input * sizeof (snd_seq_event_t));
+    *ev = &handle->current;
+    return 1;
+}
+
+int snd_seq_event_input_pending(snd_seq_t *seq, int fetch_sequencer) {
+    return seq->n_input;
+}
+
+int snd_seq_free_event(snd_seq_event_t *ev) {
+    return 0;
+}
+
+int snd_seq_poll_descriptors_count(snd_seq_t *handle, short events) {
+    return 1;
+}
+
+int snd_seq_poll_descriptors(snd_seq_t *handle, struct pollfd *pfds, unsigned int space, short events) {
+    pfds[0] = (struct pollfd) {.fd = handle->fds[0],.events = events};
+    return 1;
+}
+
+int snd_seq_poll_descriptors_revents(snd_seq_t *seq, struct pollfd *pfds, unsigned int nfds, unsigned short *revents) {
+    *revents = seq->n_input > 0 ? POLLIN : 0;
+    return 0;
+}
+
+int snd_seq_remove_events_malloc(snd_seq_remove_events_t **ptr) {
+    *ptr = &remove_events;
+    return 0;
+}
+
+void snd_seq_remove_events_free(snd_seq_remove_events_t *ptr) {
+}
+
+void snd_seq_remove_events_set_queue(snd_seq_remove_events_t *info, int queue) {
+    info->queue = queue;
+}
+
+void snd_seq_remove_events_set_condition(snd_seq_remove_events_t *info, unsigned int flags) {
+}
+
+int snd_seq_remove_events(snd_seq_t *handle, snd_seq_remove_events_t *info) {
+    handle->n_queued = 0;
+    return 0;
+}
+
+int snd_seq_queue_tempo_malloc(snd_seq_queue_tempo_t **ptr) {
+    *ptr = &tempo;
+    return 0;
+}
+
+void snd_seq_queue_tempo_free(snd_seq_queue_tempo_t *obj) {
+}
+
+void snd_seq_queue_tempo_set_tempo(snd_seq_queue_tempo_t *info, unsigned int tempo) {
+    info->tempo = tempo;
+}
+
+void snd_seq_queue_tempo_set_ppq(snd_seq_queue_tempo_t *info, int ppq) {
+}
+
+int snd_seq_set_queue_tempo(snd_seq_t *handle, int q, snd_seq_queue_tempo_t *tempo) {
+    handle->tempos++;
+    return 0;
+}
+
+int snd_seq_queue_status_malloc(snd_seq_queue_status_t **ptr) {
+    *ptr = &status;
+    return 0;
+}
+
+void snd_seq_queue_status_free(snd_seq_queue_status_t *obj) {
+}
+
+int snd_seq_get_queue_status(snd_seq_t *handle, int q, snd_seq_queue_status_t *status) {
+    status->tick = handle->tick;
+    status->time = real_time(handle->tick);
+    if (handle->started) {
+        handle->tick += TICKS_PER_STATUS;
+        play(handle);
+    }
+    return 0;
+}
+
+snd_seq_tick_time_t snd_seq_queue_status_get_tick_time(const snd_seq_queue_status_t *info) {
+    return info->tick;
+}
+
+const snd_seq_real_time_t *snd_seq_queue_status_get_real_time(const snd_seq_queue_status_t *info) {
+    return &info->time;
+}
+
+struct test_case {
+    char *source;
+    size_t pool;
+    size_t tempos; // Set by the program or its events, the initial one included
+    bool measure;
+};
+
+typedef struct test_case tc;
+
+void test_allocations(struct test *t) {
+    tc *cases[] = {
+        &(tc) {"8{c d e f}x4", 128, 1, false},
+        &(tc) {"8{c d}x4 90bpm 16{(c e g) d}x8 cc7:100 pgm3 200bpm {c}x4", 128, 3, false},
+        &(tc) {"r:64{c d e f g a b +1}x16 {r}x4", 8, 1, false},
+        &(tc) {"8{c d}x4 90bpm 16{(c e g) d}x8 cc7:100 pgm3 200bpm {c}x4", 128, 3, true},
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]->source);
+        struct bind_result bound = bind("<test>", res.ast);
+        struct bytecode *b = compile(res.ast, bound.symbols);
+        struct translator *tr = new_translator(b);
+        struct schedule_options options = {
+            .horizon = DEFAULT_HORIZON,
+            .pool = cases[i]->pool,
+            .debug = false,
+            .realtime = false,
+            .priority = DEFAULT_PRIORITY,
+            .cpu = -1,
+            .measure = cases[i]->measure,
+        };
+
+        allocations = 0;
+        if (schedule_and_loop(tr, NULL, 14, 0, options) == EXIT_FAILURE)
+            failf(t, "  source: %s\n    failed playing", cases[i]->source);
+        if (allocations > 0)
+            failf(t, "  source: %s\n    expected no allocations got %zu", cases[i]->source, allocations);
+        if (seq.played == 0 || seq.tempos != cases[i]->tempos)
+            failf(t, "  source: %s\n    played %zu events, set %zu tempos", cases[i]->source, seq.played, seq.tempos);
+
+        free_translator(tr);
+        free_bytecode(b);
+        free_bind_result(&bound);
+        free_parse_result(&res);
+    }
+}
+
+int main(int argc, char **argv) {
+
+    static test_fn tests[] = {
+        test_allocations,
+        NULL,
+    };
+
+    if (run("Scheduler allocations", tests))
+        return EXIT_SUCCESS;
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utest.h"
+#include "../stream.h"
+
+#define MAX_EVENTS 64
+
+char *whole_events(const char *source, char **err);
+char *stream_events(const char *source, size_t chunk, char **err);
+
+// Score read in pieces plays the same as the whole score
+void test_same_as_whole(struct test *t) {
+    char *sources[] = {
+        "8{c d}x3 8{-}",
+        "r:8{c . d}off 8{e} {r}x2 8{-}",
+        "a:4{b:8{c e}} {a.b}x2 120bpm cc7:100 pgm3 {a} // end\n4{ch2:g3!5 (c +2 -)}",
+        "8{c}x2 8{+1}x2",
+        "8{c} [4{- d} 8{e f}x2] 8{g}",
+        "4{c} 8{. d .}loop",
+        "8{c}loop 4{d}",
+        "",
+        NULL,
+    };
+    size_t chunks[] = {1, 2, 3, 5, 8, 1000};
+
+    for (size_t i = 0; sources[i] != NULL; i++) {
+        char *err = NULL;
+        char *expected = whole_events(sources[i], &err);
+
+        for (size_t j = 0; j < sizeof (chunks) / sizeof (chunks[0]); j++) {
+            char *stream_err = NULL;
+            char *actual = stream_events(sources[i], chunks[j], &stream_err);
+
+            if (strcmp(expected, actual) != 0 || stream_err != NULL)
+                failf(t, "  source: %s in pieces of %zu\n    expected: %s\n         got: %s", sources[i], chunks[j],
+                  expected, actual);
+            free(actual);
+            free(stream_err);
+        }
+        free(expected);
+        free(err);
+    }
+}
+
+// Errors point into the whole score
+void test_error(struct test *t) {
+    char *sources[] = {
+        "4{c}\n4{d}\n  ?",
+        "4{c} 4{d",
+        "4{c} cc1:2\n  4{c} {c}",
+        NULL,
+    };
+
+    for (size_t i = 0; sources[i] != NULL; i++) {
+        char *expected = NULL;
+        char *events = whole_events(sources[i], &expected);
+
+        for (size_t chunk = 1; chunk < 4; chunk++) {
+            char *actual = NULL;
+            char *stream = stream_events(sources[i], chunk, &actual);
+
+            if (actual == NULL || strcmp(expected, actual) != 0)
+                failf(t, "  source: %s in pieces of %zu\n    expected: %s\n         got: %s", sources[i], chunk,
+                  expected, actual == NULL ? "(null)" : actual);
+            free(actual);
+            free(stream);
+        }
+        free(expected);
+        free(events);
+    }
+}
+
+// Code which has been played is dropped, labeled sheets stay
+void test_pruned(struct test *t) {
+    struct stream *s = new_stream("<test>", -1);
+    struct event_buffer *out = new_event_buffer(0);
+    const char *head = "a:8{c}off\n";
+    const char *line = "8{d e}x2 {a}\n";
+    size_t max = 0;
+
+    stream_write(s, head, strlen(head));
+    for (size_t i = 0; i < 1000; i++) {
+        stream_write(s, line, strlen(line));
+        stream_pull(s, out, 1000);
+        if (compiler_bytecode(s->compiler)->size > max)
+            max = compiler_bytecode(s->compiler)->size;
+    }
+    stream_close(s);
+    stream_pull(s, out, 10000);
+
+    if (s->failed)
+        failf(t, "unexpected error: %s", s->err);
+    if (out->size != 5001)
+        failf(t, "expected 5001 events got %zu", out->size);
+    if (max > 32)
+        failf(t, "expected at most 32 instructions got %zu", max);
+
+    free_event_buffer(out);
+    free_stream(s);
+}
+
+int main(int argc, char **argv) {
+
+    static test_fn tests[] = {
+        test_same_as_whole,
+        test_error,
+        test_pruned,
+        NULL,
+    };
+
+    if (run("Stream", tests))
+        return EXIT_SUCCESS;
+    return EXIT_FAILURE;
+}
+
+char *print(struct event_buffer *b) {
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE* f = open_memstream(&buffer, &size);
+
+    print_events(b, f);
+    fclose(f);
+    return buffer;
+}
+
+char *whole_events(const char *source, char **err) {
+    struct parse_result res = parse("<test>", source);
+    struct event_buffer *list = new_event_buffer(0);
+
+    *err = NULL;
+    if (res.err != NULL) {
+        *err = strdup(res.err);
+    } else {
+        struct bind_result bound = bind("<test>", res.ast);
+
+        if (bound.err != NULL) {
+            *err = strdup(bound.err);
+        } else {
+            struct bytecode *b = compile(res.ast, bound.symbols);
+            struct translator *tr = new_translator(b);
+
+            while (list->size < MAX_EVENTS && translator_pull(tr, list, MAX_EVENTS - list->size) > 0) ;
+            free_translator(tr);
+            free_bytecode(b);
+        }
+        free_bind_result(&bound);
+    }
+
+    char *buffer = print(list);
+
+    free_event_buffer(list);
+    free_parse_result(&res);
+    return buffer;
+}
+
+char *stream_events(const char *source, size_t chunk, char **err) {
+    struct stream *s = new_stream("<test>", -1);
+    struct event_buffer *list = new_event_buffer(0);
+    size_t len = strlen(source);
+
+    for (size_t i = 0; i < len && !s->failed; i += chunk) {
+        stream_write(s, &source[i], i + chunk < len ? chunk : len - i);
+        stream_pull(s, list, MAX_EVENTS - list->size);
+    }
+    stream_close(s);
+    while (list->size < MAX_EVENTS && stream_pull(s, list, MAX_EVENTS - list->size) > 0) ;
+
+    char *buffer = print(list);
+
+    *err = s->err == NULL ? NULL : strdup(s->err);
+    free_event_buffer(list);
+    free_stream(s);
+    return buffer;
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../bind.h"
+#include "../translator.h"
+
+// Translation benchmark. Scores are built directly in memory so the parser is
+// kept out of the measurement. The flat score is a single 8{...} sheet holding
+// `n` notes, the repeated one is 8{c}x`n`; it compiles into a few instructions
+// and all but the first and the last iteration are expanded from one segment.
+// The referenced one defines riff:8{...}off of RIFF_SIZE notes and references
+// it `n` / RIFF_SIZE times.
+
+#define RIFF_SIZE 10
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// new_score builds a score of one sheet of `n` notes. With `references` the
+// sheet is labeled riff and referenced that many times.
+struct ast *new_score(size_t n, int repeat_count, size_t references) {
+    struct ast *a = new_ast();
+    size_t note = new_node(a, NODE_TYPE_NOTE);
+    size_t sheet = new_node(a, NODE_TYPE_SHEET);
+    size_t reference = new_node(a, NODE_TYPE_REFERENCE);
+    size_t eof = new_node(a, NODE_TYPE_EOF);
+    size_t crate = new_node(a, NODE_TYPE_CRATE);
+    size_t *children = calloc(n > references + 2 ? n : references + 2, sizeof (size_t));
+
+    a->nodes[note].u.note = (struct note) {.channel = -1, .letter = 'c', .accidental = string_view(""), .octave = -1, .velocity = -1};
+    a->nodes[sheet].u.sheet = (struct sheet) {.label = string_view(references > 0 ? "riff" : ""), .units = 1, .duration = 8,
+        .repeat_count = repeat_count, .symbol = -1};
+    a->nodes[reference].u.reference = (struct reference) {.label = string_view("riff"), .repeat_count = 1};
+
+    for (size_t i = 0; i < n; i++)
+        children[i] = note; // All the notes share one node
+    set_children(a, sheet, children, n);
+
+    // Definition, references and the EOF
+    children[0] = sheet;
+    for (size_t i = 0; i < references; i++)
+        children[i + 1] = reference; // All the references share one node
+    children[references + 1] = eof;
+    set_children(a, crate, children, references + 2);
+    a->root = crate;
+
+    free(children);
+    return a;
+}
+
+// run binds, compiles and translates the score.
+struct event_buffer *run(struct ast *score) {
+    struct bind_result bound = bind("<bench>", score);
+    struct bytecode *b = compile(score, bound.symbols);
+    struct event_buffer *events = translate(b);
+
+    free_bytecode(b);
+    free_bind_result(&bound);
+    return events;
+}
+
+int main(int argc, char **argv) {
+
+    size_t max = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+
+    printf("%10s %12s %12s %12s %12s %12s %12s %12s\n", "notes", "compile [ms]", "flat [ms]", "ns/note",
+      "repeat [ms]", "ns/note", "ref [ms]", "ns/note");
+    for (size_t size = 1000; size <= max; size *= 10) {
+        struct ast *flat = new_score(size, 1, 0);
+        struct ast *repeat = new_score(1, size, 0);
+        struct ast *referenced = new_score(RIFF_SIZE, 0, size / RIFF_SIZE);
+
+        double start = now();
+        struct bind_result bound = bind("<bench>", flat);
+        struct bytecode *b = compile(flat, bound.symbols);
+        double compiled = now() - start;
+
+        free_bytecode(b);
+        free_bind_result(&bound);
+
+        start = now();
+        struct event_buffer *flat_events = run(flat);
+        double flat_elapsed = now() - start;
+
+        start = now();
+        struct event_buffer *repeat_events = run(repeat);
+        double repeat_elapsed = now() - start;
+
+        start = now();
+        struct event_buffer *referenced_events = run(referenced);
+        double referenced_elapsed = now() - start;
+
+        if (flat_events == NULL || flat_events->size != size + 1 ||
+          repeat_events == NULL || repeat_events->size != size + 1 ||
+          referenced_events == NULL || referenced_events->size != size + 1) {
+            fprintf(stderr, "unexpected translation result for %zu notes\n", size);
+            return EXIT_FAILURE;
+        }
+
+        printf("%10zu %12.2f %12.2f %12.2f %12.2f %12.2f %12.2f %12.2f\n", size, compiled * 1e3,
+          flat_elapsed * 1e3, flat_elapsed * 1e9 / size, repeat_elapsed * 1e3, repeat_elapsed * 1e9 / size,
+          referenced_elapsed * 1e3, referenced_elapsed * 1e9 / size);
+
+        free_event_buffer(flat_events);
+        free_event_buffer(repeat_events);
+        free_event_buffer(referenced_events);
+        free_ast(flat);
+        free_ast(repeat);
+        free_ast(referenced);
+    }
+
+    return EXIT_SUCCESS;
+}
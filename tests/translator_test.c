@@ -2,7 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "utest.h"
-#include "../list.h"
+#include "../bind.h"
 #include "../translator.h"
 
 struct test_case {
@@ -26,13 +26,14 @@ void test_loop(struct test *t) {
         &(tc) {"8{c +1}loop", "(NOTE L-START t:0 ch:0 d:44 n:60 v:127) (NOTE L-END t:48 ch:0 d:44 n:61 v:127)"},
         &(tc) {"8{c +1 .}loop", "(NOTE L-START t:0 ch:0 d:44 n:60 v:127) (NOTE L-END t:48 ch:0 d:44 n:61 v:127)"},
         &(tc) {"8{. c .}loop", "(NOTE L-START-END t:48 ch:0 d:44 n:60 v:127)"},
+        &(tc) {"8{c}x3 8{d}loop", "(NOTE t:0 ch:0 d:44 n:60 v:127) (NOTE t:48 ch:0 d:44 n:60 v:127) (NOTE t:96 ch:0 d:44 n:60 v:127) (NOTE L-START-END t:144 ch:0 d:44 n:62 v:127)"},
+        &(tc) {"l:8{c d} 8{e}loop {l}x3", "(NOTE t:0 ch:0 d:44 n:60 v:127) (NOTE t:48 ch:0 d:44 n:62 v:127) (NOTE L-START-END t:96 ch:0 d:44 n:64 v:127)"},
+        &(tc) {"l:8{c d} {l}loop {l}x3", "(NOTE t:0 ch:0 d:44 n:60 v:127) (NOTE t:48 ch:0 d:44 n:62 v:127) (NOTE L-START t:96 ch:0 d:44 n:60 v:127) (NOTE L-END t:144 ch:0 d:44 n:62 v:127)"},
         NULL,
     };
 
-    struct parser p = new_parser();
-
     for (size_t i = 0; cases[i] != NULL; i++) {
-        struct parse_result res = parse("<test>", p, cases[i]->source);
+        struct parse_result res = parse("<test>", cases[i]->source);
 
         char *actual = get_events(&res);
         if (strcmp(cases[i]->expected, actual) != 0)
@@ -41,8 +42,6 @@ void test_loop(struct test *t) {
         free(actual);
         free_parse_result(&res);
     }
-
-    free_parser(&p);
 }
 
 void test_off(struct test *t) {
@@ -52,13 +51,33 @@ void test_off(struct test *t) {
         &(tc) {"8{c} label:8{c}off {label}", "(NOTE t:0 ch:0 d:44 n:60 v:127) (NOTE t:48 ch:0 d:44 n:60 v:127) (USR0 t:96)"},
         &(tc) {"8{label:1{c}}off {label}", "(NOTE t:0 ch:0 d:44 n:60 v:127) (USR0 t:48)"},
         &(tc) {"main:8{label:1{c}}off {main.label}", "(NOTE t:0 ch:0 d:44 n:60 v:127) (USR0 t:48)"},
+        &(tc) {"r:8{c}off 8{+1} {r} 8{+2}", "(NOTE t:0 ch:0 d:44 n:61 v:127) (NOTE t:48 ch:0 d:44 n:60 v:127) (NOTE t:96 ch:0 d:44 n:62 v:127) (USR0 t:144)"},
+        &(tc) {"r:8{c . d}off 8{e} {r}x2 8{-}", "(NOTE t:0 ch:0 d:44 n:64 v:127) (NOTE t:48 ch:0 d:44 n:60 v:127) (NOTE t:144 ch:0 d:44 n:62 v:127) (NOTE t:192 ch:0 d:44 n:60 v:127) (NOTE t:288 ch:0 d:92 n:62 v:127) (USR0 t:384)"},
         NULL,
     };
 
-    struct parser p = new_parser();
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]->source);
+
+        char *actual = get_events(&res);
+        if (strcmp(cases[i]->expected, actual) != 0)
+            failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
+
+        free(actual);
+        free_parse_result(&res);
+    }
+}
+
+// A referenced sheet without notes leaves channel, octave and velocity alone
+void test_reference_without_note(struct test *t) {
+    tc *cases[] = {
+        &(tc) {"4{c} l1:4{.} 4{e3} {l1} 4{g}", "(NOTE t:0 ch:0 d:92 n:60 v:127) (NOTE t:192 ch:0 d:92 n:40 v:127) (NOTE t:384 ch:0 d:92 n:43 v:127) (USR0 t:480)"},
+        &(tc) {"4{c} l1:4{cc1:5} 4{ch2:e3} {l1} 4{g}", "(NOTE t:0 ch:0 d:92 n:60 v:127) (CC p:1 v:5) (NOTE t:96 ch:2 d:92 n:40 v:127) (CC p:1 v:5) (NOTE t:192 ch:2 d:92 n:43 v:127) (USR0 t:288)"},
+        NULL,
+    };
 
     for (size_t i = 0; cases[i] != NULL; i++) {
-        struct parse_result res = parse("<test>", p, cases[i]->source);
+        struct parse_result res = parse("<test>", cases[i]->source);
 
         char *actual = get_events(&res);
         if (strcmp(cases[i]->expected, actual) != 0)
@@ -67,8 +86,26 @@ void test_off(struct test *t) {
         free(actual);
         free_parse_result(&res);
     }
+}
+
+void test_repeat(struct test *t) {
+    tc *cases[] = {
+        &(tc) {"8{c d}x3 8{-}", "(NOTE t:0 ch:0 d:44 n:60 v:127) (NOTE t:48 ch:0 d:44 n:62 v:127) (NOTE t:96 ch:0 d:44 n:60 v:127) (NOTE t:144 ch:0 d:44 n:62 v:127) (NOTE t:192 ch:0 d:44 n:60 v:127) (NOTE t:240 ch:0 d:92 n:62 v:127) (USR0 t:336)"},
+        &(tc) {"4{8{c}x2 d}x2", "(NOTE t:0 ch:0 d:8 n:60 v:127) (NOTE t:12 ch:0 d:8 n:60 v:127) (NOTE t:24 ch:0 d:92 n:62 v:127) (NOTE t:120 ch:0 d:8 n:60 v:127) (NOTE t:132 ch:0 d:8 n:60 v:127) (NOTE t:144 ch:0 d:92 n:62 v:127) (USR0 t:240)"},
+        &(tc) {"8{c}x2 8{+1}x2", "(NOTE t:0 ch:0 d:44 n:60 v:127) (NOTE t:48 ch:0 d:44 n:60 v:127) (NOTE t:96 ch:0 d:44 n:61 v:127) (NOTE t:144 ch:0 d:44 n:61 v:127) (USR0 t:192)"},
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]->source);
+
+        char *actual = get_events(&res);
+        if (strcmp(cases[i]->expected, actual) != 0)
+            failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
 
-    free_parser(&p);
+        free(actual);
+        free_parse_result(&res);
+    }
 }
 
 void test_interval_and_tie(struct test *t) {
@@ -82,10 +119,57 @@ void test_interval_and_tie(struct test *t) {
         NULL,
     };
 
-    struct parser p = new_parser();
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]->source);
+
+        char *actual = get_events(&res);
+        if (strcmp(cases[i]->expected, actual) != 0)
+            failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
+
+        free(actual);
+        free_parse_result(&res);
+    }
+}
+
+char *pull_events(struct parse_result *r, size_t chunk, size_t max) {
+    char *buffer = NULL;
+    size_t size = 0;
+
+    struct bind_result bound = bind("<test>", r->ast);
+    struct bytecode *b = compile(r->ast, bound.symbols);
+    struct translator *tr = new_translator(b);
+    struct event_buffer *list = new_event_buffer(chunk);
+
+    FILE* f = open_memstream(&buffer, &size);
+    for (size_t total = 0; total < max;) {
+        list->size = 0;
+        size_t n = translator_pull(tr, list, chunk);
+        if (n == 0)
+            break;
+        if (total > 0)
+            fprintf(f, " ");
+        print_events(list, f);
+        total += n;
+    }
+    fclose(f);
+
+    free_event_buffer(list);
+    free_translator(tr);
+    free_bytecode(b);
+    free_bind_result(&bound);
+    return buffer;
+}
+
+// Gaps and legato overlaps grow with the pulse of the score
+void test_pulse(struct test *t) {
+    tc *cases[] = {
+        &(tc) {"3{c d e}", "(NOTE t:0 ch:0 d:124 n:60 v:127) (NOTE t:128 ch:0 d:124 n:62 v:127) (NOTE t:256 ch:0 d:124 n:64 v:127) (USR0 t:384)"},
+        &(tc) {"7{c (d e)} 4{f}", "(NOTE t:0 ch:0 d:356 n:60 v:127) (NOTE t:384 ch:0 d:391 n:62 v:127) (NOTE t:768 ch:0 d:356 n:64 v:127) (NOTE t:1152 ch:0 d:644 n:65 v:127) (USR0 t:1824)"},
+        NULL,
+    };
 
     for (size_t i = 0; cases[i] != NULL; i++) {
-        struct parse_result res = parse("<test>", p, cases[i]->source);
+        struct parse_result res = parse("<test>", cases[i]->source);
 
         char *actual = get_events(&res);
         if (strcmp(cases[i]->expected, actual) != 0)
@@ -94,8 +178,171 @@ void test_interval_and_tie(struct test *t) {
         free(actual);
         free_parse_result(&res);
     }
+}
 
-    free_parser(&p);
+// Voices start together and are merged by tick, the longest one sets where
+// the score goes on
+void test_voices(struct test *t) {
+    tc *cases[] = {
+        &(tc) {"[8{c d} 4{e}] 8{f}", "(NOTE t:0 ch:0 d:44 n:60 v:127) (NOTE t:0 ch:0 d:92 n:64 v:127) (NOTE t:48 ch:0 d:44 n:62 v:127) (NOTE t:96 ch:0 d:44 n:65 v:127) (USR0 t:144)"},
+        &(tc) {"4{c} [8{- d} 8{ch2:e . +1}] CC1:2 8{-}", "(NOTE t:0 ch:0 d:140 n:60 v:127) (NOTE t:96 ch:2 d:44 n:64 v:127) (NOTE t:144 ch:0 d:44 n:62 v:127) (NOTE t:192 ch:2 d:92 n:65 v:127) (CC p:1 v:2) (USR0 t:288)"},
+        &(tc) {"a:8{c d e}off [{a}x2 2{g}]", "(NOTE t:0 ch:0 d:44 n:60 v:127) (NOTE t:0 ch:0 d:188 n:67 v:127) (NOTE t:48 ch:0 d:44 n:62 v:127) (NOTE t:96 ch:0 d:44 n:64 v:127) (NOTE t:144 ch:0 d:44 n:60 v:127) (NOTE t:192 ch:0 d:44 n:62 v:127) (NOTE t:240 ch:0 d:44 n:64 v:127) (USR0 t:288)"},
+        &(tc) {"[8{c}loop 4{d}]", "(NOTE t:0 ch:0 d:44 n:60 v:127) (NOTE t:0 ch:0 d:92 n:62 v:127)"},
+        &(tc) {"[8{+1 c 4{d}loop}off 8{e f}] 8{g}", "(NOTE t:0 ch:0 d:44 n:64 v:127) (NOTE t:48 ch:0 d:44 n:65 v:127) (NOTE t:96 ch:0 d:44 n:67 v:127) (USR0 t:144)"},
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]->source);
+
+        char *actual = get_events(&res);
+        if (strcmp(cases[i]->expected, actual) != 0)
+            failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
+
+        free(actual);
+        free_parse_result(&res);
+    }
+}
+
+// Tones of a chord go one after another at the same tick, a tie holds them
+// all
+void test_chord(struct test *t) {
+    tc *cases[] = {
+        &(tc) {"8{c [e g] - d}", "(NOTE t:0 ch:0 d:44 n:60 v:127) (NOTE t:48 ch:0 d:92 n:64 v:127) (NOTE t:48 ch:0 d:92 n:67 v:127) (NOTE t:144 ch:0 d:44 n:62 v:127) (USR0 t:192)"},
+        &(tc) {"4{[c +4 +7] -} 8{+2}", "(NOTE t:0 ch:0 d:188 n:60 v:127) (NOTE t:0 ch:0 d:188 n:64 v:127) (NOTE t:0 ch:0 d:188 n:67 v:127) (NOTE t:192 ch:0 d:44 n:62 v:127) (USR0 t:240)"},
+        &(tc) {"8{c [d e]}loop", "(NOTE L-START t:0 ch:0 d:44 n:60 v:127) (NOTE t:48 ch:0 d:44 n:62 v:127) (NOTE L-END t:48 ch:0 d:44 n:64 v:127)"},
+        &(tc) {"r:8{[c e] -}off 8{g} {r}x2 8{-}", "(NOTE t:0 ch:0 d:44 n:67 v:127) (NOTE t:48 ch:0 d:92 n:60 v:127) (NOTE t:48 ch:0 d:92 n:64 v:127) (NOTE t:144 ch:0 d:140 n:60 v:127) (NOTE t:144 ch:0 d:140 n:64 v:127) (USR0 t:288)"},
+        &(tc) {"[4{[c e]} 8{[d f] [g b]}]", "(NOTE t:0 ch:0 d:92 n:60 v:127) (NOTE t:0 ch:0 d:92 n:64 v:127) (NOTE t:0 ch:0 d:44 n:62 v:127) (NOTE t:0 ch:0 d:44 n:65 v:127) (NOTE t:48 ch:0 d:44 n:67 v:127) (NOTE t:48 ch:0 d:44 n:71 v:127) (USR0 t:96)"},
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]->source);
+
+        char *actual = get_events(&res);
+        if (strcmp(cases[i]->expected, actual) != 0)
+            failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
+
+        free(actual);
+        free_parse_result(&res);
+    }
+}
+
+void test_pull(struct test *t) {
+    char *cases[] = {
+        "8{c +1 -}",
+        "8{c . +1} 4{d e -}x3 CC1:2 4{f}",
+        "label:8{c d}off {label}x2 pgm3 {label}",
+        "8{c d}x2 lbl:4{(e f -) g}x2 {lbl}",
+        "4{8{c d}x3 e}x4 8{-}",
+        "r:8{c . d}x5 {r}x3 4{+1 -}",
+        "r:8{c . d}off 8{e} {r} 8{+2} {r}x2 8{-} {r}",
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]);
+
+        char *expected = get_events(&res);
+        for (size_t chunk = 1; chunk < 8; chunk += 3) {
+            char *actual = pull_events(&res, chunk, 1000);
+            if (strcmp(expected, actual) != 0)
+                failf(t, "  source: %s chunk: %zu\n    expected: %s\n         got: %s", cases[i], chunk, expected, actual);
+            free(actual);
+        }
+
+        free(expected);
+        free_parse_result(&res);
+    }
+}
+
+void test_pull_loop(struct test *t) {
+    tc *cases[] = {
+        &(tc) {"8{c d}loop", "(NOTE t:0 ch:0 d:44 n:60 v:127) (NOTE t:48 ch:0 d:44 n:62 v:127) (NOTE t:96 ch:0 d:44 n:60 v:127) (NOTE t:144 ch:0 d:44 n:62 v:127) (NOTE t:192 ch:0 d:44 n:60 v:127)"},
+        &(tc) {"4{c} 8{. d .}loop", "(NOTE t:0 ch:0 d:92 n:60 v:127) (NOTE t:144 ch:0 d:44 n:62 v:127) (NOTE t:288 ch:0 d:44 n:62 v:127) (NOTE t:432 ch:0 d:44 n:62 v:127) (NOTE t:576 ch:0 d:44 n:62 v:127)"},
+        &(tc) {"l:8{c d} 8{e}loop {l}x3", "(NOTE t:0 ch:0 d:44 n:60 v:127) (NOTE t:48 ch:0 d:44 n:62 v:127) (NOTE t:96 ch:0 d:44 n:64 v:127) (NOTE t:144 ch:0 d:44 n:64 v:127) (NOTE t:192 ch:0 d:44 n:64 v:127)"},
+        &(tc) {"l:8{c d} {l}loop {l}x3", "(NOTE t:0 ch:0 d:44 n:60 v:127) (NOTE t:48 ch:0 d:44 n:62 v:127) (NOTE t:96 ch:0 d:44 n:60 v:127) (NOTE t:144 ch:0 d:44 n:62 v:127) (NOTE t:192 ch:0 d:44 n:60 v:127)"},
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]->source);
+
+        char *actual = pull_events(&res, 1, 5);
+        if (strcmp(cases[i]->expected, actual) != 0)
+            failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
+
+        free(actual);
+        free_parse_result(&res);
+    }
+}
+
+// Loops of voices go on with their own periods, merged by tick
+void test_pull_cycles(struct test *t) {
+    tc *cases[] = {
+        &(tc) {"[4{c d e}loop 4{f g}loop]", "(NOTE t:0 ch:0 d:92 n:60 v:127) (NOTE t:0 ch:0 d:92 n:65 v:127) (NOTE t:96 ch:0 d:92 n:62 v:127) (NOTE t:96 ch:0 d:92 n:67 v:127) (NOTE t:192 ch:0 d:92 n:64 v:127) (NOTE t:192 ch:0 d:92 n:65 v:127) (NOTE t:288 ch:0 d:92 n:60 v:127) (NOTE t:288 ch:0 d:92 n:67 v:127) (NOTE t:384 ch:0 d:92 n:62 v:127) (NOTE t:384 ch:0 d:92 n:65 v:127)"},
+        &(tc) {"8{c} [2{[e g]}loop 4{d a}]", "(NOTE t:0 ch:0 d:44 n:60 v:127) (NOTE t:48 ch:0 d:188 n:64 v:127) (NOTE t:48 ch:0 d:188 n:67 v:127) (NOTE t:48 ch:0 d:92 n:62 v:127) (NOTE t:144 ch:0 d:92 n:69 v:127) (NOTE t:240 ch:0 d:188 n:64 v:127) (NOTE t:240 ch:0 d:188 n:67 v:127) (NOTE t:432 ch:0 d:188 n:64 v:127) (NOTE t:432 ch:0 d:188 n:67 v:127) (NOTE t:624 ch:0 d:188 n:64 v:127)"},
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]->source);
+
+        char *actual = pull_events(&res, 1, 10);
+        if (strcmp(cases[i]->expected, actual) != 0)
+            failf(t, "  source: %s\n    expected: %s\n         got: %s", cases[i]->source, cases[i]->expected, actual);
+
+        free(actual);
+        free_parse_result(&res);
+    }
+}
+
+// Repeats are not unrolled up front, so a huge repeat count costs nothing
+// until the events are pulled.
+void test_pull_huge_repeat(struct test *t) {
+    tc c = {"8{c d e f}x1000000000", "(NOTE t:0 ch:0 d:44 n:60 v:127) (NOTE t:48 ch:0 d:44 n:62 v:127) (NOTE t:96 ch:0 d:44 n:64 v:127)"};
+
+    struct parse_result res = parse("<test>", c.source);
+
+    char *actual = pull_events(&res, 3, 3);
+    if (strcmp(c.expected, actual) != 0)
+        failf(t, "expected: %s got: %s", c.expected, actual);
+
+    free(actual);
+    free_parse_result(&res);
+}
+
+char *get_parts(struct parse_result *r, size_t n);
+
+// Parts translated at once are joined into the events of the whole score
+void test_parts(struct test *t) {
+    char *cases[] = {
+        "8{c d}x3 8{e} 4{f}x2",
+        "8{c} 8{-} 4{d} 8{. -} 4{e}",
+        "8{ch2:c} CC7:1 4{d} pgm3 8{ch3:e} CC1:2 120bpm 4{f}",
+        "r:8{c . d}off 8{e} {r} 8{+2} {r}x2 8{-} {r}",
+        "8{c}x3 8{d}x2 l:8{(e f)}off {l}x3 {l}loop 8{g}",
+        "8{c} 4{d}x5 8{e . -}loop 8{f}x9",
+        "8{c}x1000 4{8{c d}x3 e}x4 8{c}x1000 8{-}",
+        "8{c}x50 [8{d e}x20 4{f}x10 2{g}x5] 8{a}x50 [4{c} 8{d}] 8{-}",
+        "8{[c e g] - [d +3]}x40 4{[c e] -}x3 8{-}",
+        NULL,
+    };
+
+    for (size_t i = 0; cases[i] != NULL; i++) {
+        struct parse_result res = parse("<test>", cases[i]);
+
+        char *expected = get_parts(&res, 1);
+        for (size_t n = 2; n <= 6; n++) {
+            char *actual = get_parts(&res, n);
+            if (strcmp(expected, actual) != 0)
+                failf(t, "  source: %s parts: %zu\n    expected: %s\n         got: %s", cases[i], n, expected, actual);
+            free(actual);
+        }
+
+        free(expected);
+        free_parse_result(&res);
+    }
 }
 
 int main(int argc, char **argv) {
@@ -103,7 +350,17 @@ int main(int argc, char **argv) {
     static test_fn tests[] = {
         test_loop,
         test_off,
+        test_reference_without_note,
         test_interval_and_tie,
+        test_repeat,
+        test_pulse,
+        test_voices,
+        test_chord,
+        test_pull,
+        test_pull_loop,
+        test_pull_cycles,
+        test_pull_huge_repeat,
+        test_parts,
         NULL,
     };
 
@@ -116,12 +373,34 @@ char *get_events(struct parse_result *r) {
     char *buffer = NULL;
     size_t size = 0;
 
-    struct event_list *list = translate(*r->n);
+    struct bind_result bound = bind("<test>", r->ast);
+    struct bytecode *b = compile(r->ast, bound.symbols);
+    struct event_buffer *list = translate(b);
+
+    FILE* f = open_memstream(&buffer, &size);
+    print_events(list, f);
+    fclose(f);
+
+    free_event_buffer(list);
+    free_bytecode(b);
+    free_bind_result(&bound);
+    return buffer;
+}
+
+char *get_parts(struct parse_result *r, size_t n) {
+    char *buffer = NULL;
+    size_t size = 0;
+
+    struct bind_result bound = bind("<test>", r->ast);
+    struct bytecode *b = compile(r->ast, bound.symbols);
+    struct event_buffer *list = translate_parts(b, n);
 
     FILE* f = open_memstream(&buffer, &size);
     print_events(list, f);
     fclose(f);
 
-    list_apply(list, free);
+    free_event_buffer(list);
+    free_bytecode(b);
+    free_bind_result(&bound);
     return buffer;
 }
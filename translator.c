@@ -1,559 +1,1455 @@
-#include <assert.h>
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <unistd.h>
 #include <alsa/asoundlib.h>
 
 #include "korlessa.h"
-#include "list.h"
-#include "parser.h"
+#include "compiler.h"
 #include "translator.h"
 
-struct event_list *new_event_list(snd_seq_event_t e) {
-    struct event_list *ptr = calloc(1, sizeof (struct event_list));
+#define DEFAULT_BUFFER_CAPACITY 256
+#define MAX_PARTS 64
+
+// NO_ADDRESS marks an unset address in the bytecode.
+#define NO_ADDRESS ((size_t) -1)
+
+struct event_buffer *new_event_buffer(size_t capacity) {
+    struct event_buffer *ptr = calloc(1, sizeof (struct event_buffer));
 
     if (ptr == NULL)
         return NULL;
-    ptr->e = e;
+
+    if (capacity == 0)
+        capacity = DEFAULT_BUFFER_CAPACITY;
+
+    ptr->events = calloc(capacity, sizeof (snd_seq_event_t));
+    if (ptr->events == NULL) {
+        free(ptr);
+        return NULL;
+    }
+    ptr->capacity = capacity;
+    ptr->loop_start = NO_EVENT;
+    ptr->loop_end = NO_EVENT;
     return ptr;
 }
 
-struct sheet_reference {
-    struct list l;
-    struct node *node;
-    char *label;
-    double divider;
+void free_event_buffer(struct event_buffer *b) {
+    if (b == NULL)
+        return;
+    free(b->events);
+    free(b);
+}
+
+size_t event_buffer_append(struct event_buffer *b, snd_seq_event_t e) {
+    if (b->size == b->capacity) {
+        size_t capacity = b->capacity * 2;
+        void *ptr = realloc(b->events, capacity * sizeof (snd_seq_event_t));
+
+        if (ptr == NULL)
+            return NO_EVENT;
+        b->events = ptr;
+        b->capacity = capacity;
+    }
+    b->events[b->size] = e;
+    return b->size++;
+}
+
+bool event_buffer_is_loop(struct event_buffer *b) {
+    return b->loop_start != NO_EVENT && b->loop_end != NO_EVENT;
+}
+
+// context holds the registers of the VM.
+struct context {
+    unsigned int offset;
+    unsigned int step; // Duration of one element in ticks
+    unsigned int ppq;
+    unsigned char channel;
+    struct event_buffer *events;
+    size_t base; // Index of the first event kept in `events`
+    snd_seq_event_t last_note;
+    bool has_last_note;
+    size_t prev_tone; // Might be note or interval
+    size_t tones; // Events of the last tone, a chord has several up to prev_tone
+    bool did_rest;
+    bool legato;
+    bool chord; // Tones go at the same offset until the chord ends
+    int repeat_count; // Iterations of the next call
 };
 
-struct sheet_reference *new_sheet_reference(struct node *node, char *label, double divider) {
-    struct sheet_reference *ptr = calloc(1, sizeof (struct sheet_reference));
+struct context init_context(struct event_buffer *events, unsigned int ppq) {
 
-    if (ptr == NULL)
-        return NULL;
-    ptr->node = node;
-    ptr->label = label;
-    ptr->divider = divider;
-    return ptr;
+    // Default values
+    return (struct context) {
+        .offset = 0,
+        .step = ppq * 4,
+        .ppq = ppq,
+        .channel = 0,
+        .events = events,
+        .base = 0,
+        .has_last_note = false,
+        .prev_tone = NO_EVENT,
+        .tones = 0,
+        .did_rest = false,
+        .legato = false,
+        .chord = false,
+        .repeat_count = 1,
+    };
 }
 
-bool find_label_in_sheet_reference(void *reference, void *arg) {
-    struct sheet_reference *r = reference;
-    char *label = arg;
+// frame is one call of a function. A repeated sheet stays on the stack until
+// its last iteration is over.
+struct frame {
+    size_t function;
+    size_t ret; // Address to continue at after the last iteration
+    int count; // Remaining iterations
+    unsigned int step; // Step to restore when leaving the frame
+    unsigned int old_offset;
+    size_t start; // First event translated within the frame
+    size_t loop_first; // First event of the loop
+    bool loop;
+    bool dry_run;
+    bool shared; // Iterations are copies of the first one
+    bool record; // First iteration becomes the template of the function
+};
+
+// template is the output of a referenced pure function with ticks relative
+// to its start. Once recorded, later calls copy it instead of running the
+// function again.
+struct template {
+    snd_seq_event_t *events;
+    size_t size;
+    size_t tone; // Last tone
+    size_t tones;
+    unsigned int length; // Length in ticks
+    snd_seq_event_t last_note;
+    bool did_rest;
+};
+
+// segment is the first iteration of a shared frame. Iterations between the
+// first and the last one are only expanded when they are drained; the last
+// one is copied into the window, so the following elements can tie to it.
+struct segment {
+    size_t start;
+    size_t end;
+    size_t tone; // Last tone of the segment
+    size_t tones;
+    unsigned int length; // Length of one iteration in ticks
+    unsigned int count; // Iterations left to expand
+    size_t position; // Next event to expand
+    unsigned int shift; // Shift of the iteration being expanded
+};
 
-    return strcmp(r->label, label) == 0;
+// run is the part of the window translated by one voice, `next` is its event
+// to be merged next. The first loop of the voice, if any, is taken out of the
+// run and becomes a cycle.
+struct run {
+    size_t next;
+    size_t end;
+    size_t loop_start;
+    size_t loop_end;
+    unsigned int loop_length;
+};
+
+// voices are translated one after another into runs of the window, each
+// starting at `offset` with the context the first one got. Once the last one
+// is done the runs are merged by tick, until then nothing from `start` on is
+// released.
+struct voices {
+    bool open;
+    size_t start;
+    unsigned int offset;
+    unsigned int end; // End of the longest voice so far
+    struct context ctx;
+    struct run *runs;
+    size_t n_runs;
+    size_t capacity;
+    size_t *heap; // Runs by their next event, `capacity` of them
+    snd_seq_event_t *scratch; // Copy of the runs while they are merged
+    size_t scratch_capacity;
+};
+
+// cycle is a voice played on its own alongside the others once any of them
+// loops. The voice plays once up to its loop, which then goes on over and
+// over with its own period. Events are kept out of the window with the ticks
+// of the first iteration, so memory depends on the voices only, no matter how
+// the lengths of the loops line up.
+struct cycle {
+    snd_seq_event_t *events;
+    size_t size;
+    size_t loop; // First event of the loop, `size` for none
+    unsigned int length; // Period of the loop in ticks
+    size_t next; // Next event to be played
+    unsigned int shift; // Shift of the iteration being played
+};
+
+// cycles are played by the next tick of each, from a heap of their indices.
+struct cycles {
+    struct cycle *all;
+    size_t n;
+    size_t *heap;
+    size_t n_heap;
+};
+
+// translator runs the bytecode lazily. Events are translated into a small
+// window and released once nothing can change them anymore (ties modify the
+// last tone, sheets marked `off` drop their events). Repeats are kept as
+// counters on the frame stack, so memory depends on the nesting depth and on
+// the bodies of loops, not on the length of the score.
+struct translator {
+    struct bytecode *b;
+    size_t pc;
+    struct context ctx;
+    struct frame *frames;
+    size_t depth;
+    size_t capacity;
+    size_t dry_runs; // Number of `off` frames on the stack
+    size_t loops; // Number of loop frames on the stack
+    struct segment segment;
+    struct voices voices;
+    struct cycles cycles;
+    struct template *templates; // One per function
+    size_t n_templates;
+    size_t released; // Next event to be handed out
+    size_t expanded; // Events handed out by expand, they have no index
+    bool passed; // Whole program has been run through
+    bool failed; // Out of memory, the events are incomplete
+    bool more; // More code may follow the HALT
+    bool waiting; // Stopped at the HALT until more code follows
+    size_t end; // Top level address taken for the HALT, NO_ADDRESS for none
+
+    // Loop, if any, as absolute indices
+    size_t loop_start;
+    size_t loop_end;
+    unsigned int loop_offset;
+    size_t loop_expanded; // Events expanded before the loop
+
+    // Replay position within the loop
+    size_t replay;
+    unsigned int replay_offset;
+};
+
+snd_seq_event_t translate_note(struct context *ctx, struct instruction i);
+snd_seq_event_t translate_interval(struct context *ctx, snd_seq_event_t event, struct instruction i);
+snd_seq_event_t translate_controller(struct context *ctx, struct instruction i);
+snd_seq_event_t translate_program(struct context *ctx, struct instruction i);
+snd_seq_event_t translate_eof(struct context *ctx);
+snd_seq_event_t translate_tempo(struct context *ctx, unsigned int tempo);
+void print_event(struct event_buffer *b, size_t index, FILE * f);
+
+snd_seq_event_t *get_event(struct context *ctx, size_t index) {
+    return &ctx->events->events[index - ctx->base];
 }
 
-void free_sheet_reference(void *r) {
-    struct sheet_reference *ptr = r;
+size_t emit(struct translator *t, snd_seq_event_t e) {
+    struct context *ctx = &t->ctx;
+    size_t index = event_buffer_append(ctx->events, e);
+
+    if (index == NO_EVENT) {
+        t->failed = true;
+        return NO_EVENT;
+    }
+    index += ctx->base;
+
+    // First event of a loop; events inside `off` sheets don't count, not even
+    // for loops within them, or voices would keep loops of dropped events
+    for (size_t i = t->depth; t->dry_runs == 0 && i-- > 0;) {
+        struct frame *f = &t->frames[i];
+
+        if (f->loop && f->loop_first == NO_EVENT)
+            f->loop_first = index;
+    }
+    return index;
+}
 
-    free(ptr->label);
-    free(ptr);
+// drop_events throws away everything translated from index `start` on. It is
+// used for sheets that are translated only to keep the context up to date.
+void drop_events(struct translator *t, size_t start) {
+    struct context *ctx = &t->ctx;
+
+    ctx->events->size = start - ctx->base;
+    if (ctx->prev_tone != NO_EVENT && ctx->prev_tone >= start)
+        ctx->prev_tone = NO_EVENT;
+    if (t->loop_end != NO_EVENT && t->loop_end >= start) {
+        t->loop_start = NO_EVENT;
+        t->loop_end = NO_EVENT;
+    }
 }
 
-void free_after_loop(void *event, void *ctx) {
-    struct event_list *e = event;
-    bool *is_loop = ctx;
+bool push_frame(struct translator *t, struct frame f) {
+    if (t->depth == t->capacity) {
+        size_t capacity = t->capacity == 0 ? 16 : t->capacity * 2;
+        void *ptr = realloc(t->frames, capacity * sizeof (struct frame));
 
-    if (*is_loop) {
-        free(e);
+        if (ptr == NULL) {
+            t->failed = true;
+            return false;
+        }
+        t->frames = ptr;
+        t->capacity = capacity;
+    }
+    f.start = t->ctx.base + t->ctx.events->size;
+    f.loop_first = NO_EVENT;
+    if (f.dry_run)
+        t->dry_runs++;
+    if (f.loop)
+        t->loops++;
+    t->frames[t->depth++] = f;
+    return true;
+}
+
+void pop_frame(struct translator *t) {
+    struct context *ctx = &t->ctx;
+    struct frame *f = &t->frames[--t->depth];
+
+    if (f->dry_run) {
+        drop_events(t, f->start);
+        ctx->offset = f->old_offset;
+        t->dry_runs--;
+    }
+    if (f->loop)
+        t->loops--;
+    ctx->step = f->step;
+    t->pc = f->ret;
+}
+
+void ret(struct translator *t);
+
+// record keeps the first iteration of the top frame as the template.
+void record(struct translator *t, struct frame *f) {
+    struct context *ctx = &t->ctx;
+    struct template *tpl = &t->templates[f->function];
+    size_t size = ctx->base + ctx->events->size - f->start;
+
+    f->record = false;
+    if (ctx->prev_tone == NO_EVENT || ctx->prev_tone < f->start)
+        return;
+
+    tpl->events = calloc(size, sizeof (snd_seq_event_t));
+    if (tpl->events == NULL)
         return;
+    for (size_t i = 0; i < size; i++) {
+        tpl->events[i] = *get_event(ctx, f->start + i);
+        tpl->events[i].time.tick -= f->old_offset;
     }
+    tpl->size = size;
+    tpl->tone = ctx->prev_tone - f->start;
+    tpl->tones = ctx->tones;
+    tpl->length = ctx->offset - f->old_offset;
+    tpl->last_note = ctx->last_note;
+    tpl->did_rest = ctx->did_rest;
+}
+
+// instantiate copies the template to the current offset and leaves the state
+// as if the function has been run. The state is left as it is when out of
+// memory.
+void instantiate(struct translator *t, struct template *tpl) {
+    struct context *ctx = &t->ctx;
+    size_t start = ctx->base + ctx->events->size;
+
+    for (size_t i = 0; i < tpl->size; i++) {
+        snd_seq_event_t e = tpl->events[i];
 
-    if (e->end_loop) {
-        e->l.next = NULL;
-        *is_loop = true;
+        e.time.tick += ctx->offset;
+        if (emit(t, e) == NO_EVENT)
+            return;
     }
+    ctx->prev_tone = start + tpl->tone;
+    ctx->tones = tpl->tones;
+    ctx->last_note = tpl->last_note;
+    ctx->has_last_note = true;
+    ctx->channel = tpl->last_note.data.note.channel;
+    ctx->did_rest = tpl->did_rest;
+    ctx->offset += tpl->length;
 }
 
-struct namespace {
-    struct list l;
-    const char *label;
-};
+void call(struct translator *t, size_t function) {
+    struct context *ctx = &t->ctx;
+    struct function *fn = &t->b->functions[function];
+    struct frame f = {
+        .function = function,
+        .ret = t->pc,
+        .count = ctx->repeat_count,
+        .step = ctx->step,
+        .old_offset = ctx->offset,
+    };
 
-struct namespace *new_namespace(const char *label) {
-    struct namespace *ptr = calloc(1, sizeof (struct namespace));
+    // Loop is indicated by negative number of repeat_count
+    if (f.count < 0) {
+        f.count = 1;
+        f.loop = true;
+    } else if (f.count == 0) {
+        f.count = 1;
+        f.dry_run = true;
+    }
+    ctx->repeat_count = 1;
 
-    if (ptr == NULL)
-        return NULL;
-    ptr->label = label;
-    return ptr;
+    // Events inside `off` sheets, loops and voices are needed in the window.
+    // Once the loop has closed nothing but its first tone after is run, so
+    // there is nothing to share or instantiate.
+    bool closed = t->loop_end != NO_EVENT;
+
+    f.shared = fn->pure && f.count > 1 && t->dry_runs == 0 && t->loops == 0 && !t->voices.open && !closed;
+    f.record = fn->pure && fn->referenced && t->templates[function].events == NULL;
+
+    if (!push_frame(t, f))
+        return;
+    ctx->step = fn->step;
+    t->pc = fn->address;
+
+    if (fn->pure && t->templates[function].events != NULL && !closed) {
+        instantiate(t, &t->templates[function]);
+        ret(t);
+    }
 }
 
-char *get_label(struct namespace *ns) {
+// copy_segment copies events of the first iteration to the window shifted by
+// `shift` ticks and moves the last tone to the copy. The last tone stays when
+// out of memory, the copy is incomplete.
+void copy_segment(struct translator *t, struct segment *s, unsigned int shift) {
+    struct context *ctx = &t->ctx;
+    size_t start = ctx->base + ctx->events->size;
 
-    // Count
-    int len = 0;
-    int elements = 0;
+    for (size_t i = s->start; i < s->end; i++) {
+        snd_seq_event_t e = *get_event(ctx, i);
 
-    for (struct namespace * n = ns; n != NULL; n = n->l.next) {
-        len += strlen(n->label);
-        elements++;
+        e.time.tick += shift;
+        if (emit(t, e) == NO_EVENT)
+            return;
     }
+    ctx->prev_tone = start + (s->tone - s->start);
+    ctx->tones = s->tones;
+}
 
-    if (elements == 0)
-        return NULL;
+// share replaces the remaining iterations of the top frame with copies of the
+// first one. Unless an enclosing frame is going to be shared too, iterations
+// are left to be expanded by pull.
+void share(struct translator *t, struct frame *f) {
+    struct context *ctx = &t->ctx;
+    struct segment s = {
+        .start = f->start,
+        .end = ctx->base + ctx->events->size,
+        .tone = ctx->prev_tone,
+        .tones = ctx->tones,
+        .length = ctx->offset - f->old_offset,
+        .count = f->count - 1,
+        .position = f->start,
+        .shift = ctx->offset - f->old_offset,
+    };
+    bool nested = false;
 
-    // Count dots `.` in
-    len += elements - 1;
-    // Count `\0` in
-    len++;
+    for (size_t i = 0; i + 1 < t->depth; i++)
+        nested = nested || t->frames[i].shared || t->frames[i].record;
 
-    // Allocate
-    char *tmp = calloc(len, sizeof (char));
+    if (nested || s.count == 0) {
+        for (unsigned int i = 1; i <= f->count && !t->failed; i++)
+            copy_segment(t, &s, s.length * i);
+        ctx->offset = f->old_offset + s.length * (f->count + 1);
+        pop_frame(t);
+        return;
+    }
 
-    if (tmp == NULL)
-        return NULL;
+    // Nothing is going to tie to the first iteration anymore
+    ctx->prev_tone = NO_EVENT;
+    t->segment = s;
+}
 
-    char *full_label = calloc(len, sizeof (char));
+// expand hands out up to `n` events of the pending iterations.
+size_t expand(struct translator *t, struct event_buffer *out, size_t n) {
+    struct context *ctx = &t->ctx;
+    struct segment *s = &t->segment;
+    size_t moved = 0;
 
-    if (full_label == NULL)
-        return NULL;
+    while (s->count > 0 && moved < n) {
+        snd_seq_event_t e = *get_event(ctx, s->position);
 
-    // Build the label up
-    snprintf(full_label, len, "%s", ns->label);
-    for (struct namespace *n = ns->l.next; n != NULL; n = n->l.next) {
-        snprintf(tmp, len, "%s.%s", full_label, n->label);
-        snprintf(full_label, len, "%s", tmp);
+        e.time.tick += s->shift;
+        if (event_buffer_append(out, e) == NO_EVENT) {
+            t->failed = true;
+            return moved;
+        }
+        moved++;
+        t->expanded++;
+        if (++s->position == s->end) {
+            s->position = s->start;
+            s->shift += s->length;
+            s->count--;
+        }
     }
 
-    free(tmp);
+    // Last iteration goes to the window
+    if (s->count == 0) {
+        struct frame *f = &t->frames[t->depth - 1];
 
-    return full_label;
+        copy_segment(t, s, s->shift);
+        ctx->offset = f->old_offset + s->shift + s->length;
+        pop_frame(t);
+    }
+    return moved;
 }
 
-struct context {
-    unsigned int bpm;
-    unsigned int offset;
-    int octave;
-    struct sheet_reference *sheets;
-    struct namespace *namespace;
-    unsigned char channel;
-    double divider;
-    int velocity;
-    struct event_list *last_note;
-    struct event_list *prev_tone; // Might be note or interval
-    bool did_rest;
-    bool referencing;
-    bool legato;
-};
+// add_run starts the run of the next voice at the end of the window.
+bool add_run(struct translator *t) {
+    struct voices *v = &t->voices;
 
-struct context init_context() {
+    if (v->n_runs == v->capacity) {
+        size_t capacity = v->capacity == 0 ? 4 : v->capacity * 2;
+        void *runs = realloc(v->runs, capacity * sizeof (struct run));
 
-    // Default values
-    return (struct context) {
-        .bpm = 120,
-        .offset = 0,
-        .octave = 5,
-        .sheets = NULL,
-        .namespace = NULL,
-        .channel = 0,
-        .divider = 1.,
-        .velocity = 9,
-        .last_note = NULL,
-        .prev_tone = NULL,
-        .did_rest = false,
-        .referencing = false,
-        .legato = false,
+        if (runs == NULL) {
+            t->failed = true;
+            return false;
+        }
+        v->runs = runs;
+
+        void *heap = realloc(v->heap, capacity * sizeof (size_t));
+
+        if (heap == NULL) {
+            t->failed = true;
+            return false;
+        }
+        v->heap = heap;
+        v->capacity = capacity;
+    }
+    v->runs[v->n_runs++] = (struct run) {
+        .next = t->ctx.base + t->ctx.events->size,
+        .loop_start = NO_EVENT,
+        .loop_end = NO_EVENT,
     };
+    return true;
 }
 
-snd_seq_event_t translate_note(struct context *ctx, struct note *n);
-snd_seq_event_t translate_interval(struct context *ctx, snd_seq_event_t event, struct interval *i);
-snd_seq_event_t translate_controller(struct context *ctx, struct controller *c);
-snd_seq_event_t translate_program(struct context *ctx, struct program *p);
-snd_seq_event_t translate_eof(struct context *ctx);
-snd_seq_event_t translate_tempo(struct context *ctx, unsigned int tempo);
-void print_event(struct event_list *l, FILE * f);
+void open_voices(struct translator *t) {
+    struct voices *v = &t->voices;
 
-// Duration of the note in ticks
-unsigned int compute_duration(double divider) {
-    double d = (PULSE_PER_QUARTER * 4) / divider;
-    unsigned int ret = (unsigned int) d;
+    v->open = true;
+    v->start = t->ctx.base + t->ctx.events->size;
+    v->offset = t->ctx.offset;
+    v->end = t->ctx.offset;
+    v->ctx = t->ctx;
+    v->n_runs = 0;
+    add_run(t);
+}
 
-    if (d - ret > 0)
-        fprintf(stderr, "warning, not in pulse\n");
-    return ret;
+// next_voice goes back to the start with the context the first voice got.
+// Only the first voice can tie to the tone before.
+void next_voice(struct translator *t) {
+    struct context *ctx = &t->ctx;
+    struct voices *v = &t->voices;
+
+    if (ctx->offset > v->end)
+        v->end = ctx->offset;
+    ctx->offset = v->offset;
+    ctx->channel = v->ctx.channel;
+    ctx->last_note = v->ctx.last_note;
+    ctx->has_last_note = v->ctx.has_last_note;
+    ctx->did_rest = v->ctx.did_rest;
+    ctx->prev_tone = NO_EVENT;
+    add_run(t);
 }
 
-bool isNotEmpty(char *str) {
-    if (str == NULL)
-        return true;
-    return str[0] != '\0';
+// earlier tells whether the next event of run `a` goes before the one of `b`,
+// the earlier voice wins a tie so the merge is stable.
+bool earlier(struct voices *v, size_t a, size_t b) {
+    unsigned int ta = v->scratch[v->runs[a].next - v->start].time.tick;
+    unsigned int tb = v->scratch[v->runs[b].next - v->start].time.tick;
+
+    return ta < tb || (ta == tb && a < b);
 }
 
-struct event_list *_translate(struct context *ctx, struct node *n) {
-    switch (n->type) {
+void sift_down(struct voices *v, size_t i, size_t n) {
+    for (;;) {
+        size_t min = i;
+        size_t l = 2 * i + 1;
+        size_t r = l + 1;
 
-    case NODE_TYPE_BPM:
-    {
-        snd_seq_event_t e = translate_tempo(ctx, n->u.bpm->value);
+        if (l < n && earlier(v, v->heap[l], v->heap[min]))
+            min = l;
+        if (r < n && earlier(v, v->heap[r], v->heap[min]))
+            min = r;
+        if (min == i)
+            return;
+
+        size_t tmp = v->heap[i];
 
-        ctx->bpm = n->u.bpm->value;
-        return new_event_list(e);
+        v->heap[i] = v->heap[min];
+        v->heap[min] = tmp;
+        i = min;
     }
+}
 
-    case NODE_TYPE_NOTE:
-    {
-        struct note *note = n->u.note;
+// cycle_earlier tells whether cycle `a` plays its next event before `b`, the
+// earlier voice wins a tie.
+bool cycle_earlier(struct cycles *c, size_t a, size_t b) {
+    struct cycle *ca = &c->all[a];
+    struct cycle *cb = &c->all[b];
+    unsigned int ta = ca->events[ca->next].time.tick + ca->shift;
+    unsigned int tb = cb->events[cb->next].time.tick + cb->shift;
 
-        if (note->channel == -1)
-            note->channel = ctx->channel;
+    return ta < tb || (ta == tb && a < b);
+}
 
-        if (note->octave == -1)
-            note->octave = ctx->octave;
+void sift_cycles(struct cycles *c, size_t i) {
+    for (;;) {
+        size_t min = i;
+        size_t l = 2 * i + 1;
+        size_t r = l + 1;
 
-        if (note->velocity == -1)
-            note->velocity = ctx->velocity;
+        if (l < c->n_heap && cycle_earlier(c, c->heap[l], c->heap[min]))
+            min = l;
+        if (r < c->n_heap && cycle_earlier(c, c->heap[r], c->heap[min]))
+            min = r;
+        if (min == i)
+            return;
 
-        snd_seq_event_t e = translate_note(ctx, note);
-        struct event_list *entry = new_event_list(e);
+        size_t tmp = c->heap[i];
 
-        ctx->channel = note->channel;
-        ctx->octave = note->octave;
-        ctx->velocity = note->velocity;
-        ctx->last_note = entry;
-        ctx->prev_tone = entry;
-        ctx->did_rest = false;
-        ctx->offset += compute_duration(ctx->divider);
-        return entry;
+        c->heap[i] = c->heap[min];
+        c->heap[min] = tmp;
+        i = min;
     }
+}
 
-    case NODE_TYPE_INTERVAL:
-    {
-        if (ctx->last_note != NULL) {
-            snd_seq_event_t e = translate_interval(ctx, ctx->last_note->e, n->u.interval);
-            struct event_list *entry = new_event_list(e);
+// cycle_voices turns each voice into a cycle, so the voices are merged by
+// their next ticks as they are played. A voice plays once up to its loop, if
+// it has one, which goes on over and over from then on. Function returns
+// false when out of memory, which fails the translation.
+bool cycle_voices(struct translator *t, size_t end) {
+    struct voices *v = &t->voices;
+    struct cycles *c = &t->cycles;
+
+    c->all = calloc(v->n_runs, sizeof (struct cycle));
+    c->heap = calloc(v->n_runs, sizeof (size_t));
+    if (c->all == NULL || c->heap == NULL)
+        goto cleanup;
+
+    for (size_t i = 0; i < v->n_runs; i++) {
+        struct run *r = &v->runs[i];
+        size_t last = i + 1 < v->n_runs ? v->runs[i + 1].next : end;
+
+        // Nothing after the loop is played
+        if (r->loop_start != NO_EVENT)
+            last = r->loop_end + 1;
+
+        size_t size = last - r->next;
+
+        c->all[i] = (struct cycle) {
+            .events = malloc(size * sizeof (snd_seq_event_t)),
+            .size = size,
+            .loop = r->loop_start != NO_EVENT ? r->loop_start - r->next : size,
+            .length = r->loop_length,
+        };
+        c->n++;
+        if (c->all[i].events == NULL && size > 0)
+            goto cleanup;
+        if (size > 0) {
+            memcpy(c->all[i].events, get_event(&t->ctx, r->next), size * sizeof (snd_seq_event_t));
+            c->heap[c->n_heap++] = i;
+        }
+    }
+    for (size_t i = c->n_heap / 2; i-- > 0;)
+        sift_cycles(c, i);
+    return true;
+
+  cleanup:
+    for (size_t i = 0; i < c->n; i++)
+        free(c->all[i].events);
+    free(c->all);
+    free(c->heap);
+    *c = (struct cycles) { 0 };
+    t->failed = true;
+    return false;
+}
 
-            ctx->prev_tone = entry;
-            ctx->did_rest = false;
-            ctx->offset += compute_duration(ctx->divider);
-            return entry;
+// merge_voices closes the voices at the end of the longest one and merges
+// the runs by tick in the window. Each run is sorted already, so a heap of
+// their next events does it in O(n log k) for n events of k voices. Voices
+// with loops become cycles instead, as the loops never end.
+void merge_voices(struct translator *t) {
+    struct context *ctx = &t->ctx;
+    struct voices *v = &t->voices;
+    size_t end = ctx->base + ctx->events->size;
+    size_t size = end - v->start;
+    size_t n = 0;
+    bool loops = false;
+
+    if (ctx->offset < v->end)
+        ctx->offset = v->end;
+    v->open = false;
+
+    for (size_t i = 0; i < v->n_runs; i++)
+        loops = loops || v->runs[i].loop_start != NO_EVENT;
+    if (loops) {
+        if (cycle_voices(t, end)) {
+            drop_events(t, v->start);
+            t->passed = true;
+        }
+        return;
+    }
+
+    if (size > v->scratch_capacity) {
+        void *ptr = realloc(v->scratch, size * sizeof (snd_seq_event_t));
+
+        // Voices one after another are out of tick order
+        if (ptr == NULL) {
+            t->failed = true;
+            return;
         }
-        ctx->offset += compute_duration(ctx->divider);
+        v->scratch = ptr;
+        v->scratch_capacity = size;
+    }
+    if (size > 0)
+        memcpy(v->scratch, get_event(ctx, v->start), size * sizeof (snd_seq_event_t));
+
+    for (size_t i = 0; i < v->n_runs; i++) {
+        v->runs[i].end = i + 1 < v->n_runs ? v->runs[i + 1].next : end;
+        if (v->runs[i].next < v->runs[i].end)
+            v->heap[n++] = i;
+    }
+    for (size_t i = n / 2; i-- > 0;)
+        sift_down(v, i, n);
+
+    size_t tone = ctx->prev_tone;
+
+    for (size_t i = v->start; n > 0; i++) {
+        struct run *r = &v->runs[v->heap[0]];
+
+        if (r->next == tone)
+            ctx->prev_tone = i;
+        *get_event(ctx, i) = v->scratch[r->next - v->start];
+        if (++r->next == r->end)
+            v->heap[0] = v->heap[--n];
+        sift_down(v, 0, n);
+    }
+}
+
+void ret(struct translator *t) {
+    struct context *ctx = &t->ctx;
+    struct frame *f = &t->frames[t->depth - 1];
+
+    if (f->record)
+        record(t, f);
+
+    // Loop closes on the last tone of the sheet; the first one wins. Within
+    // voices it closes the loop of the voice only.
+    if (f->loop && f->loop_first != NO_EVENT && ctx->prev_tone != NO_EVENT && ctx->prev_tone >= f->loop_first) {
+        struct run *r = t->voices.n_runs > 0 ? &t->voices.runs[t->voices.n_runs - 1] : NULL;
+
+        if (t->voices.open && r != NULL && r->loop_start == NO_EVENT) {
+            r->loop_start = f->loop_first;
+            r->loop_end = ctx->prev_tone;
+            r->loop_length = ctx->offset - f->old_offset;
+        } else if (!t->voices.open && t->loop_end == NO_EVENT) {
+            t->loop_start = f->loop_first;
+            t->loop_end = ctx->prev_tone;
+            t->loop_offset = ctx->offset - f->old_offset;
+            t->loop_expanded = t->expanded;
+        }
+    }
+
+    if (--f->count > 0) {
+        if (f->shared && t->loop_end == NO_EVENT) {
+            share(t, f);
+            return;
+        }
+        t->pc = t->b->functions[f->function].address;
+        return;
+    }
+    pop_frame(t);
+}
+
+// add_tone makes the event the last tone. Tones of a chord are emitted one
+// after another, so the last tone is a run of events ending at prev_tone.
+void add_tone(struct context *ctx, size_t index) {
+    ctx->tones = ctx->chord ? ctx->tones + 1 : 1;
+    ctx->prev_tone = index;
+    ctx->did_rest = false;
+    if (!ctx->chord)
+        ctx->offset += ctx->step;
+}
+
+// step executes the next instruction.
+void step(struct translator *t) {
+    struct context *ctx = &t->ctx;
+
+    if (t->pc == t->end && t->depth == 0) {
+        t->passed = true;
+        return;
+    }
+
+    struct instruction i = t->b->code[t->pc++];
+
+    switch (i.op) {
+
+    case OP_NOTE:
+    {
+        snd_seq_event_t e = translate_note(ctx, i);
+
+        ctx->channel = i.a;
+        ctx->last_note = e;
+        ctx->has_last_note = true;
+
+        size_t index = emit(t, e);
+
+        if (index != NO_EVENT)
+            add_tone(ctx, index);
         break;
     }
 
-    case NODE_TYPE_REST:
+    case OP_INTERVAL:
+        if (ctx->has_last_note) {
+            snd_seq_event_t e = translate_interval(ctx, ctx->last_note, i);
+            size_t index = emit(t, e);
+
+            if (index != NO_EVENT)
+                add_tone(ctx, index);
+        } else if (!ctx->chord)
+            ctx->offset += ctx->step;
+        break;
+
+    case OP_REST:
         ctx->did_rest = true;
-        ctx->offset += compute_duration(ctx->divider);
+        ctx->offset += ctx->step;
         break;
 
-    case NODE_TYPE_TIE:
-    {
-        unsigned int d = compute_duration(ctx->divider);
+    case OP_TIE:
+        if (ctx->prev_tone != NO_EVENT && !ctx->did_rest) {
+            for (size_t k = 0; k < ctx->tones; k++)
+                get_event(ctx, ctx->prev_tone - k)->data.note.duration += ctx->step;
+        }
+        ctx->offset += ctx->step;
+        break;
+
+    case OP_CC:
+        emit(t, translate_controller(ctx, i));
+        break;
+
+    case OP_PGM:
+        emit(t, translate_program(ctx, i));
+        break;
+
+    case OP_TEMPO:
+        emit(t, translate_tempo(ctx, i.x));
+        break;
+
+    case OP_LEGATO:
+        ctx->legato = i.a;
+        break;
+
+    case OP_CHORD:
+        ctx->chord = i.a;
+        if (ctx->chord)
+            ctx->tones = 0;
+        else
+            ctx->offset += ctx->step;
+        break;
+
+    case OP_REPEAT:
+        ctx->repeat_count = i.x;
+        break;
+
+    case OP_LOOP:
+        ctx->repeat_count = -1;
+        break;
+
+    case OP_CALL:
+        call(t, i.x);
+        break;
+
+    case OP_RET:
+        ret(t);
+        break;
+
+    case OP_EOF:
+        emit(t, translate_eof(ctx));
+        break;
+
+    case OP_VOICES:
+        open_voices(t);
+        break;
+
+    case OP_VOICE:
+        next_voice(t);
+        break;
+
+    case OP_MERGE:
+        merge_voices(t);
+        break;
+
+    case OP_SKIP:
+        if (i.x & SKIP_NOTE) {
+            ctx->channel = i.a;
+            ctx->last_note = translate_note(ctx, i);
+            ctx->has_last_note = true;
+            ctx->prev_tone = NO_EVENT;
+            ctx->did_rest = false;
+        }
+        if (i.x & SKIP_REST)
+            ctx->did_rest = true;
+        break;
 
-        if (ctx->prev_tone != NULL && !ctx->did_rest)
-            ctx->prev_tone->e.data.note.duration += d;
-        ctx->offset += d;
+    case OP_HALT:
+    default:
+        t->pc--;
+        if (t->more)
+            t->waiting = true;
+        else
+            t->passed = true;
         break;
     }
+}
 
-    case NODE_TYPE_CONTROLLER:
-    {
-        snd_seq_event_t e = translate_controller(ctx, n->u.controller);
-        struct event_list *entry = new_event_list(e);
+// ready returns index of the first event which is not final yet.
+size_t ready(struct translator *t) {
+    struct context *ctx = &t->ctx;
+    size_t end = ctx->base + ctx->events->size;
+
+    if (t->loop_end != NO_EVENT && t->loop_end + 1 < end)
+        end = t->loop_end + 1;
+    if (t->passed)
+        return end;
+    if (ctx->prev_tone != NO_EVENT && ctx->prev_tone + 1 - ctx->tones < end)
+        end = ctx->prev_tone + 1 - ctx->tones;
+    if (t->voices.open && t->voices.start < end)
+        end = t->voices.start;
+    for (size_t i = 0; t->dry_runs > 0 && i < t->depth; i++) {
+        if (t->frames[i].dry_run && t->frames[i].start < end)
+            end = t->frames[i].start;
+    }
+    return end;
+}
 
-        return entry;
+// loop_is_final returns true if nothing can change the closed loop anymore.
+bool loop_is_final(struct translator *t) {
+    if (t->loop_end == NO_EVENT || t->ctx.prev_tone == t->loop_end)
+        return false;
+    for (size_t i = 0; t->dry_runs > 0 && i < t->depth; i++) {
+        if (t->frames[i].dry_run && t->frames[i].start <= t->loop_end)
+            return false;
     }
+    return true;
+}
 
-    case NODE_TYPE_PROGRAM:
-    {
-        snd_seq_event_t e = translate_program(ctx, n->u.program);
-        struct event_list *entry = new_event_list(e);
+// compact drops the released events which are not needed for the loop.
+void compact(struct translator *t) {
+    struct context *ctx = &t->ctx;
+    size_t keep = t->released;
+
+    if (t->loop_start != NO_EVENT && t->loop_start < keep)
+        keep = t->loop_start;
+    if (t->segment.count > 0 && t->segment.start < keep)
+        keep = t->segment.start;
+    for (size_t i = 0; i < t->depth; i++) {
+        if (t->frames[i].loop_first != NO_EVENT && t->frames[i].loop_first < keep)
+            keep = t->frames[i].loop_first;
+        if ((t->frames[i].shared || t->frames[i].record) && t->frames[i].start < keep)
+            keep = t->frames[i].start;
+    }
+
+    size_t n = keep - ctx->base;
 
-        return entry;
+    // Move only if it frees at least a half of the window
+    if (n == 0 || n * 2 < ctx->events->size)
+        return;
+    memmove(ctx->events->events, &ctx->events->events[n], (ctx->events->size - n) * sizeof (snd_seq_event_t));
+    ctx->events->size -= n;
+    ctx->base += n;
+}
+
+struct translator *new_translator(struct bytecode *b) {
+    struct translator *t = calloc(1, sizeof (struct translator));
+
+    if (t == NULL)
+        return NULL;
+
+    struct event_buffer *events = new_event_buffer(0);
+
+    if (events == NULL) {
+        free(t);
+        return NULL;
     }
 
-    case NODE_TYPE_DIVIDER:
-        // No action for divider
-        break;
+    t->templates = calloc(b->n_functions + 1, sizeof (struct template));
+    if (t->templates == NULL) {
+        free_event_buffer(events);
+        free(t);
+        return NULL;
+    }
+    t->n_templates = b->n_functions + 1;
+
+    t->b = b;
+    t->pc = b->entry;
+    t->ctx = init_context(events, b->ppq);
+    t->loop_start = NO_EVENT;
+    t->loop_end = NO_EVENT;
+    t->replay = NO_EVENT;
+    t->end = NO_ADDRESS;
+    return t;
+}
 
-    case NODE_TYPE_LEGATO:
-    {
-        ctx->legato = true;
-        struct event_list *list = NULL;
+void free_translator(struct translator *t) {
+    if (t == NULL)
+        return;
+    for (size_t i = 0; i < t->n_templates; i++)
+        free(t->templates[i].events);
+    free(t->templates);
+    free(t->voices.runs);
+    free(t->voices.heap);
+    free(t->voices.scratch);
+    for (size_t i = 0; i < t->cycles.n; i++)
+        free(t->cycles.all[i].events);
+    free(t->cycles.all);
+    free(t->cycles.heap);
+    free_event_buffer(t->ctx.events);
+    free(t->frames);
+    free(t);
+}
 
-        for (size_t i = 0; i < n->n; i++) {
-            if (i == (n->n - 1))
-                ctx->legato = false; // Legato is turned off on the last element
-            struct event_list *part = _translate(ctx, n->nodes[i]);
+// play_cycles hands out up to `n` events of the window up to `end` and of
+// the cycles, whichever comes first. Without `replay` every cycle is played
+// once.
+size_t play_cycles(struct translator *t, struct event_buffer *out, size_t n, size_t end, bool replay) {
+    struct context *ctx = &t->ctx;
+    struct cycles *c = &t->cycles;
+    size_t moved = 0;
+
+    for (; moved < n && (t->released < end || c->n_heap > 0); moved++) {
+        struct cycle *top = c->n_heap > 0 ? &c->all[c->heap[0]] : NULL;
+
+        if (t->released < end &&
+          (top == NULL || get_event(ctx, t->released)->time.tick <= top->events[top->next].time.tick + top->shift)) {
+            if (event_buffer_append(out, *get_event(ctx, t->released)) == NO_EVENT) {
+                t->failed = true;
+                break;
+            }
+            t->released++;
+            continue;
+        }
+
+        snd_seq_event_t e = top->events[top->next];
+
+        e.time.tick += top->shift;
+        if (event_buffer_append(out, e) == NO_EVENT) {
+            t->failed = true;
+            break;
+        }
+        if (++top->next == top->size) {
+            top->next = top->loop;
+            top->shift += top->length;
 
-            list = list_append(list, part);
+            // A loop of no length would never let the others play
+            if (!replay || top->loop == top->size || top->length == 0)
+                c->heap[0] = c->heap[--c->n_heap];
         }
-        return list;
+        sift_cycles(c, 0);
     }
+    return moved;
+}
 
-    case NODE_TYPE_SHEET:
-    {
-        // Namespace and reference handling
-        if (isNotEmpty(n->u.sheet->label) && !ctx->referencing) {
-            ctx->namespace = list_append(ctx->namespace, new_namespace(n->u.sheet->label));
-            char *label = get_label(ctx->namespace);
-            struct sheet_reference *r = new_sheet_reference(n, label, ctx->divider);
+size_t pull(struct translator *t, struct event_buffer *out, size_t n, bool replay) {
+    struct context *ctx = &t->ctx;
+    size_t moved = 0;
+
+    while (moved < n && !t->failed) {
+        size_t end = ready(t);
+
+        // Loops of voices play alongside the rest of the window
+        if (t->cycles.n > 0 && t->passed) {
+            moved += play_cycles(t, out, n - moved, end, replay);
+            break;
+        }
+
+        for (; t->released < end && moved < n; t->released++, moved++) {
+            if (event_buffer_append(out, *get_event(ctx, t->released)) == NO_EVENT) {
+                t->failed = true;
+                return moved;
+            }
+        }
+        if (moved == n)
+            break;
+
+        // Iterations past the closed loop are never played
+        if (t->segment.count > 0 && t->passed)
+            t->segment.count = 0;
+        if (t->segment.count > 0) {
+            moved += expand(t, out, n - moved);
+            continue;
+        }
 
-            ctx->sheets = list_append(ctx->sheets, r);
+        if (t->waiting)
+            break;
+        if (!t->passed) {
+            step(t);
+            if (loop_is_final(t))
+                t->passed = true;
+            if (ctx->events->size >= DEFAULT_BUFFER_CAPACITY)
+                compact(t);
+            continue;
         }
 
-        // Loop preparations
-        bool loop = false;
-        bool dry_run = false;
-        bool first_to_loop = false;
-        int count = n->u.sheet->repeat_count;
-
-        // Loop is indicated by negative number of repeat_count
-        if (count < 0) {
-            count = 1;
-            loop = true;
-        } else if (count == 0) {
-            count = 1;
-            dry_run = true;
+        // Whole tree is translated, play the loop over and over
+        if (!replay || t->loop_end == NO_EVENT)
+            break;
+        if (t->replay == NO_EVENT || t->replay > t->loop_end) {
+            t->replay = t->loop_start;
+            t->replay_offset += t->loop_offset;
         }
+        for (; t->replay <= t->loop_end && moved < n; t->replay++, moved++) {
+            snd_seq_event_t e = *get_event(ctx, t->replay);
 
-        unsigned int old_offset = ctx->offset;
-        double d = ctx->divider;
-
-        struct event_list *list = NULL;
-
-        for (size_t i = 0; i < count; i++) {
-            for (size_t j = 0; j < n->n; j++) {
-                double duration = n->u.sheet->duration;
-                int units = n->u.sheet->units;
-
-                ctx->divider = d * (duration / (double) units);
-                struct event_list *part = _translate(ctx, n->nodes[j]);
-
-                if (dry_run) {
-                    list_apply(part, free);
-                    continue;
-                };
-
-                // Loop flag for this sheet and first element
-                if (loop && !first_to_loop) {
-                    if (part != NULL) {
-                        part->start_loop = true;
-                        first_to_loop = true;
-                    }
-                }
-
-                // Loop flag for this sheet and last element
-                if (loop && j == (n->n - 1)) {
-                    if (ctx->prev_tone != NULL) {
-                        ctx->prev_tone->end_loop = true;
-                        ctx->prev_tone->loop_offset = ctx->offset - old_offset;
-                    }
-                }
-
-                list = list_append(list, part);
+            e.time.tick += t->replay_offset;
+            if (event_buffer_append(out, e) == NO_EVENT) {
+                t->failed = true;
+                return moved;
             }
         }
+    }
+
+    compact(t);
+    return moved;
+}
+
+size_t translator_pull(struct translator *t, struct event_buffer *out, size_t n) {
+    return pull(t, out, n, true);
+}
+
+bool translator_waiting(struct translator *t) {
+    return !t->passed && t->more && t->depth == 0 && t->b->code[t->pc].op == OP_HALT;
+}
+
+unsigned int translator_ppq(struct translator *t) {
+    return t->b->ppq;
+}
+
+int translator_bpm(struct translator *t) {
+    return t->b->bpm;
+}
+
+bool translator_failed(struct translator *t) {
+    return t->failed;
+}
 
-        if (dry_run)
-            ctx->offset = old_offset;
-        if (isNotEmpty(n->u.sheet->label) && !ctx->referencing)
-            ctx->namespace = list_drop_apply(ctx->namespace, free);
+bool translator_resume(struct translator *t, const size_t *map, size_t n_map, bool more) {
+    size_t n = t->b->n_functions + 1;
 
-        ctx->divider = d;
-        return list;
+    // Templates follow their functions, the dropped ones go
+    for (size_t i = 0; map != NULL && i < n_map; i++) {
+        if (map[i] == NO_FUNCTION) {
+            free(t->templates[i].events);
+        } else if (map[i] != i) {
+            t->templates[map[i]] = t->templates[i];
+        }
+        if (map[i] != i)
+            t->templates[i] = (struct template) { 0 };
     }
 
-    case NODE_TYPE_REFERENCE:
-    {
-        struct sheet_reference *r = list_find(ctx->sheets, find_label_in_sheet_reference, n->u.reference->label);
-
-        if (r != NULL) {
-
-            // Loop preparations
-            bool loop = false;
-            bool dry_run = false;
-            bool first_to_loop = false;
-            int count = n->u.reference->repeat_count;
-
-            if (count < 0) {
-                count = 1;
-                loop = true;
-            } else if (count == 0) {
-                count = 1;
-                dry_run = true;
-            }
+    if (n > t->n_templates) {
+        void *ptr = realloc(t->templates, n * sizeof (struct template));
 
-            unsigned int old_offset = ctx->offset;
+        if (ptr == NULL)
+            return false;
+        t->templates = ptr;
+        memset(&t->templates[t->n_templates], 0, (n - t->n_templates) * sizeof (struct template));
+        t->n_templates = n;
+    }
 
-            ctx->referencing = true;
-            double d = ctx->divider;
+    t->pc = t->b->entry;
+    t->more = more;
+    t->waiting = false;
+    return true;
+}
 
-            struct event_list *list = NULL;
+// span is what the first pass of translate_parts knows about a function: its
+// length in ticks, unless it loops.
+struct span {
+    unsigned int length;
+    bool loops;
+    bool done;
+};
 
-            for (size_t i = 0; i < count; i++) {
-                for (size_t j = 0; j < r->node->n; j++) {
+// cursor is where the first pass is in a run of code.
+struct cursor {
+    unsigned int offset;
+    int repeat; // Iterations of the next CALL
+    bool voices; // Within voices
+    bool chord; // Within a chord, tones don't move the offset
+    unsigned int start; // Offset the voices start at
+    unsigned int end; // End of the longest voice so far
+};
 
-                    // Reset value on each iteration
-                    ctx->divider = r->divider * (r->node->u.sheet->duration / (double) r->node->u.sheet->units);
-                    struct event_list *part = _translate(ctx, r->node->nodes[j]);
+void measure(struct bytecode *b, struct span *spans, size_t function);
 
-                    if (dry_run) {
-                        list_apply(part, free);
-                        continue;
-                    };
+// advance_cursor moves the cursor past the instruction as running it would.
+// Function returns false if the instruction loops.
+bool advance_cursor(struct bytecode *b, struct span *spans, struct instruction i, unsigned int step, struct cursor *c) {
+    switch (i.op) {
+    case OP_NOTE:
+    case OP_INTERVAL:
+        if (!c->chord)
+            c->offset += step;
+        break;
 
-                    // Loop flag for this sheet and first element
-                    if (loop && !first_to_loop) {
-                        if (part != NULL) {
-                            part->start_loop = true;
-                            first_to_loop = true;
-                        }
-                    }
+    case OP_REST:
+    case OP_TIE:
+        c->offset += step;
+        break;
 
-                    // Loop flag for this sheet and last element/note
-                    if (loop && j == (r->node->n - 1)) {
-                        if (ctx->prev_tone != NULL) {
-                            ctx->prev_tone->end_loop = true;
-                            ctx->prev_tone->loop_offset = ctx->offset - old_offset;
-                        }
-                    }
+    case OP_CHORD:
+        c->chord = i.a;
+        if (!c->chord)
+            c->offset += step;
+        break;
 
-                    list = list_append(list, part);
-                }
-            }
+    case OP_REPEAT:
+        c->repeat = i.x;
+        break;
 
-            if (dry_run)
-                ctx->offset = old_offset;
-            ctx->divider = d;
-            ctx->referencing = false;
-            return list;
-        }
+    case OP_LOOP:
+        return false;
+
+    case OP_CALL:
+        if (!spans[i.x].done)
+            measure(b, spans, i.x);
+        if (spans[i.x].loops)
+            return false;
+        c->offset += spans[i.x].length * (unsigned int) c->repeat;
+        c->repeat = 1;
         break;
-    }
 
-    case NODE_TYPE_CRATE:
-    {
-        struct event_list *list = NULL;
+    case OP_VOICES:
+        c->voices = true;
+        c->start = c->offset;
+        c->end = c->offset;
+        break;
+
+    case OP_VOICE:
+    case OP_MERGE:
+        if (c->offset > c->end)
+            c->end = c->offset;
+        c->offset = i.op == OP_VOICE ? c->start : c->end;
+        c->voices = i.op == OP_VOICE;
+        break;
+    }
+    return true;
+}
 
-        for (size_t i = 0; i < n->n; i++) {
-            struct event_list *part = _translate(ctx, n->nodes[i]);
+void measure(struct bytecode *b, struct span *spans, size_t function) {
+    struct function *fn = &b->functions[function];
+    struct span *s = &spans[function];
+    struct cursor c = {.repeat = 1};
 
-            list = list_append(list, part);
+    s->done = true;
+    for (size_t pc = fn->address; b->code[pc].op != OP_RET; pc++) {
+        if (!advance_cursor(b, spans, b->code[pc], fn->step, &c)) {
+            s->loops = true;
+            return;
         }
-        return list;
     }
+    s->length = c.offset;
+}
 
-    case NODE_TYPE_EOF:
-    {
-        snd_seq_event_t e = translate_eof(ctx);
+// part is a run of top level code from `start` up to `end` translated on its
+// own, starting at `offset`.
+struct part {
+    struct bytecode *b;
+    size_t start;
+    size_t end;
+    unsigned int offset;
+    struct event_buffer *events;
+};
 
-        return new_event_list(e);
+void *translate_part(void *arg) {
+    struct part *p = arg;
+    struct translator *t = new_translator(p->b);
+
+    p->events = new_event_buffer(0);
+    if (t == NULL || p->events == NULL) {
+        free_event_buffer(p->events);
+        free_translator(t);
+        p->events = NULL;
+        return NULL;
+    }
+    t->pc = p->start;
+    t->end = p->end;
+    t->ctx.offset = p->offset;
+
+    // Only the first pass; a loop would go on forever
+    while (pull(t, p->events, DEFAULT_BUFFER_CAPACITY, false) > 0) ;
+    if (t->failed) {
+        free_event_buffer(p->events);
+        free_translator(t);
+        p->events = NULL;
+        return NULL;
     }
 
-    case NODE_TYPE_UNKNOWN:
-    default:
-        break;
+    // Indices in the output count the expanded events too
+    if (t->loop_end != NO_EVENT) {
+        p->events->loop_start = t->loop_start + t->loop_expanded;
+        p->events->loop_end = t->loop_end + t->loop_expanded;
+        p->events->loop_offset = t->loop_offset;
     }
 
+    free_translator(t);
     return NULL;
 }
 
-bool sort_by_tick(void *e1, void *e2) {
-    struct event_list
-    *event1 = e1, *event2 = e2;
+// cut_code cuts the top level code into at most `n` parts of about the same
+// length in ticks and returns how many there are. A part starts only with a
+// call of a pure function, which reads nothing the code before leaves but the
+// offset, so the parts can be translated at once. Everything from the first
+// loop on is one part, its length is not known.
+size_t cut_code(struct bytecode *b, size_t n, struct part *parts) {
+    struct span *spans = calloc(b->n_functions + 1, sizeof (struct span));
 
-    return event1->e.time.tick > event2->e.time.tick;
-}
+    if (spans == NULL)
+        return 0;
 
-struct event_list *translate(struct node n) {
-    struct context ctx = init_context();
-    struct event_list *events = _translate(&ctx, &n);
+    struct cursor c = {.repeat = 1};
+    size_t end = b->entry;
 
-    bool is_loop = false;
-    list_apply_ctx(events, free_after_loop, &is_loop);
-    list_apply(ctx.sheets, free_sheet_reference);
-    return events;
+    // Length of the code up to the first loop
+    while (b->code[end].op != OP_HALT && advance_cursor(b, spans, b->code[end], b->ppq * 4, &c))
+        end++;
+
+    unsigned int total = c.offset;
+    size_t count = 1;
+
+    parts[0] = (struct part) {.b = b,.start = b->entry,.end = NO_ADDRESS,.offset = 0};
+    c = (struct cursor) {.repeat = 1};
+    for (size_t pc = b->entry; pc < end && count < n; pc++) {
+        struct instruction i = b->code[pc];
+
+        // Voices are merged by one translator
+        if (i.op == OP_CALL && c.repeat > 0 && !c.voices && b->functions[i.x].pure && c.offset >= total / n * count) {
+            size_t start = pc > b->entry && b->code[pc - 1].op == OP_REPEAT ? pc - 1 : pc;
+
+            if (start > parts[count - 1].start) {
+                parts[count - 1].end = start;
+                parts[count++] = (struct part) {.b = b,.start = start,.end = NO_ADDRESS,.offset = c.offset};
+            }
+        }
+        advance_cursor(b, spans, i, b->ppq * 4, &c);
+    }
+
+    free(spans);
+    return count;
 }
 
-int letter_value(char letter) {
-    switch (letter) {
-    case 'C':
-    case 'c':
-        return 0;
-    case 'D':
-    case 'd':
-        return 2;
-    case 'E':
-    case 'e':
-        return 4;
-    case 'F':
-    case 'f':
-        return 5;
-    case 'G':
-    case 'g':
-        return 7;
-    case 'A':
-    case 'a':
-        return 9;
-    case 'B':
-    case 'b':
-        return 11;
-    }
-    // unreachable
-    assert(0);
-    return -1;
-}
-
-unsigned char midi_value(struct note *n) {
-    int offset = 0;
-    size_t len = strlen(n->accidental);
-
-    for (size_t i = 0; i < len; i++) {
-        if (n->accidental[i] == '#') {
-            offset++;
-        } else if (n->accidental[i] == 'b') {
-            offset--;
+// run_parts translates every part, the first one right here and the rest in
+// threads of their own, or here too when a thread won't start.
+void run_parts(struct part *parts, size_t n) {
+    pthread_t threads[MAX_PARTS];
+    bool started[MAX_PARTS] = { false };
+
+    for (size_t i = 1; i < n; i++)
+        started[i] = pthread_create(&threads[i], NULL, translate_part, &parts[i]) == 0;
+    translate_part(&parts[0]);
+    for (size_t i = 1; i < n; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            translate_part(&parts[i]);
+    }
+}
+
+struct event_buffer *translate_parts(struct bytecode *b, size_t n) {
+    struct part parts[MAX_PARTS];
+
+    if (n > MAX_PARTS)
+        n = MAX_PARTS;
+    if (n < 1)
+        n = 1;
+    n = cut_code(b, n, parts);
+    if (n == 0)
+        return NULL;
+    run_parts(parts, n);
+
+    // Parts follow the first one, the loop is in the last one if any
+    struct event_buffer *events = parts[0].events;
+    size_t size = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        if (parts[i].events == NULL)
+            events = NULL;
+        else
+            size += parts[i].events->size;
+    }
+    if (events != NULL && size > events->capacity) {
+        void *ptr = realloc(events->events, size * sizeof (snd_seq_event_t));
+
+        if (ptr == NULL) {
+            events = NULL;
+        } else {
+            events->events = ptr;
+            events->capacity = size;
         }
     }
-    unsigned int octave = 12 * n->octave;
 
-    return letter_value(n->letter) + offset + octave;
+    for (size_t i = 1; i < n; i++) {
+        struct event_buffer *part = parts[i].events;
+
+        if (events != NULL) {
+            if (event_buffer_is_loop(part)) {
+                events->loop_start = events->size + part->loop_start;
+                events->loop_end = events->size + part->loop_end;
+                events->loop_offset = part->loop_offset;
+            }
+            memcpy(&events->events[events->size], part->events, part->size * sizeof (snd_seq_event_t));
+            events->size += part->size;
+        }
+        free_event_buffer(part);
+    }
+
+    if (events == NULL)
+        free_event_buffer(parts[0].events);
+    return events;
 }
 
-snd_seq_event_t translate_note(struct context *ctx, struct note *n) {
+struct event_buffer *translate(struct bytecode *b) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
 
-    unsigned int tick = compute_duration(ctx->divider);
+    return translate_parts(b, processors > 1 ? processors : 1);
+}
+
+// Duration of the sounding part of a tone. Tones are apart by a 24th of a
+// quarter, unless they are shorter, tones of a legato overlap by a 96th.
+unsigned int tone_duration(struct context *ctx) {
+    unsigned int tick = ctx->step;
 
     if (ctx->legato) {
-        tick++;
-    } else {
-        tick -= 4;
+        tick += ctx->ppq / 96;
+    } else if (tick > ctx->ppq / 24) {
+        tick -= ctx->ppq / 24;
     }
+    return tick;
+}
 
-    unsigned char velocity = (double) n->velocity / 9. * 127.;
+snd_seq_event_t translate_note(struct context *ctx, struct instruction i) {
 
     snd_seq_event_t e;
 
     snd_seq_ev_clear(&e);
     snd_seq_ev_set_subs(&e);
     snd_seq_ev_schedule_tick(&e, 0, 0, ctx->offset);
-    snd_seq_ev_set_note(&e, n->channel, midi_value(n), velocity, tick);
+    snd_seq_ev_set_note(&e, i.a, i.b, i.c, tone_duration(ctx));
     return e;
 }
 
-snd_seq_event_t translate_interval(struct context *ctx, snd_seq_event_t event, struct interval *i) {
-
-    unsigned int tick = compute_duration(ctx->divider);
-
-    if (ctx->legato) {
-        tick++;
-    } else {
-        tick -= 4;
-    }
+snd_seq_event_t translate_interval(struct context *ctx, snd_seq_event_t event, struct instruction i) {
 
     snd_seq_event_t e = event;
 
     snd_seq_ev_schedule_tick(&e, 0, 0, ctx->offset);
-    if (e.data.note.note + i->value >= 0) {
-        e.data.note.note += i->value;
+    if (e.data.note.note + i.x >= 0) {
+        e.data.note.note += i.x;
     }
-    e.data.note.duration = tick;
+    e.data.note.duration = tone_duration(ctx);
     return e;
 }
 
-snd_seq_event_t translate_controller(struct context *ctx, struct controller *c) {
+snd_seq_event_t translate_controller(struct context *ctx, struct instruction i) {
 
     snd_seq_event_t e;
 
@@ -562,12 +1458,12 @@ snd_seq_event_t translate_controller(struct context *ctx, struct controller *c)
     snd_seq_ev_schedule_tick(&e, 0, 0, ctx->offset);
     e.type = SND_SEQ_EVENT_CONTROLLER;
     e.data.control.channel = ctx->channel;
-    e.data.control.param = c->param;
-    e.data.control.value = c->value;
+    e.data.control.param = i.x;
+    e.data.control.value = i.y;
     return e;
 }
 
-snd_seq_event_t translate_program(struct context *ctx, struct program *p) {
+snd_seq_event_t translate_program(struct context *ctx, struct instruction i) {
 
     snd_seq_event_t e;
 
@@ -576,7 +1472,7 @@ snd_seq_event_t translate_program(struct context *ctx, struct program *p) {
     snd_seq_ev_schedule_tick(&e, 0, 0, ctx->offset);
     e.type = SND_SEQ_EVENT_PGMCHANGE;
     e.data.control.channel = ctx->channel;
-    e.data.control.value = p->value;
+    e.data.control.value = i.x;
     return e;
 }
 
@@ -601,21 +1497,23 @@ snd_seq_event_t translate_tempo(struct context *ctx, unsigned int tempo) {
     return e;
 }
 
-void print_event(struct event_list *l, FILE * f) {
+void print_event(struct event_buffer *b, size_t index, FILE * f) {
 
-    snd_seq_event_t e = l->e;
+    snd_seq_event_t e = b->events[index];
 
     switch (e.type) {
     case SND_SEQ_EVENT_NOTE:
     {
         snd_seq_ev_note_t n = e.data.note;
+        bool start_loop = event_buffer_is_loop(b) && index == b->loop_start;
+        bool end_loop = event_buffer_is_loop(b) && index == b->loop_end;
         char *loop = "";
 
-        if (l->start_loop && l->end_loop) {
+        if (start_loop && end_loop) {
             loop = "L-START-END ";
-        } else if (l->start_loop) {
+        } else if (start_loop) {
             loop = "L-START ";
-        } else if (l->end_loop) {
+        } else if (end_loop) {
             loop = "L-END ";
         }
 
@@ -641,10 +1539,10 @@ void print_event(struct event_list *l, FILE * f) {
     }
 }
 
-void print_events(struct event_list *l, FILE * f) {
-    print_event(l, f);
-    if (l->l.next != NULL) {
-        fprintf(f, " ");
-        print_events(l->l.next, f);
+void print_events(struct event_buffer *b, FILE * f) {
+    for (size_t i = 0; i < b->size; i++) {
+        if (i > 0)
+            fprintf(f, " ");
+        print_event(b, i, f);
     }
 }
@@ -4,18 +4,82 @@
 #include <stdbool.h>
 #include <alsa/asoundlib.h>
 
-#include "list.h"
+#include "compiler.h"
 #include "parser.h"
 
-struct event_list {
-    struct list l;
-    snd_seq_event_t e;
-    bool start_loop;
-    bool end_loop;
+// NO_EVENT marks an unset index into the event buffer.
+#define NO_EVENT ((size_t) -1)
+
+// event_buffer is a contiguous array of translated events. The loop, if any,
+// is stored as indices; playback continues from `loop_start` after
+// `loop_end` with ticks shifted by `loop_offset`.
+struct event_buffer {
+    snd_seq_event_t *events;
+    size_t size;
+    size_t capacity;
+    size_t loop_start;
+    size_t loop_end;
     unsigned int loop_offset;
 };
 
-struct event_list *translate(struct node n);
+struct event_buffer *new_event_buffer(size_t capacity);
+void free_event_buffer(struct event_buffer *b);
+
+// event_buffer_append copies `e` at the end of the buffer growing it when
+// needed. Function returns index of the new event or NO_EVENT on failure.
+size_t event_buffer_append(struct event_buffer *b, snd_seq_event_t e);
+
+// event_buffer_is_loop returns true if the buffer ends with a loop.
+bool event_buffer_is_loop(struct event_buffer *b);
+
+// translator runs the bytecode and turns it into events on demand.
+struct translator;
+
+// new_translator prepares translation of `b`. The bytecode is not owned by the
+// translator and has to outlive it.
+struct translator *new_translator(struct bytecode *b);
+void free_translator(struct translator *t);
+
+// translator_pull appends up to `n` next events to `out` and returns their
+// number. A loop is played over and over, so only a score without a loop ever
+// runs dry. Loops of voices go on side by side, each with its own period.
+// Fewer events are pulled when out of memory too, see translator_failed.
+size_t translator_pull(struct translator *t, struct event_buffer *out, size_t n);
+
+// translator_failed returns true if the translator ran out of memory. The
+// events pulled so far are incomplete and no more follow.
+bool translator_failed(struct translator *t);
+
+// translator_waiting returns true if the translator stopped at the end of the
+// code compiled so far and waits for more. The last tone is kept back then, a
+// tie of the next piece may still extend it.
+bool translator_waiting(struct translator *t);
+
+// translator_resume goes on at the entry of the bytecode once the translator
+// is waiting or before it started. If the bytecode has been pruned, `map`
+// gives the new index of the `n_map` old functions. With `more` set the
+// translator waits at the next HALT instead of finishing the score. Function
+// returns false when out of memory.
+bool translator_resume(struct translator *t, const size_t *map, size_t n_map, bool more);
+
+// translator_ppq returns the ticks in a quarter note the events are timed in.
+unsigned int translator_ppq(struct translator *t);
+
+// translator_bpm returns the tempo of a bpm statement at tick 0, 0 if there is
+// none.
+int translator_bpm(struct translator *t);
+
+// translate translates the whole score at once, or returns NULL when out of
+// memory. A loop is translated only once and marked in the buffer. Voices with
+// loops are translated once each, merged by tick and left unmarked. Parts of
+// the top level code are translated at the same time, one per processor.
+struct event_buffer *translate(struct bytecode *b);
+
+// translate_parts translates the score as translate does in at most `n`
+// parts. A first pass finds the offset each top level call starts at; parts
+// start with calls of pure sheets, which depend on nothing else, and run on
+// threads of their own into buffers joined in order.
+struct event_buffer *translate_parts(struct bytecode *b, size_t n);
 
 // debug functions
-void print_events(struct event_list *l, FILE * f);
+void print_events(struct event_buffer *b, FILE * f);